@@ -12,6 +12,7 @@
  * (Everything after this point will use your custom allocator -- be careful!)
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
 #include <sys/mman.h>
@@ -19,8 +20,18 @@
 #include <stdbool.h>
 #include <assert.h>
 #include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <math.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
 #include "allocator.h"
 #include "debug.h"
+#include "new.h"
 
 /**
  * Prints the pointer number as the text output.
@@ -81,588 +92,5749 @@ void write_unsigned(FILE *fp, size_t num) {
 }
 
 /**
- * Prints out the current memory state, including both the regions and blocks.
- * Entries are printed in order, so there is an implied link from the topmost
- * entry to the next, and so on.
- * @param fp - output stream to print the memory state to.
+ * Finds the region a block belongs to.
+ * @param block - header of the block.
+ * @returns header of the region.
  */
-void write_memory(FILE *fp)
+static struct mem_region *block_region(const struct mem_block *block)
 {
-    fputs("-- Current Memory State --\n", fp);
-
-    struct mem_block *current_block = g_head;
-    while (current_block != NULL) {
-        if (current_block->region_start == current_block) {
-            fputs("[REGION] ", fp);
-            write_pointer(fp, current_block);
-            fputc('-', fp);
-            write_pointer(fp,((void *) current_block) + current_block->region_size);
-            fputc(' ', fp);
-            write_unsigned(fp, current_block->region_size);
-            fputc('\n', fp);
-        }
-
-        fputs("[BLOCK]  ", fp);
-        write_pointer(fp, current_block);
-        fputc('-', fp);
-        write_pointer(fp,
-                ((void *) current_block) + current_block->region_size);
-        fputs(" (", fp);
-        write_unsigned(fp, current_block->alloc_id);
-        fputs(") '", fp);
-        fputs(current_block->name, fp);
-        fputs("' ", fp);
-        write_unsigned(fp, current_block->size);
-        fputc(' ', fp);
-        write_unsigned(fp, current_block->usage);
-        fputc(' ', fp);
-        write_unsigned(fp, current_block->usage == 0
-                ? 0 : current_block->usage - sizeof(struct mem_block));
-        fputc('\n', fp);
-        current_block = current_block->next;
-    }
+    return (struct mem_region *) (((char *) block)
+            - (size_t) block->region_offset * MEM_UNIT);
 }
 
 /**
- * Prints out the current memory state, including both the regions and blocks.
- * Entries are printed in order, so there is an implied link from the topmost
- * entry to the next, and so on.
- * The data is written into standard output stream.
- * @see write_memory for more generic version.
+ * Finds the first block of a region, which follows the region header.
+ * @param region - header of the region.
+ * @returns header of the first block.
  */
-void print_memory(void)
+static struct mem_block *region_first(struct mem_region *region)
 {
-    /* Use more generic version */
-    /* Creates file mem.txt in viz folder*/
-    /* Uncomment this to visualize */
-    //    FILE *fp = fopen("tests/viz/mem.txt", "w");
-    //    write_memory(fp);
-    
-    write_memory(stdout);
+    return (struct mem_block *) (region + 1);
 }
 
 /**
- * Finds the block that can be used as or split to hold the new block
- * Uses First-Fit memory allocation (first valid block is chosen).
- * @param size - full size of the block which is allocated (including header).
- * @returns pointer to the header of the block that has enough free space,
- *          or NULL if not found.
+ * Finds the block that follows another one in memory.
+ * @param block - header of the block.
+ * @returns header of the next block, or NULL if the block ends its region.
  */
-struct mem_block *first_fit(size_t size)
+static struct mem_block *block_next(struct mem_block *block)
 {
-    struct mem_block *current = g_head;
+    struct mem_region *region = block_region(block);
+    char *next = ((char *) block) + (size_t) block->size * MEM_UNIT;
 
-    /* Check if any blocks are allocated */
-    if (current == NULL) {
+    if ((region->flags & REGION_LARGE)
+            || next >= ((char *) region) + region->size) {
         return NULL;
     }
-
-    /* Find the free block that we should use */
-    while (current != NULL) {
-        if (current->size >= size + current->usage) {
-            return current;
-        }
-        current = current->next;
-    }
-
-    /* If code reaches here, no blocks could be split */
-    return NULL;
+    return (struct mem_block *) next;
 }
 
 /**
- * Finds the block that can be used as is (or split) to hold the new block 
- * of some size. 
- * Uses Best-Fit memory allocation 
- * (valid block with the least extra space is chosen).
- * @param size - full size of the block which is allocated (including header).
- * @returns pointer to the header of the block that have enough free space, 
- *          or NULL if not found.
+ * Computes the full size of a block holding a data area of the given size.
+ * @param size - size of the data area.
+ * @returns size in bytes, rounded to whole MEM_UNITs, including the header.
  */
-struct mem_block *best_fit(size_t size)
+static size_t block_size_for(size_t size)
 {
-    struct mem_block *current = g_head, *best = NULL;
+    return (size + MEM_UNIT - 1) / MEM_UNIT * MEM_UNIT
+        + sizeof(struct mem_block);
+}
 
-    /* Check if any blocks are allocated */
-    if (current == NULL) {
-        return NULL;
-    }
+/**
+ * Records that the used part of a block may no longer hold zeros.
+ * Must be called whenever the usage of a block grows.
+ * @param block - header of the block.
+ */
+static void region_touch(struct mem_block *block)
+{
+    struct mem_region *region = block_region(block);
+    size_t end = ((size_t) block->region_offset + block->usage) * MEM_UNIT;
 
-    /* Find the free block that we should use */
-    while (current != NULL) {
-        if (current->size >= size + current->usage) {
-            /* We found the suitable block, now check if it's best */
-            if (best == NULL || current->size - current->usage < 
-                    best->size - best->usage) {
-                best = current;
-            }
-        }
-        current = current->next;
+    if (end > region->clean) {
+        region->clean = end;
     }
-
-    /* Return the best block (possibly NULL if not found) */
-    return best;
 }
 
 /**
- * Finds the block that can be used as or split to hold the new block
- * Uses same logic as Best-Fit memory allocation
- * (valid block with most extra space is chosen).
- * @param size - full size of the block which is allocated (including header).
- * @returns pointer to the header of the block that have enough free space, 
- *          or NULL if not found.
+ * Finds the arena a block belongs to.
+ * @param block - header of the block.
+ * @returns the owning arena.
  */
-struct mem_block *worst_fit(size_t size)
+static struct arena *block_arena(const struct mem_block *block)
 {
-    struct mem_block *current = g_head, *worst = NULL;
+    return block_region(block)->arena;
+}
 
-    /* Check if any blocks are allocated */
-    if (current == NULL) {
-        return NULL;
-    }
+/**
+ * Computes the usable size of a block's data area.
+ * @param block - header of the block; not a slab object.
+ * @returns usable size in bytes.
+ */
+static size_t block_usable(const struct mem_block *block)
+{
+    struct mem_region *region = block_region(block);
 
-    /* Find the free block that we should use */
-    while (current != NULL) {
-        if (current->size >= size + current->usage) {
-            /* We found the suitable block, now check if it's worst */
-            if (worst == NULL || current->size - current->usage >
-                    worst->size - worst->usage) {
-                worst = current;
-            }
-        }
-        current = current->next;
+    /* Large blocks may use their mapping up to its end */
+    if (region->flags & REGION_LARGE) {
+        return region->size - sizeof(struct mem_region)
+            - sizeof(struct mem_block);
     }
-
-    /* Return the worst block (possibly NULL if not found) */
-    return worst;
+    return (size_t) block->usage * MEM_UNIT - sizeof(struct mem_block);
 }
 
 /**
- * Finds the block that can be used as is (or split) to hold the new block 
- * of some size. 
- * Determines memory allocation algorithm based on the ALLOCATOR_ALGORITHM
- * environment variable. Default is First-Fit.
- * @param size - full size of the block which is allocated (including header).
- * @returns pointer to the header of the block that have enough free space, 
- *          or NULL if not found.
+ * Counts a block in or out of the blocks its arena has in use. Must be
+ * called as a block is handed out or released, and around changes to its
+ * usage. Callers hold the arena's lock.
+ * @param block - header of the block, its usage set.
+ * @param used - true for a block taken into use, false for one released.
  */
-void *reuse(size_t size)
+static void block_account(const struct mem_block *block, bool used)
 {
-    struct mem_block *block = NULL;
-    char *algo;
-
-    /* Check which algorithm should be used */
-    algo = getenv("ALLOCATOR_ALGORITHM");
-    if (algo == NULL) {
-        algo = "first_fit";
-    }
+    struct arena *arena = block_arena(block);
+    size_t usable = block_usable(block);
 
-    /* Find the block that should be reused */
-    if (strcmp(algo, "first_fit") == 0) {
-        block = first_fit(size);
+    if (used) {
+        arena->live_blocks++;
+        arena->live_bytes += usable;
     }
-    else if (strcmp(algo, "best_fit") == 0) {
-        block = best_fit(size);
-    } 
-    else if (strcmp(algo, "worst_fit") == 0) {
-        block = worst_fit(size);    
+    else {
+        arena->live_blocks--;
+        arena->live_bytes -= usable;
     }
-
-    /* Return block which will be reused (may be NULL) */
-    return block;
 }
 
 /**
- * Maps a new region and creates a block in it.
- * @param size - full size of the block which is allocated (including header).
- * @returns pointer to the block which is a single block for newly allocated 
- *          region.
+ * Checks whether a freed pointer may be queued on its arena's remote list,
+ * which links it through its first word. Blocks allocated with a size of
+ * zero have no room for that.
+ * @param ptr - data pointer of the object or block.
+ * @param slab - slab holding the object, or NULL for blocks.
+ * @returns true if the pointer can be queued.
  */
-void *expand_heap(size_t size)
+static bool remote_fits(void *ptr, struct slab *slab)
 {
-    int page_sz = getpagesize();
-    size_t num_pages = size / page_sz;
-    if ((size % page_sz) != 0) {
-        num_pages++;
-    }
-    
-    struct mem_block *block = mmap(NULL, num_pages * page_sz, 
-            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    
-    if (block == MAP_FAILED) {
-        perror("mmap");
-        return NULL;
-    }
-    
-    block->alloc_id = g_allocations++;
-    strcpy(block->name, "");
-    block->size = num_pages * page_sz;
-    block->usage = 0;
-    block->region_start = block;
-    block->region_size = num_pages * page_sz;
-    block->next = NULL;
-    
-    /* Add the block at the end of the list */
-    if (g_head == NULL) {
-        g_head = block;
-    }
-    else {
-        struct mem_block *curr = g_head;
-        while (curr->next != NULL) {
-            curr = curr->next;
-        }
-        curr->next = block;
-    }
+    struct mem_block *block = ((struct mem_block *) ptr) - 1;
 
-    /* Return block of expanded region */
-     LOG("ALLOCATED NEW REGION AT %p\n", block);
-    return block;    
+    return slab != NULL || (block_region(block)->flags & REGION_LARGE)
+        || block->usage > 1;
 }
 
 /**
- * Allocates an unnamed memory block with a given size.
- * If environment variable ALLOCATOR_SCRIBBLE is set to "1" then
- * allocated data memory is filled with 0xAA bytes.
- * @param size - size of the memory segment to allocate.
- * @returns pointer to the first byte of data inside the allocated segment.
+ * Hands a freed object or block to its arena without taking the lock. The
+ * arena releases it the next time one of its threads allocates.
+ * @param arena - arena owning the memory.
+ * @param ptr - data pointer to release; see remote_fits.
  */
-void *malloc_unsafe(size_t size)
+static void remote_push(struct arena *arena, void *ptr)
 {
-    size_t actual_size;
-    char *scribble;
-    
-    /* Align the memory */
-    if (size % 8 != 0) {
-        size = size + (8 - size % 8);
-    }
+    void *head = __atomic_load_n(&arena->remote, __ATOMIC_RELAXED);
 
-    /* Include the block header into needed size */
-    actual_size = size + sizeof(struct mem_block);
-    
-    /* Check maybe we can use some existing block */
-    struct mem_block *allocated = (struct mem_block *) reuse(actual_size);
-    
-    /* If no suitable block exists, expand to the new region */
-    if (allocated == NULL) {
-        allocated = (struct mem_block *) expand_heap(actual_size);
-    }
+    do {
+        *((void **) ptr) = head;
+    } while (!__atomic_compare_exchange_n(&arena->remote, &head, ptr, true,
+            __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
 
-    /* Make sure that current block can hold new data */
-    if (allocated->size < allocated->usage + actual_size) {
-        LOG("WEIRD, CHOSEN BLOCK HASN'T ENOUGH SPACE %p\n", allocated);
-    }
+/**
+ * Releases everything other threads queued on an arena's remote list. The
+ * whole list is taken at once, so pushes never race with the walk.
+ * Callers hold the arena's lock.
+ * @param arena - arena to drain.
+ */
+static void remote_drain(struct arena *arena)
+{
+    void *ptr, *next;
 
-    /* If the block is free, just use it */
-    if (allocated->usage == 0) {
-        allocated->usage = actual_size;
-    }
-    else {
-        struct mem_block *new;
-
-        /* Else, split this block into the old one and new */
-        new = (struct mem_block *) (((void *) allocated) + allocated->usage);
-        new->region_start = allocated->region_start;
-        new->region_size = allocated->region_size;
-        new->next = allocated->next;
-        new->size = allocated->size - allocated->usage;
-        new->alloc_id = g_allocations++;
-        new->usage = actual_size;
-        strcpy(new->name, "");
-
-        /* Remove the spent size from allocated block */
-        allocated->size = allocated->usage;
-        allocated->next = new;
-
-        /* Prepare pointer to the new block for return */
-        allocated = new;
+    /* Skip the exchange, which dirties the cache line, when there's nothing */
+    if (__atomic_load_n(&arena->remote, __ATOMIC_RELAXED) == NULL) {
+        return;
     }
 
-    /* Scribble if needed */
-    scribble = getenv("ALLOCATOR_SCRIBBLE");
-    if (scribble != NULL && strcmp(scribble, "1") == 0) {
-        memset((void *) (allocated + 1), 0xaa, size);
+    ptr = __atomic_exchange_n(&arena->remote, NULL, __ATOMIC_ACQUIRE);
+    while (ptr != NULL) {
+        next = *((void **) ptr);
+        free_unsafe(ptr);
+        ptr = next;
     }
-
-    /* Return data of allocated block */
-    /* LOG("FINAL ALLOCATION RESULT %p\n", allocated + 1); */
-    return (void *) (allocated + 1);
 }
 
 /**
- * Allocates an unnamed memory block with a given size. Thread-safe.
- * @see malloc_unsafe for the implementation of the allocation itself.
- * @param size - size of the memory segment to allocate.
- * @returns pointer to the first byte of data inside the allocated segment.
+ * Hashes a block address into the metadata side table of its arena.
+ * @param arena - arena owning the table.
+ * @param block - header of the block.
+ * @returns home slot of the block.
  */
-void *malloc(size_t size)
+static size_t meta_slot(struct arena *arena, const struct mem_block *block)
 {
-    void *result;
+    uint64_t key = ((uintptr_t) block) / MEM_UNIT * 0x9e3779b97f4a7c15ULL;
 
-     LOG("ALLOCATING SIZE %zu\n", size);
-
-    /* Lock the mutex to protect the call */
-    pthread_mutex_lock(&g_heap_lock);
+    return (key ^ (key >> 32)) & (arena->meta_slots - 1);
+}
 
-    /* Make call to the unsafe function inside critical section */
-    result = malloc_unsafe(size);
+/**
+ * Looks up the side table entry of a block.
+ * @param arena - arena owning the block.
+ * @param block - header of the block (only its address is used).
+ * @returns the entry, or NULL if the block has none.
+ */
+static struct block_meta *meta_find(struct arena *arena,
+        const struct mem_block *block)
+{
+    size_t i;
 
-    /* Unlock the mutex after call */
-    pthread_mutex_unlock(&g_heap_lock);
+    if (arena->meta_slots == 0) {
+        return NULL;
+    }
 
-    /* Return result of the guarded call */
-    return result;
+    for (i = meta_slot(arena, block); arena->meta[i].block != NULL;
+            i = (i + 1) & (arena->meta_slots - 1)) {
+        if (arena->meta[i].block == block) {
+            return &arena->meta[i];
+        }
+    }
+    return NULL;
 }
 
 /**
- * Allocates a named memory block with a given size.
- * @see malloc_unsafe for the implementation of the allocation itself.
- * @param size - size of the memory segment to allocate.
- * @param name - name of the block.
- * @returns pointer to the first byte of data inside the allocated segment.
+ * Doubles the side table and rehashes its entries.
+ * @param arena - arena owning the table.
+ * @returns true on success, false if the new table couldn't be mapped.
  */
-void *malloc_name_unsafe(size_t size, char *name)
+static bool meta_grow(struct arena *arena)
 {
-    struct mem_block *block;
-    void *pointer;
-    
-    /* Allocate the unnamed block */
-    pointer = malloc_unsafe(size);
-    block = ((struct mem_block *) pointer) - 1;
+    struct block_meta *old = arena->meta, *table;
+    size_t old_slots = arena->meta_slots, slots, i, j;
+
+    slots = old_slots == 0 ? META_INITIAL_SLOTS : old_slots * 2;
+    table = mmap(NULL, slots * sizeof(struct block_meta),
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
 
-    /* Set the name for the block */
-    strcpy(block->name, name);
+    arena->meta = table;
+    arena->meta_slots = slots;
+    for (i = 0; i < old_slots; i++) {
+        if (old[i].block == NULL) {
+            continue;
+        }
+        for (j = meta_slot(arena, old[i].block); table[j].block != NULL;
+                j = (j + 1) & (slots - 1));
+        table[j] = old[i];
+    }
 
-    /* Return allocated data region */
-    return pointer;
+    if (old != NULL && munmap(old, old_slots * sizeof(struct block_meta))) {
+        perror("munmap");
+    }
+    return true;
 }
 
 /**
- * Allocates a named memory block with a given size. Thread-safe.
- * @see malloc_name_unsafe for the implementation of the allocation itself.
- * @param size - size of the memory segment to allocate.
- * @param name - name of the block.
- * @returns pointer to the first byte of data inside the allocated segment.
+ * Adds an empty side table entry for a block that has none.
+ * @param block - header of the block.
+ * @returns the entry, or NULL if the table couldn't grow.
  */
-void *malloc_name(size_t size, char *name)
+static struct block_meta *meta_insert(struct mem_block *block)
 {
-    void *result;
+    struct arena *arena = block_arena(block);
+    struct block_meta *meta;
+    size_t i;
 
-    LOG("NAMED ALLOCATION WITH size = %zu, name = %s\n", size, name);
+    /* Keep the load factor at or below one half */
+    if ((arena->meta_count + 1) * 2 > arena->meta_slots && !meta_grow(arena)) {
+        return NULL;
+    }
 
-    /* Lock the mutex to protect the call */
-    pthread_mutex_lock(&g_heap_lock);
+    for (i = meta_slot(arena, block); arena->meta[i].block != NULL;
+            i = (i + 1) & (arena->meta_slots - 1));
+    meta = &arena->meta[i];
+    meta->block = block;
+    block->named = 1;
+    arena->meta_count++;
+    return meta;
+}
 
-    /* Make call to the unsafe function inside critical section */
-    result = malloc_name_unsafe(size, name);
+/**
+ * Finds or creates the side table entry of a block. New entries get the next
+ * allocation ID and an empty name.
+ * @param block - header of the block.
+ * @returns the entry, or NULL if the table couldn't grow.
+ */
+static struct block_meta *meta_get(struct mem_block *block)
+{
+    struct block_meta *meta;
 
-    /* Unlock the mutex after call */
-    pthread_mutex_unlock(&g_heap_lock);
+    if (block->named && (meta = meta_find(block_arena(block), block))) {
+        return meta;
+    }
 
-    /* Return result of the guarded call */
-    return result;
+    meta = meta_insert(block);
+    if (meta != NULL) {
+        meta->alloc_id = __atomic_fetch_add(&g_allocations, 1,
+                __ATOMIC_RELAXED);
+        meta->name[0] = '\0';
+        meta->sample = NULL;
+    }
+    return meta;
 }
 
 /**
- * Deallocates a memory block by the data pointer given.
- * @param ptr - data pointer of the block to free. If NULL, nothing is done.
- */ 
-void free_unsafe(void *ptr)
+ * Removes the side table entry stored under a block address. Later entries
+ * of the probe sequence are shifted back, so lookups never need tombstones.
+ * @param arena - arena owning the block.
+ * @param block - header of the block (only its address is used).
+ */
+static void meta_remove(struct arena *arena, const struct mem_block *block)
 {
-    bool region_empty = false;
-    struct mem_block *region_head, *region_end, *current, *next_region;
+    struct block_meta *meta = meta_find(arena, block), *table = arena->meta;
+    size_t mask = arena->meta_slots - 1, i, j, home;
 
-    /* Freeing a NULL pointer does nothing */
-    if (ptr == NULL) {
+    if (meta == NULL) {
         return;
     }
 
-    /* Reset the usage of the current block */
-    current = ((struct mem_block *) ptr) - 1;
-    current->usage = 0;
-
-    /* Find the region the block belongs to */
-    region_head = current->region_start;
-    region_end = (struct mem_block *) (((void *) region_head) + 
-            region_head->region_size);
-
-    /* Now, traverse through region to check if each block is empty */
-    region_empty = true;
-    current = region_head;
-    while (current != NULL && current >= region_head && current < region_end) {
-        /* If this block is not empty, the region is not empty too */
-        if (current->usage != 0) {
-            region_empty = false;
-            break;
+    i = meta - table;
+    for (j = (i + 1) & mask; table[j].block != NULL; j = (j + 1) & mask) {
+        /* The entry may fill the hole if the hole lies on its probe path */
+        home = meta_slot(arena, table[j].block);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            table[i] = table[j];
+            i = j;
         }
+    }
+    table[i].block = NULL;
+    arena->meta_count--;
+}
 
-        /* Else, check next block */
-        current = current->next;
+/**
+ * Drops the side table entry of a block whose header goes away.
+ * @param block - header of the block.
+ */
+static void meta_forget(struct mem_block *block)
+{
+    if (block->named) {
+        meta_remove(block_arena(block), block);
+        block->named = 0;
     }
+}
+
+/**
+ * Moves the side table entry of a block whose header has been moved.
+ * @param old - former address of the header.
+ * @param block - new header of the block.
+ */
+static void meta_move(const struct mem_block *old, struct mem_block *block)
+{
+    struct arena *arena = block_arena(block);
+    struct block_meta *meta = meta_find(arena, old), saved;
 
-    /* If the region is not empty, return as we can't do anything else */
-    next_region = current;
-    if (!region_empty) {
+    block->named = 0;
+    if (meta == NULL) {
         return;
     }
-    
-    /* Else, free the whole region */
-     LOG("FREE IS CAUSING REGION %p TO UNMAP\n", region_head);
-    if (munmap(region_head, region_head->region_size) != 0) {
-        perror("munmap");
-    }
 
-    /* Fix the linked list so it points over the freed region */
-    if (g_head == region_head) {
-        /* Fix only head pointer */
-        g_head = next_region;
-    } 
-    else {
-        /* Find the block that pointed to this region and fix it */
-        current = g_head;
-        while (current->next != NULL && current->next != region_head) {
-            current = current->next;
-        }
-        if (current->next != NULL) {
-            current->next = next_region;
+    saved = *meta;
+    meta_remove(arena, old);
+    meta = meta_insert(block);
+    if (meta != NULL) {
+        meta->alloc_id = saved.alloc_id;
+        memcpy(meta->name, saved.name, sizeof(meta->name));
+        meta->sample = saved.sample;
+        if (meta->sample != NULL) {
+            meta->sample->block = block;
         }
     }
 }
 
 /**
- * Deallocates a memory block by the data pointer given. Thread-safe.
- * @see free_unsafe for the implementation of the deallocation itself.
- * @param ptr - data pointer of the block to free. If NULL, nothing is done.
- */ 
-void free(void *ptr)
+ * Sets up the metadata of a new block header: with METADATA enabled, every
+ * block gets an allocation ID; otherwise only named blocks have an entry.
+ * @param block - header of the new block.
+ */
+static void meta_track(struct mem_block *block)
 {
-     LOG("FREE request at %p\n", ptr);
-
-    /* Freeing a NULL pointer does nothing */
-    if (ptr == NULL) {
-        return;
+    block->named = 0;
+    if (METADATA) {
+        meta_get(block);
     }
-    
-    /* Lock the mutex to protect the call */
-    pthread_mutex_lock(&g_heap_lock);
-
-    /* Make call to the unsafe function inside critical section */
-    free_unsafe(ptr);
-    
-    /* Unlock the mutex after call */
-    pthread_mutex_unlock(&g_heap_lock);
 }
 
 /**
- * Allocates an unnamed memory block with some amount of elements 
- * of given size each. Allocated data memory is filled with zero bytes.
- * Thread-safe.
- * @see malloc_unsafe for the implementation of the allocation itself.
- * @param nmemb - count of elements to allocate memory for.
- * @param size - size of the each element.
- * @returns pointer to the first byte of data inside the allocated segment.
+ * Prints out the current memory state, including both the regions and blocks.
+ * Entries are printed in order, so there is an implied link from the topmost
+ * entry to the next, and so on. With several arenas, each one that holds
+ * memory is introduced by an [ARENA] line. The heap is copied with a heap
+ * snapshot first, so no arena stays locked while the text is written.
+ * @param fp - output stream to print the memory state to.
  */
-void *calloc(size_t nmemb, size_t size)
+void write_memory(FILE *fp)
 {
-    void *result;
+    struct heap_snapshot *snapshot;
+    size_t capacity = SNAPSHOT_INITIAL;
 
-    /* Lock the mutex to protect the call */
-    pthread_mutex_lock(&g_heap_lock);
-
-    /* Allocate the memory inside critical section */
-    result = malloc_unsafe(nmemb * size);
-
-    /* Unlock the mutex after call */
-    pthread_mutex_unlock(&g_heap_lock);
+    for (;;) {
+        snapshot = heap_snapshot_create(capacity);
+        if (snapshot == NULL) {
+            LOG_ERROR("cannot map a snapshot of %zu entries\n", capacity);
+            return;
+        }
+        if (heap_snapshot_take(snapshot) == 0) {
+            break;
+        }
 
-    /* Zeroing the allocated memory */
-    memset(result, 0, nmemb * size);
+        /* The heap grew past the snapshot: retry with room to spare */
+        capacity = snapshot->needed * 2;
+        heap_snapshot_destroy(snapshot);
+    }
+    heap_snapshot_write(snapshot, fp, SNAPSHOT_TEXT);
+    heap_snapshot_destroy(snapshot);
+}
 
-    /* Return result of the guarded call */
-    return result;
+/**
+ * Prints out the current memory state, including both the regions and blocks.
+ * Entries are printed in order, so there is an implied link from the topmost
+ * entry to the next, and so on.
+ * The data is written into standard output stream.
+ * @see write_memory for more generic version.
+ */
+void print_memory(void)
+{
+    /* Use more generic version */
+    /* Creates file mem.txt in viz folder*/
+    /* Uncomment this to visualize */
+    //    FILE *fp = fopen("tests/viz/mem.txt", "w");
+    //    write_memory(fp);
+    
+    write_memory(stdout);
 }
 
 /**
- * Changes the size of the given allocated block to the new one.
- * If the given block is NULL, equal to malloc_unsafe(size).
- * If the new size is 0, equal to free_unsafe(ptr).
- * @see malloc_unsafe for the implementation of the allocation.
- * @see free_unsafe for the implementation of the deallocation.
- * @param ptr - data pointer of the existing block.
- * @param size - new size for the block.
- * @returns pointer to the first byte of data inside the resized segment.
+ * Reads the ALLOCATOR_ALGORITHM environment variable, once. The index layout
+ * depends on the algorithm, so it cannot change while blocks are indexed.
+ * @returns the placement algorithm in use.
  */
-void *realloc_unsafe(void *ptr, size_t size)
+static enum fit_algorithm fit_algorithm(void)
 {
-    struct mem_block *current;
-    size_t actual_size;
+    char *algo;
 
-    /* If the pointer is NULL, then we simply malloc a new block */
-    if (ptr == NULL) {
-        return malloc_unsafe(size);
+    if (g_fit_algorithm != FIT_UNSET) {
+        return g_fit_algorithm;
     }
-    
-    if (size == 0) {
-        /* Realloc to 0 is often the same as freeing the memory block... 
-         * But the C standard doesn't require this. 
-         * We will free the block and return NULL here. */
-        free_unsafe(ptr);
+
+    /* Check which algorithm should be used */
+    algo = getenv("ALLOCATOR_ALGORITHM");
+    if (algo == NULL || strcmp(algo, "first_fit") == 0) {
+        g_fit_algorithm = FIT_FIRST;
+    }
+    else if (strcmp(algo, "best_fit") == 0) {
+        g_fit_algorithm = FIT_BEST;
+    }
+    else if (strcmp(algo, "worst_fit") == 0) {
+        g_fit_algorithm = FIT_WORST;
+    }
+    else if (strcmp(algo, "tlsf") == 0) {
+        g_fit_algorithm = FIT_TLSF;
+    }
+    else {
+        g_fit_algorithm = FIT_NONE;
+    }
+
+    return g_fit_algorithm;
+}
+
+/**
+ * Compares two index nodes according to the ordering of the algorithm.
+ * @param a - first node (may be a stack-allocated search key).
+ * @param b - second node.
+ * @returns negative, zero or positive as a sorts before, with or after b.
+ */
+static int fit_compare(const struct fit_node *a, const struct fit_node *b)
+{
+    enum fit_algorithm algo = fit_algorithm();
+    int order;
+
+    /* Position in the block list: region creation order, then address */
+    if (a->region_id != b->region_id) {
+        order = a->region_id < b->region_id ? -1 : 1;
+    }
+    else if (a->block != b->block) {
+        order = a->block < b->block ? -1 : 1;
+    }
+    else {
+        order = 0;
+    }
+
+    if (algo == FIT_FIRST || algo == FIT_NONE || a->slack == b->slack) {
+        return algo == FIT_WORST ? -order : order;
+    }
+    return a->slack < b->slack ? -1 : 1;
+}
+
+/**
+ * Recomputes the largest slack of a subtree after its children changed.
+ * @param node - root of the subtree.
+ */
+static void fit_update(struct fit_node *node)
+{
+    node->max_slack = node->slack;
+    if (node->left != NULL && node->left->max_slack > node->max_slack) {
+        node->max_slack = node->left->max_slack;
+    }
+    if (node->right != NULL && node->right->max_slack > node->max_slack) {
+        node->max_slack = node->right->max_slack;
+    }
+}
+
+/**
+ * Inserts a node into a subtree of the index.
+ * @param root - root of the subtree (may be NULL).
+ * @param node - node to insert.
+ * @returns new root of the subtree.
+ */
+static struct fit_node *fit_insert_node(struct fit_node *root,
+        struct fit_node *node)
+{
+    struct fit_node *child;
+
+    if (root == NULL) {
+        return node;
+    }
+
+    if (fit_compare(node, root) < 0) {
+        root->left = fit_insert_node(root->left, node);
+        if (root->left->priority > root->priority) {
+            /* Rotate right */
+            child = root->left;
+            root->left = child->right;
+            fit_update(root);
+            child->right = root;
+            root = child;
+        }
+    }
+    else {
+        root->right = fit_insert_node(root->right, node);
+        if (root->right->priority > root->priority) {
+            /* Rotate left */
+            child = root->right;
+            root->right = child->left;
+            fit_update(root);
+            child->left = root;
+            root = child;
+        }
+    }
+
+    fit_update(root);
+    return root;
+}
+
+/**
+ * Joins two subtrees where every node of the first sorts before the second.
+ * @param a - left subtree (may be NULL).
+ * @param b - right subtree (may be NULL).
+ * @returns root of the joined tree.
+ */
+static struct fit_node *fit_merge(struct fit_node *a, struct fit_node *b)
+{
+    if (a == NULL) {
+        return b;
+    }
+    if (b == NULL) {
+        return a;
+    }
+
+    if (a->priority > b->priority) {
+        a->right = fit_merge(a->right, b);
+        fit_update(a);
+        return a;
+    }
+    b->left = fit_merge(a, b->left);
+    fit_update(b);
+    return b;
+}
+
+/**
+ * Removes the node matching a key from a subtree of the index.
+ * @param root - root of the subtree (may be NULL).
+ * @param key - key of the node to remove.
+ * @param removed - receives the removed node.
+ * @returns new root of the subtree.
+ */
+static struct fit_node *fit_remove_node(struct fit_node *root,
+        const struct fit_node *key, struct fit_node **removed)
+{
+    int cmp;
+
+    if (root == NULL) {
         return NULL;
     }
 
-    /* Align the memory */
-    if (size % 8 != 0) {
-        size = size + (8 - size % 8);
+    cmp = fit_compare(key, root);
+    if (cmp < 0) {
+        root->left = fit_remove_node(root->left, key, removed);
+    }
+    else if (cmp > 0) {
+        root->right = fit_remove_node(root->right, key, removed);
+    }
+    else {
+        *removed = root;
+        root = fit_merge(root->left, root->right);
+        if (root == NULL) {
+            return NULL;
+        }
     }
 
-    /* Include the block header into needed size */
-    actual_size = size + sizeof(struct mem_block);
+    fit_update(root);
+    return root;
+}
 
-    /* Check if the current block can be resized in-place */
-    current = ((struct mem_block *) ptr) - 1;
-    if (current->size >= actual_size) {
-        /* Just resize the block */
-        current->usage = actual_size;
+/**
+ * Fills in the key describing the current slack of a block.
+ * @param key - node to fill.
+ * @param block - the block.
+ */
+static void fit_key(struct fit_node *key, struct mem_block *block)
+{
+    key->block = block;
+    key->region_id = block_region(block)->id;
+    key->slack = (size_t) (block->size - block->usage) * MEM_UNIT;
+}
 
-        /* And return itself */
-        return ptr;
+/**
+ * Tells whether a block has enough slack to be in the free space index.
+ * The TLSF links of a free region head go after its header, so a head of a
+ * single unit is left out.
+ * @param block - the block.
+ * @returns true if the block belongs in the index.
+ */
+static bool fit_slack(struct mem_block *block)
+{
+    if ((size_t) (block->size - block->usage) * MEM_UNIT < FIT_MIN_SLACK) {
+        return false;
+    }
+    return fit_algorithm() != FIT_TLSF || block->size > 1;
+}
+
+/**
+ * Finds the TLSF links of an indexed block.
+ * @param block - the block.
+ * @returns the links, at the start of the block's slack.
+ */
+static struct tlsf_link *tlsf_link(struct mem_block *block)
+{
+    return (struct tlsf_link *) (((char *) block)
+            + (size_t) (block->usage > 0 ? block->usage : 1) * MEM_UNIT);
+}
+
+/**
+ * Maps a slack to its TLSF list: slack below TLSF_SL_COUNT units has a list
+ * per unit, above that each power of two is split into TLSF_SL_COUNT lists.
+ * @param units - slack in MEM_UNITs.
+ * @param fl - receives the first-level class.
+ * @param sl - receives the list within the class.
+ */
+static void tlsf_mapping(size_t units, unsigned int *fl, unsigned int *sl)
+{
+    unsigned int bits;
+
+    if (units < TLSF_SL_COUNT) {
+        *fl = 0;
+        *sl = units;
+        return;
+    }
+    bits = 63 - __builtin_clzll(units);
+    *fl = bits - TLSF_SL_BITS + 1;
+    *sl = (units >> (bits - TLSF_SL_BITS)) - TLSF_SL_COUNT;
+}
+
+/**
+ * Pushes a block on the TLSF list of its slack and marks the list non-empty.
+ * The links are written into the slack, so the clean offset of the region
+ * moves past them.
+ * @param block - the block, with at least FIT_MIN_SLACK slack.
+ */
+static void tlsf_insert(struct mem_block *block)
+{
+    struct arena *arena = block_arena(block);
+    struct mem_region *region = block_region(block);
+    struct tlsf_link *link = tlsf_link(block);
+    unsigned int fl, sl;
+    size_t end;
+
+    tlsf_mapping(block->size - block->usage, &fl, &sl);
+    link->prev = NULL;
+    link->next = arena->tlsf_lists[fl][sl];
+    if (link->next != NULL) {
+        tlsf_link(link->next)->prev = block;
+    }
+    arena->tlsf_lists[fl][sl] = block;
+    arena->tlsf_first |= 1u << fl;
+    arena->tlsf_second[fl] |= 1u << sl;
+
+    end = (size_t) ((char *) (link + 1) - (char *) region);
+    if (end > region->clean) {
+        region->clean = end;
+    }
+}
+
+/**
+ * Unlinks a block from its TLSF list, clearing the bits of the list and of
+ * its class when they empty.
+ * @param block - the indexed block, its slack unchanged since tlsf_insert.
+ */
+static void tlsf_remove(struct mem_block *block)
+{
+    struct arena *arena = block_arena(block);
+    struct tlsf_link *link = tlsf_link(block);
+    unsigned int fl, sl;
+
+    tlsf_mapping(block->size - block->usage, &fl, &sl);
+    if (link->prev != NULL) {
+        tlsf_link(link->prev)->next = link->next;
     }
     else {
-        /* Else, can't resize in-place, so allocate new place */
-        void *new = malloc_unsafe(size);
+        arena->tlsf_lists[fl][sl] = link->next;
+    }
+    if (link->next != NULL) {
+        tlsf_link(link->next)->prev = link->prev;
+    }
+
+    if (arena->tlsf_lists[fl][sl] == NULL) {
+        arena->tlsf_second[fl] &= ~(1u << sl);
+        if (arena->tlsf_second[fl] == 0) {
+            arena->tlsf_first &= ~(1u << fl);
+        }
+    }
+}
 
-        /* Copy data from the current memory to the new one */
-        memcpy(new, ptr, size);
+/**
+ * Adds the slack of a block to the free space index. Must be called after
+ * every change that may leave a block with at least FIT_MIN_SLACK slack.
+ * @param block - the block.
+ */
+static void fit_insert(struct mem_block *block)
+{
+    struct arena *arena;
+    struct fit_node *node;
+    size_t i;
 
-        /* And free old memory */
-        free_unsafe(ptr);
+    if (!fit_slack(block)) {
+        return;
+    }
+    if (fit_algorithm() == FIT_TLSF) {
+        tlsf_insert(block);
+        return;
+    }
 
-        /* Return newly allocated */
-        return new;
+    /* Carve a new chunk of nodes when the spares run out */
+    arena = block_arena(block);
+    if (arena->fit_spare == NULL) {
+        node = mmap(NULL, FIT_NODE_CHUNK, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (node == MAP_FAILED) {
+            perror("mmap");
+            return;
+        }
+        for (i = 0; i < FIT_NODE_CHUNK / sizeof(struct fit_node); i++) {
+            node[i].left = arena->fit_spare;
+            arena->fit_spare = &node[i];
+        }
     }
+
+    node = arena->fit_spare;
+    arena->fit_spare = node->left;
+
+    fit_key(node, block);
+    node->left = node->right = NULL;
+    node->max_slack = node->slack;
+
+    /* xorshift32 keeps the treap balanced in expectation */
+    arena->fit_seed ^= arena->fit_seed << 13;
+    arena->fit_seed ^= arena->fit_seed >> 17;
+    arena->fit_seed ^= arena->fit_seed << 5;
+    node->priority = arena->fit_seed;
+
+    arena->fit_root = fit_insert_node(arena->fit_root, node);
 }
 
 /**
- * Changes the size of the given allocated block to the new one.
- * If the given block is NULL, equal to malloc_unsafe(size).
- * If the new size is 0, equal to free_unsafe(ptr).
- * Thread-safe.
- * @see realloc_unsafe for for implementation of the reallocation itself.
- * @param ptr - data pointer of the existing block.
- * @param size - new size for the block.
- * @returns pointer to the first byte of data inside the resized segment.
+ * Removes the slack of a block from the free space index. Must be called
+ * before every change to the size or usage of a block, and only for blocks
+ * that are indexed: the TLSF lists can't tell.
+ * @param block - the block.
  */
-void *realloc(void *ptr, size_t size)
+static void fit_remove(struct mem_block *block)
 {
-    void *result;
+    struct arena *arena = block_arena(block);
+    struct fit_node key, *removed = NULL;
 
-    /* Lock the mutex to protect the call */
-    pthread_mutex_lock(&g_heap_lock);
+    if (!fit_slack(block)) {
+        return;
+    }
+    if (fit_algorithm() == FIT_TLSF) {
+        tlsf_remove(block);
+        return;
+    }
 
-    /* Make call to the unsafe function inside critical section */
-    result = realloc_unsafe(ptr, size);
+    fit_key(&key, block);
+    arena->fit_root = fit_remove_node(arena->fit_root, &key, &removed);
+    if (removed != NULL) {
+        removed->left = arena->fit_spare;
+        arena->fit_spare = removed;
+    }
+}
 
-    /* Unlock the mutex after call */
-    pthread_mutex_unlock(&g_heap_lock);
+/**
+ * Finds the block that can be used as or split to hold the new block
+ * Uses First-Fit memory allocation (first valid block is chosen).
+ * The index is ordered like the block list, so the leftmost node with enough
+ * slack is the block a walk of the list would find, in O(log n).
+ * @param arena - arena to search.
+ * @param size - full size of the block which is allocated (including header).
+ * @returns pointer to the header of the block that has enough free space,
+ *          or NULL if not found.
+ */
+struct mem_block *first_fit(struct arena *arena, size_t size)
+{
+    struct fit_node *current = arena->fit_root;
 
-    /* Return result of the guarded call */
-    return result;
+    /* Descend towards the leftmost node with enough slack */
+    while (current != NULL) {
+        if (current->left != NULL && current->left->max_slack >= size) {
+            current = current->left;
+        }
+        else if (current->slack >= size) {
+            return current->block;
+        }
+        else if (current->right != NULL && current->right->max_slack >= size) {
+            current = current->right;
+        }
+        else {
+            break;
+        }
+    }
+
+    /* If code reaches here, no blocks could be split */
+    return NULL;
+}
+
+/**
+ * Finds the block that can be used as is (or split) to hold the new block 
+ * of some size. 
+ * Uses Best-Fit memory allocation 
+ * (valid block with the least extra space is chosen).
+ * Ties go to the block that comes first in the list, found in O(log n) as
+ * the lower bound of the size-ordered index.
+ * @param arena - arena to search.
+ * @param size - full size of the block which is allocated (including header).
+ * @returns pointer to the header of the block that have enough free space, 
+ *          or NULL if not found.
+ */
+struct mem_block *best_fit(struct arena *arena, size_t size)
+{
+    struct fit_node *current = arena->fit_root, *best = NULL;
+
+    /* Find the smallest slack that is large enough */
+    while (current != NULL) {
+        if (current->slack >= size) {
+            best = current;
+            current = current->left;
+        }
+        else {
+            current = current->right;
+        }
+    }
+
+    /* Return the best block (possibly NULL if not found) */
+    return best == NULL ? NULL : best->block;
+}
+
+/**
+ * Finds the block that can be used as or split to hold the new block
+ * Uses same logic as Best-Fit memory allocation
+ * (valid block with most extra space is chosen).
+ * Ties go to the block that comes first in the list, which the index keeps
+ * as its rightmost node.
+ * @param arena - arena to search.
+ * @param size - full size of the block which is allocated (including header).
+ * @returns pointer to the header of the block that have enough free space, 
+ *          or NULL if not found.
+ */
+struct mem_block *worst_fit(struct arena *arena, size_t size)
+{
+    struct fit_node *current = arena->fit_root;
+
+    /* Check if any blocks are indexed */
+    if (current == NULL) {
+        return NULL;
+    }
+
+    /* The largest slack is the rightmost node */
+    while (current->right != NULL) {
+        current = current->right;
+    }
+
+    /* Return the worst block (NULL if it isn't large enough) */
+    return current->slack >= size ? current->block : NULL;
+}
+
+/**
+ * Finds the block that can be used as or split to hold the new block
+ * Uses Two-Level Segregated Fit memory allocation (a block from the first
+ * non-empty list whose slack is certain to be large enough is chosen).
+ * The size is rounded up to the start of the next list, and the list found
+ * with a bit scan of each level's bitmap, so the search takes constant time
+ * however many blocks are indexed. A block in the list the size falls into
+ * may fit too, but is only taken once nothing larger is left: the first
+ * block of that list is checked, so the search stays constant.
+ * @param arena - arena to search.
+ * @param size - full size of the block which is allocated (including header).
+ * @returns pointer to the header of the block that have enough free space,
+ *          or NULL if not found.
+ */
+struct mem_block *tlsf_fit(struct arena *arena, size_t size)
+{
+    size_t needed = (size + MEM_UNIT - 1) / MEM_UNIT, units = needed;
+    struct mem_block *block;
+    unsigned int fl, sl;
+    uint32_t map;
+
+    if (needed > UINT32_MAX) {
+        return NULL;
+    }
+
+    /* Round up so every block of the list is large enough */
+    if (units >= TLSF_SL_COUNT) {
+        units += ((size_t) 1 << (63 - __builtin_clzll(units) - TLSF_SL_BITS))
+            - 1;
+    }
+    if (units <= UINT32_MAX) {
+        tlsf_mapping(units, &fl, &sl);
+
+        /* A list further along the class, else the first list of a larger
+         * one */
+        map = arena->tlsf_second[fl] & (~0u << sl);
+        if (map == 0 && fl + 1 < TLSF_FL_COUNT) {
+            map = arena->tlsf_first & (~0u << (fl + 1));
+            if (map != 0) {
+                fl = __builtin_ctz(map);
+                map = arena->tlsf_second[fl];
+            }
+        }
+        if (map != 0) {
+            return arena->tlsf_lists[fl][__builtin_ctz(map)];
+        }
+    }
+
+    /* Nothing larger is left: the list the size falls into may hold a
+     * block that fits */
+    tlsf_mapping(needed, &fl, &sl);
+    block = arena->tlsf_lists[fl][sl];
+    if (block != NULL
+            && (size_t) (block->size - block->usage) * MEM_UNIT >= size) {
+        return block;
+    }
+    return NULL;
+}
+
+/**
+ * Finds the block that can be used as is (or split) to hold the new block 
+ * of some size. 
+ * Determines memory allocation algorithm based on the ALLOCATOR_ALGORITHM
+ * environment variable. Default is First-Fit.
+ * @param arena - arena to search.
+ * @param size - full size of the block which is allocated (including header).
+ * @returns pointer to the header of the block that have enough free space, 
+ *          or NULL if not found.
+ */
+void *reuse(struct arena *arena, size_t size)
+{
+    struct mem_block *block = NULL;
+
+    /* Find the block that should be reused */
+    switch (fit_algorithm()) {
+    case FIT_FIRST:
+        block = first_fit(arena, size);
+        break;
+    case FIT_BEST:
+        block = best_fit(arena, size);
+        break;
+    case FIT_WORST:
+        block = worst_fit(arena, size);
+        break;
+    case FIT_TLSF:
+        block = tlsf_fit(arena, size);
+        break;
+    default:
+        break;
+    }
+
+    /* Return block which will be reused (may be NULL) */
+    return block;
+}
+
+/**
+ * Reads a size from the environment. The value may carry a K, M or G suffix.
+ * @param name - name of the environment variable.
+ * @param fallback - value used when the variable is unset or malformed.
+ * @returns the size in bytes.
+ */
+static size_t env_size(const char *name, size_t fallback)
+{
+    char *value = getenv(name), *end;
+    size_t size;
+
+    if (value == NULL) {
+        return fallback;
+    }
+
+    size = strtoull(value, &end, 10);
+    if (end == value) {
+        return fallback;
+    }
+
+    switch (*end) {
+    case 'G': case 'g':
+        size <<= 10;
+        /* fall through */
+    case 'M': case 'm':
+        size <<= 10;
+        /* fall through */
+    case 'K': case 'k':
+        size <<= 10;
+        break;
+    default:
+        break;
+    }
+
+    return size;
+}
+
+/**
+ * Reads the region growth limits and the huge page mode from the
+ * environment.
+ */
+static void region_config(void)
+{
+    char *huge = getenv("ALLOCATOR_HUGEPAGES");
+
+    if (huge != NULL && strcmp(huge, "hugetlb") == 0) {
+        g_huge_pages = HUGE_TLB;
+    }
+    else if (huge != NULL && (strcmp(huge, "1") == 0
+                || strcmp(huge, "thp") == 0)) {
+        g_huge_pages = HUGE_THP;
+    }
+
+    g_region_chunk = env_size("ALLOCATOR_REGION_MIN", REGION_CHUNK_MIN);
+    g_region_chunk_max = env_size("ALLOCATOR_REGION_MAX", REGION_CHUNK_MAX);
+
+    /* Huge pages are only worth it for regions of at least one */
+    if (g_huge_pages != HUGE_OFF && g_region_chunk < HUGE_PAGE_SIZE) {
+        g_region_chunk = HUGE_PAGE_SIZE;
+    }
+    if (g_region_chunk_max < g_region_chunk) {
+        g_region_chunk_max = g_region_chunk;
+    }
+
+    /* Block sizes are counted in 32 bits of MEM_UNITs */
+    if (g_region_chunk_max > BLOCK_MAX_SIZE) {
+        g_region_chunk_max = BLOCK_MAX_SIZE;
+    }
+    if (g_region_chunk > g_region_chunk_max) {
+        g_region_chunk = g_region_chunk_max;
+    }
+}
+
+/**
+ * Decides how large the next region of an arena should be. Regions are
+ * reserved in chunks that double with every mapping, starting at
+ * ALLOCATOR_REGION_MIN and capped at ALLOCATOR_REGION_MAX, so bursts of
+ * growth need few mmaps.
+ * @param arena - arena the region is for.
+ * @param size - full size of the block which is allocated (including header).
+ * @returns number of bytes to map.
+ */
+static size_t region_chunk_size(struct arena *arena, size_t size)
+{
+    size_t chunk;
+
+    if (arena->region_chunk == 0) {
+        arena->region_chunk = g_region_chunk;
+    }
+
+    chunk = arena->region_chunk;
+    if (arena->region_chunk < g_region_chunk_max) {
+        arena->region_chunk *= 2;
+        if (arena->region_chunk > g_region_chunk_max) {
+            arena->region_chunk = g_region_chunk_max;
+        }
+    }
+
+    return size > chunk ? size : chunk;
+}
+
+/**
+ * Reads the retention limits from the environment. ALLOCATOR_RETAIN_MAX is
+ * shared out between the arenas.
+ */
+static void retain_config(void)
+{
+    char *background;
+
+    g_retain_max = env_size("ALLOCATOR_RETAIN_MAX", RETAIN_MAX)
+        / g_arena_count;
+    g_retain_decay_ms = env_size("ALLOCATOR_RETAIN_DECAY_MS",
+            RETAIN_DECAY_MS);
+    background = getenv("ALLOCATOR_BACKGROUND_PURGE");
+    g_retain_background = background != NULL && strcmp(background, "1") == 0;
+}
+
+/**
+ * Reads the monotonic clock.
+ * @returns current time in milliseconds.
+ */
+static unsigned long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Reads the monotonic clock with full precision.
+ * @returns current time in nanoseconds.
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Takes the lock of an arena, counting how often and how long threads had to
+ * wait for it. The clock is only read when the lock is busy, unless hold
+ * times are measured as well.
+ * @param arena - arena to lock.
+ */
+static void arena_lock(struct arena *arena)
+{
+    uint64_t start;
+
+    if (pthread_mutex_trylock(&arena->lock) != 0) {
+        start = now_ns();
+        pthread_mutex_lock(&arena->lock);
+        arena->stats.lock_contended++;
+        arena->stats.lock_wait_ns += now_ns() - start;
+    }
+    arena->stats.lock_acquired++;
+    if (g_stats_timing) {
+        arena->lock_since = now_ns();
+    }
+}
+
+/**
+ * Releases the lock of an arena.
+ * @param arena - arena to unlock.
+ */
+static void arena_unlock(struct arena *arena)
+{
+    if (g_stats_timing) {
+        arena->stats.lock_hold_ns += now_ns() - arena->lock_since;
+    }
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/**
+ * Walks all arenas in use: first those threads are assigned, then the
+ * tagged ones. The arenas must have been set up.
+ * @param arena - arena the walk is at, or NULL to start it.
+ * @returns the next arena, or NULL after the last one.
+ */
+static struct arena *arena_next(struct arena *arena)
+{
+    unsigned int tags = __atomic_load_n(&g_tag_count, __ATOMIC_ACQUIRE);
+
+    if (arena == NULL) {
+        return &g_arenas[0];
+    }
+    if (arena->index + 1 < g_arena_count) {
+        return arena + 1;
+    }
+    if (arena->index < ARENA_MAX) {
+        return tags > 0 ? &g_tags[0] : NULL;
+    }
+    return arena->index - ARENA_MAX + 1 < tags ? arena + 1 : NULL;
+}
+
+/**
+ * Draws the number of bytes to allocate before the next heap profile sample.
+ * Distances are exponentially distributed, so every allocated byte is
+ * equally likely to be sampled (a Poisson process) and the mean distance is
+ * g_prof_rate.
+ * @param cache - thread cache holding the generator state.
+ * @returns the distance in bytes.
+ */
+static uint64_t prof_distance(struct tcache *cache)
+{
+    uint64_t x = cache->prof_seed;
+    double u;
+
+    /* xorshift64* */
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    cache->prof_seed = x;
+
+    /* The top 53 bits give a uniform number in (0, 1] */
+    u = ((x * 0x2545f4914f6cdd1dULL >> 11) + 1.0) / 9007199254740992.0;
+    return (uint64_t) (-log(u) * g_prof_rate);
+}
+
+/**
+ * Decides whether an allocation is sampled by the heap profiler. When
+ * profiling is off, this costs a single comparison.
+ * @param cache - thread cache of the calling thread, or NULL.
+ * @param size - requested size.
+ * @returns true if the allocation is to be sampled.
+ */
+static bool prof_tick(struct tcache *cache, size_t size)
+{
+    if (g_prof_rate == 0 || cache == NULL || cache->prof_busy) {
+        return false;
+    }
+
+    if (cache->prof_left > size) {
+        cache->prof_left -= size;
+        return false;
+    }
+
+    /* The first allocation of a thread only seeds its generator */
+    if (cache->prof_seed == 0) {
+        cache->prof_seed = (((uintptr_t) cache) ^ now_ns()) | 1;
+        cache->prof_left = prof_distance(cache);
+        return false;
+    }
+
+    cache->prof_left = prof_distance(cache);
+    return true;
+}
+
+/**
+ * Takes the stack trace of a sampled allocation. Must be called without any
+ * arena lock held: the first trace loads the unwinder, which allocates.
+ * @param cache - thread cache of the calling thread.
+ * @param trace - set to the trace, leaving out this function's own frame.
+ */
+__attribute__((noinline))
+static void prof_capture(struct tcache *cache, struct prof_trace *trace)
+{
+    void *stack[PROF_DEPTH + 1];
+    int depth;
+
+    /* Allocations made by the unwinder itself aren't sampled */
+    cache->prof_busy = true;
+    depth = backtrace(stack, PROF_DEPTH + 1);
+    cache->prof_busy = false;
+
+    trace->depth = depth > 1 ? depth - 1 : 0;
+    memcpy(trace->stack, stack + 1, trace->depth * sizeof(void *));
+}
+
+/**
+ * Records a sampled allocation in the side table entry of its block and the
+ * arena's list of live samples. Callers hold the arena's lock.
+ * @param ptr - data pointer of the block (sampled allocations never come
+ *              from slabs).
+ * @param size - requested size.
+ * @param trace - stack trace of the allocation.
+ */
+static void prof_record(void *ptr, size_t size,
+        const struct prof_trace *trace)
+{
+    struct mem_block *block = ((struct mem_block *) ptr) - 1;
+    struct arena *arena = block_arena(block);
+    struct prof_sample *sample;
+    struct block_meta *meta;
+    size_t i;
+
+    /* Carve a new chunk of records when the spares run out */
+    if (arena->prof_spare == NULL) {
+        sample = mmap(NULL, PROF_CHUNK, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (sample == MAP_FAILED) {
+            perror("mmap");
+            return;
+        }
+        for (i = 0; i < PROF_CHUNK / sizeof(struct prof_sample); i++) {
+            sample[i].next = arena->prof_spare;
+            arena->prof_spare = &sample[i];
+        }
+    }
+
+    meta = meta_get(block);
+    if (meta == NULL) {
+        return;
+    }
+
+    sample = arena->prof_spare;
+    arena->prof_spare = sample->next;
+    sample->block = block;
+    sample->size = size;
+    sample->trace = *trace;
+
+    sample->prev = NULL;
+    sample->next = arena->prof_live;
+    if (arena->prof_live != NULL) {
+        arena->prof_live->prev = sample;
+    }
+    arena->prof_live = sample;
+    arena->prof_count++;
+    meta->sample = sample;
+}
+
+/**
+ * Drops the heap profile sample of a block being freed, if it has one.
+ * Only blocks with a side table entry are looked up. Callers hold the
+ * arena's lock.
+ * @param block - header of the block.
+ */
+static void prof_release(struct mem_block *block)
+{
+    struct prof_sample *sample;
+    struct block_meta *meta;
+    struct arena *arena;
+
+    if (!block->named) {
+        return;
+    }
+
+    arena = block_arena(block);
+    meta = meta_find(arena, block);
+    if (meta == NULL || meta->sample == NULL) {
+        return;
+    }
+    sample = meta->sample;
+    meta->sample = NULL;
+
+    if (sample->prev != NULL) {
+        sample->prev->next = sample->next;
+    }
+    else {
+        arena->prof_live = sample->next;
+    }
+    if (sample->next != NULL) {
+        sample->next->prev = sample->prev;
+    }
+    arena->prof_count--;
+
+    sample->next = arena->prof_spare;
+    arena->prof_spare = sample;
+}
+
+/**
+ * Removes a region from the retained list.
+ * @param node - retention record of the region.
+ */
+static void retained_unlink(struct retained_region *node)
+{
+    struct mem_region *region = ((struct mem_region *) node) - 1;
+    struct arena *arena = region->arena;
+
+    if (node->prev != NULL) {
+        node->prev->next = node->next;
+    }
+    else {
+        arena->retained = node->next;
+    }
+    if (node->next != NULL) {
+        node->next->prev = node->prev;
+    }
+    else {
+        arena->retained_tail = node->prev;
+    }
+    arena->retained_bytes -= region->size;
+}
+
+/**
+ * Gives a region that is in no list back to the operating system.
+ * @param region - header of the region; not a large block.
+ */
+static void region_unmap(struct mem_region *region)
+{
+    region->arena->stats.mapped -= region->size;
+    if (region->flags & (REGION_HUGE | REGION_HUGETLB)) {
+        region->arena->stats.huge_mapped -= region->size;
+    }
+    region->arena->stats.unmaps++;
+    if (munmap(region, region->size) != 0) {
+        perror("munmap");
+    }
+}
+
+/**
+ * Gives a retained region back to the operating system.
+ * @param node - retention record of the region.
+ */
+static void retained_unmap(struct retained_region *node)
+{
+    struct mem_region *region = ((struct mem_region *) node) - 1;
+
+    retained_unlink(node);
+    LOG_INFO("UNMAPPING RETAINED REGION %p\n", region);
+    region_unmap(region);
+}
+
+/**
+ * Ages the retained regions: regions empty for ALLOCATOR_RETAIN_DECAY_MS are
+ * purged with madvise, and unmapped once they have been empty twice as long.
+ * @param arena - arena whose regions are aged.
+ * @param now - current time in milliseconds.
+ */
+static void retain_decay(struct arena *arena, unsigned long now)
+{
+    struct retained_region *node = arena->retained, *next;
+    struct mem_region *region;
+    size_t page_sz = getpagesize();
+
+    /* The list is ordered by age, so stop at the first young region */
+    while (node != NULL && now - node->retired_ms >= g_retain_decay_ms) {
+        next = node->next;
+        region = ((struct mem_region *) node) - 1;
+
+        if (now - node->retired_ms >= 2 * g_retain_decay_ms) {
+            retained_unmap(node);
+        }
+        else if (!node->purged && (region->flags & REGION_HUGETLB)) {
+            /* The hugetlb pool only takes whole mappings back */
+            node->purged = true;
+        }
+        else if (!node->purged) {
+            /* Keep the first page: it holds the headers */
+            node->zeroed = false;
+#ifdef MADV_FREE
+            if (madvise(((char *) region) + page_sz,
+                        region->size - page_sz, MADV_FREE) != 0)
+#endif
+            node->zeroed = madvise(((char *) region) + page_sz,
+                    region->size - page_sz, MADV_DONTNEED) == 0;
+            node->purged = true;
+        }
+
+        node = next;
+    }
+}
+
+/**
+ * Periodically purges retained regions when ALLOCATOR_BACKGROUND_PURGE is
+ * set to "1", so idle processes give memory back too.
+ * @param arg - unused.
+ * @returns never.
+ */
+static void *retain_purge_thread(void *arg)
+{
+    struct timespec ts;
+    struct arena *arena;
+
+    (void) arg;
+    ts.tv_sec = g_retain_decay_ms / 2000;
+    ts.tv_nsec = (g_retain_decay_ms / 2 % 1000) * 1000000 + 1;
+
+    for (;;) {
+        nanosleep(&ts, NULL);
+        for (arena = arena_next(NULL); arena != NULL;
+                arena = arena_next(arena)) {
+            arena_lock(arena);
+            remote_drain(arena);
+            retain_decay(arena, now_ms());
+            arena_unlock(arena);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Starts the background purge thread.
+ */
+static void retain_start_thread(void)
+{
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, retain_purge_thread, NULL) == 0) {
+        pthread_detach(thread);
+    }
+}
+
+/**
+ * Keeps an empty region for reuse instead of unmapping it right away. The
+ * region must already be unlinked from the region list.
+ * @param region - header of the empty region.
+ */
+static void retain_region(struct mem_region *region)
+{
+    struct retained_region *node = (struct retained_region *) (region + 1);
+    struct arena *arena = region->arena;
+    unsigned long now = now_ms();
+
+    LOG_INFO("RETAINING EMPTY REGION %p\n", region);
+    node->retired_ms = now;
+    node->purged = false;
+    node->zeroed = false;
+    node->next = NULL;
+    node->prev = arena->retained_tail;
+    if (arena->retained_tail != NULL) {
+        arena->retained_tail->next = node;
+    }
+    else {
+        arena->retained = node;
+    }
+    arena->retained_tail = node;
+    arena->retained_bytes += region->size;
+
+    /* Enforce the limit by dropping the oldest regions */
+    while (arena->retained != NULL && arena->retained_bytes > g_retain_max) {
+        retained_unmap(arena->retained);
+    }
+    retain_decay(arena, now);
+}
+
+/**
+ * Takes a retained region that can hold a block of the given size, trying
+ * the most recently emptied (and so most likely resident) regions first.
+ * @param arena - arena to take the region from.
+ * @param size - full size of the region needed (including headers).
+ * @returns header of the region, or NULL if none is large enough.
+ */
+static struct mem_region *retained_take(struct arena *arena, size_t size)
+{
+    struct retained_region *node;
+    struct mem_region *region;
+
+    if (arena->retained == NULL) {
+        return NULL;
+    }
+    retain_decay(arena, now_ms());
+
+    for (node = arena->retained_tail; node != NULL; node = node->prev) {
+        region = ((struct mem_region *) node) - 1;
+        if (region->size >= size) {
+            retained_unlink(node);
+            LOG_INFO("REUSING RETAINED REGION %p\n", region);
+
+            /* Only pages dropped with MADV_DONTNEED are known to be zero */
+            region->clean = node->zeroed ? (size_t) getpagesize()
+                : region->size;
+            return region;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Maps the memory of a new region. With ALLOCATOR_HUGEPAGES set, the mapping
+ * is aligned to HUGE_PAGE_SIZE and backed by huge pages: from the hugetlb
+ * pool if asked for and it has pages left, otherwise transparent huge pages.
+ * Whatever isn't available falls back quietly to the next option, down to
+ * normal pages.
+ * @param size - size of the mapping; a multiple of HUGE_PAGE_SIZE when huge
+ *               pages are enabled.
+ * @param flags - set to the REGION_HUGE* flags describing the mapping.
+ * @returns the mapping, or MAP_FAILED.
+ */
+static void *region_map(size_t size, unsigned int *flags)
+{
+    size_t slack = HUGE_PAGE_SIZE - getpagesize(), lead;
+    char *map;
+
+    *flags = 0;
+    if (g_huge_pages == HUGE_OFF) {
+        return mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+
+#ifdef MAP_HUGETLB
+    if (g_huge_pages == HUGE_TLB) {
+#ifdef MAP_HUGE_SHIFT
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB
+                | (HUGE_PAGE_SHIFT << MAP_HUGE_SHIFT), -1, 0);
+#else
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+        if (map != MAP_FAILED) {
+            *flags = REGION_HUGETLB;
+            return map;
+        }
+    }
+#endif
+
+    /* Reserve enough to trim the mapping to an aligned start */
+    map = mmap(NULL, size + slack, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        return mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    lead = -(uintptr_t) map & (HUGE_PAGE_SIZE - 1);
+    if (lead != 0) {
+        munmap(map, lead);
+    }
+    if (lead != slack) {
+        munmap(map + lead + size, slack - lead);
+    }
+    map += lead;
+
+#ifdef MADV_HUGEPAGE
+    if (madvise(map, size, MADV_HUGEPAGE) == 0) {
+        *flags = REGION_HUGE;
+    }
+#endif
+    return map;
+}
+
+/**
+ * Maps a new region for an arena and creates a block in it.
+ * @see region_chunk_size for how large the region is.
+ * @param arena - arena the region is added to.
+ * @param size - full size of the block which is allocated (including header).
+ * @returns pointer to the block which is a single block for newly allocated 
+ *          region.
+ */
+void *expand_heap(struct arena *arena, size_t size)
+{
+    size_t page_sz = g_huge_pages != HUGE_OFF
+        ? HUGE_PAGE_SIZE : (size_t) getpagesize();
+    size_t num_pages, region_size;
+    unsigned int flags;
+    struct mem_block *block;
+
+    /* The region starts with a header of its own */
+    size += sizeof(struct mem_region);
+
+    /* Prefer an empty region that was kept around */
+    struct mem_region *region = retained_take(arena, size);
+
+    if (region != NULL) {
+        region_size = region->size;
+        flags = region->flags & (REGION_HUGE | REGION_HUGETLB);
+    }
+    else {
+        /* With huge pages enabled, regions are made of whole huge pages */
+        size = region_chunk_size(arena, size);
+        num_pages = size / page_sz;
+        if ((size % page_sz) != 0) {
+            num_pages++;
+        }
+        region_size = num_pages * page_sz;
+
+        region = region_map(region_size, &flags);
+        if (region == MAP_FAILED) {
+            perror("mmap");
+            return NULL;
+        }
+        arena->stats.mapped += region_size;
+        if (flags != 0) {
+            arena->stats.huge_mapped += region_size;
+        }
+        arena->stats.maps++;
+
+        /* Fresh anonymous memory is zero past the headers */
+        region->clean = sizeof(struct mem_region) + sizeof(struct mem_block);
+    }
+
+    region->size = region_size;
+    region->id = __atomic_fetch_add(&g_regions, 1, __ATOMIC_RELAXED);
+    region->arena = arena;
+    region->live_blocks = 0;
+    region->flags = flags;
+    region->usage = 0;
+    region->next = NULL;
+    region->prev = NULL;
+
+    /* A single free block spans the rest of the region */
+    block = region_first(region);
+    block->size = (region_size - sizeof(struct mem_region)) / MEM_UNIT;
+    block->usage = 0;
+    block->prev_size = 0;
+    block->region_offset = sizeof(struct mem_region) / MEM_UNIT;
+    meta_track(block);
+    
+    /* Add the region at the end of the list */
+    if (arena->head == NULL) {
+        arena->head = region;
+    }
+    else {
+        arena->tail->next = region;
+        region->prev = arena->tail;
+    }
+    arena->tail = region;
+    fit_insert(block);
+
+    /* Return block of expanded region */
+     LOG_INFO("ALLOCATED NEW REGION AT %p\n", region);
+    return block;    
+}
+
+/**
+ * Returns the size from which blocks get a mapping of their own.
+ * @returns the threshold in bytes (including the header).
+ */
+static size_t large_threshold(void)
+{
+    if (g_large_threshold == 0) {
+        g_large_threshold = env_size("ALLOCATOR_LARGE_THRESHOLD",
+                LARGE_THRESHOLD);
+    }
+    return g_large_threshold;
+}
+
+/**
+ * Rounds a size up to whole pages.
+ * @param size - size in bytes.
+ * @returns the rounded size.
+ */
+static size_t page_round(size_t size)
+{
+    size_t page_sz = getpagesize();
+
+    return (size + page_sz - 1) / page_sz * page_sz;
+}
+
+/**
+ * Finds the start of the mapping of a large block. The region header is at
+ * the start of the mapping unless the block was placed for an alignment.
+ * @param region - header of the large block's region.
+ * @returns the page the region header lies in.
+ */
+static char *large_base(struct mem_region *region)
+{
+    return (char *) (((uintptr_t) region) & ~((uintptr_t) getpagesize() - 1));
+}
+
+/**
+ * Points the neighbours of a large block (and the arena's list) at its
+ * region after the block has been created or moved.
+ * @param region - header of the large block's region.
+ */
+static void large_relink(struct mem_region *region)
+{
+    if (region->prev != NULL) {
+        region->prev->next = region;
+    }
+    else {
+        region->arena->large = region;
+    }
+    if (region->next != NULL) {
+        region->next->prev = region;
+    }
+}
+
+/**
+ * Allocates a large block in a mapping of its own. Such blocks are never
+ * carved up or indexed, so they can be resized with mremap. Their sizes may
+ * not fit into the block header and are kept in the region header instead;
+ * region->size counts the bytes from the region header to the mapping end.
+ * @param arena - arena the block is added to.
+ * @param actual_size - full size of the block (including header).
+ * @param alignment - alignment of the data area, a power of two.
+ * @returns header of the block, or NULL if the mapping failed.
+ */
+static struct mem_block *large_alloc(struct arena *arena, size_t actual_size,
+        size_t alignment)
+{
+    size_t headers = sizeof(struct mem_region) + sizeof(struct mem_block);
+    size_t map_size, pad = alignment > MEM_UNIT ? alignment - MEM_UNIT : 0;
+    struct mem_region *region;
+    struct mem_block *block;
+    char *map, *data, *base, *end;
+
+    map_size = page_round(headers + pad + actual_size);
+    map = mmap(NULL, map_size,
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+
+    /* Place the data at the first aligned address after the headers and
+     * hand the whole pages around it back */
+    data = (char *) ((((uintptr_t) map) + headers + alignment - 1)
+            & ~((uintptr_t) alignment - 1));
+    region = (struct mem_region *) (data - headers);
+    base = large_base(region);
+    end = map + page_round(data + actual_size - sizeof(struct mem_block)
+            - map);
+    if (base != map) {
+        munmap(map, base - map);
+    }
+    if (end != map + map_size) {
+        munmap(end, map + map_size - end);
+    }
+
+    /* Let transparent huge pages back the aligned parts of the block */
+#ifdef MADV_HUGEPAGE
+    if (g_huge_pages != HUGE_OFF && (size_t) (end - base) >= HUGE_PAGE_SIZE) {
+        madvise(base, end - base, MADV_HUGEPAGE);
+    }
+#endif
+
+    region->size = end - (char *) region;
+    arena->stats.large_mapped += end - base;
+    arena->stats.large_blocks++;
+    arena->stats.maps++;
+    region->id = __atomic_fetch_add(&g_regions, 1, __ATOMIC_RELAXED);
+    region->arena = arena;
+    region->live_blocks = 1;
+    region->flags = REGION_LARGE;
+    region->usage = actual_size;
+    region->prev = NULL;
+    region->next = arena->large;
+    large_relink(region);
+
+    block = region_first(region);
+    block->size = 0;
+    block->usage = 0;
+    block->prev_size = 0;
+    block->region_offset = sizeof(struct mem_region) / MEM_UNIT;
+    meta_track(block);
+
+    LOG_INFO("MAPPED LARGE BLOCK AT %p\n", block);
+    return block;
+}
+
+/**
+ * Unmaps a large block.
+ * @param block - header of the large block.
+ */
+static void large_free(struct mem_block *block)
+{
+    struct mem_region *region = block_region(block);
+    size_t map_size = ((char *) region) + region->size - large_base(region);
+
+    meta_forget(block);
+    if (region->prev != NULL) {
+        region->prev->next = region->next;
+    }
+    else {
+        region->arena->large = region->next;
+    }
+    if (region->next != NULL) {
+        region->next->prev = region->prev;
+    }
+
+    region->arena->stats.large_mapped -= map_size;
+    region->arena->stats.large_blocks--;
+    region->arena->stats.unmaps++;
+
+    LOG_INFO("UNMAPPING LARGE BLOCK AT %p\n", block);
+    if (munmap(large_base(region), map_size) != 0) {
+        perror("munmap");
+    }
+}
+
+/**
+ * Grows or shrinks a large block with mremap, so no bytes are copied even
+ * if the mapping has to move. The data keeps its offset within the page.
+ * @param block - header of the large block.
+ * @param actual_size - new full size of the block (including header).
+ * @returns header of the (possibly moved) block, or NULL on failure.
+ */
+static struct mem_block *large_resize(struct mem_block *block,
+        size_t actual_size)
+{
+    struct mem_region *region = block_region(block), *moved;
+    char *base = large_base(region), *map;
+    size_t lead = ((char *) region) - base;
+    size_t map_size = page_round(lead + sizeof(struct mem_region)
+            + actual_size);
+
+    if (map_size != lead + region->size) {
+        /* The usable size follows the mapping */
+        block_account(block, false);
+        map = mremap(base, lead + region->size, map_size, MREMAP_MAYMOVE);
+        if (map == MAP_FAILED) {
+            perror("mremap");
+            block_account(block, true);
+            return NULL;
+        }
+        moved = (struct mem_region *) (map + lead);
+        moved->arena->stats.large_mapped += map_size - lead - moved->size;
+
+        /* The side table is keyed by header address */
+        if (moved != region && region_first(moved)->named) {
+            meta_move(block, region_first(moved));
+        }
+
+        region = moved;
+        region->size = map_size - lead;
+        large_relink(region);
+        block_account(region_first(region), true);
+    }
+
+    region->usage = actual_size;
+    return region_first(region);
+}
+
+/**
+ * Finds the page map entry describing the slab granule an address lies in.
+ * @param addr - address inside the granule.
+ * @param create - if true, a missing second level of the map is allocated.
+ * @returns pointer to the entry, or NULL if the address isn't covered.
+ */
+static struct slab **pagemap_entry(const void *addr, bool create)
+{
+    uintptr_t granule = ((uintptr_t) addr) >> SLAB_SHIFT;
+    uintptr_t root = granule >> PAGEMAP_LEVEL_BITS;
+    struct slab **leaf, **created;
+
+    if (root >= PAGEMAP_LEVEL_SIZE) {
+        return NULL;
+    }
+
+    leaf = __atomic_load_n(&g_pagemap[root], __ATOMIC_ACQUIRE);
+    if (leaf == NULL) {
+        if (!create) {
+            return NULL;
+        }
+
+        /* Arenas may race to create the same second level */
+        created = mmap(NULL, PAGEMAP_LEVEL_SIZE * sizeof(struct slab *),
+                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (created == MAP_FAILED) {
+            perror("mmap");
+            return NULL;
+        }
+        if (__atomic_compare_exchange_n(&g_pagemap[root], &leaf, created,
+                    false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            leaf = created;
+        }
+        else {
+            munmap(created, PAGEMAP_LEVEL_SIZE * sizeof(struct slab *));
+        }
+    }
+
+    return &leaf[granule & (PAGEMAP_LEVEL_SIZE - 1)];
+}
+
+/**
+ * Finds the slab that holds an object. Safe to call without the heap lock.
+ * @param ptr - data pointer returned by the allocator.
+ * @returns the slab, or NULL if the pointer belongs to a regular block.
+ */
+static struct slab *slab_of(const void *ptr)
+{
+    struct slab **entry = pagemap_entry(ptr, false);
+
+    if (entry == NULL) {
+        return NULL;
+    }
+    return __atomic_load_n(entry, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Maps a request size to the small object class serving it.
+ * Class n holds objects of (n + 1) * SLAB_CLASS_SIZE bytes.
+ * @param size - requested size of the data area (at most SLAB_MAX_SIZE).
+ * @returns index of the size class.
+ */
+static size_t slab_class(size_t size)
+{
+    if (size == 0) {
+        return 0;
+    }
+    return (size - 1) / SLAB_CLASS_SIZE;
+}
+
+/**
+ * Returns the size of the objects in a small object class.
+ * @param cls - index of the size class.
+ * @returns object size in bytes.
+ */
+static size_t slab_object_size(size_t cls)
+{
+    return (cls + 1) * SLAB_CLASS_SIZE;
+}
+
+/**
+ * Pushes a slab to the front of a slab list.
+ * @param list - head of the list.
+ * @param slab - slab to add.
+ */
+static void slab_link(struct slab **list, struct slab *slab)
+{
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list != NULL) {
+        (*list)->prev = slab;
+    }
+    *list = slab;
+}
+
+/**
+ * Removes a slab from a slab list.
+ * @param list - head of the list.
+ * @param slab - slab to remove.
+ */
+static void slab_unlink(struct slab **list, struct slab *slab)
+{
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    }
+    else {
+        *list = slab->next;
+    }
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = slab->prev = NULL;
+}
+
+/**
+ * Checks whether a slab has handed out every object it can hold.
+ * @param slab - slab to check.
+ * @returns true if no object is left.
+ */
+static bool slab_full(struct slab *slab)
+{
+    return slab->free_list == NULL
+        && slab->bump + slab_object_size(slab->cls) > slab->end;
+}
+
+/**
+ * Carves a new slab out of the current slab region, mapping a new region
+ * through expand_heap when the current one is used up.
+ * @param arena - arena the slab is carved for.
+ * @returns the new slab (not yet assigned to a class), or NULL on failure.
+ */
+static struct slab *slab_carve(struct arena *arena)
+{
+    struct slab_region *region = arena->slab_region;
+    struct mem_block *block;
+    struct block_meta *meta;
+    struct slab **entry;
+    struct slab *slab;
+    char *granule;
+
+    if (region == NULL
+            || region->carved == region->region.size / SLAB_SIZE) {
+        block = expand_heap(arena, SLAB_REGION_SIZE);
+        if (block == NULL) {
+            return NULL;
+        }
+        region = (struct slab_region *) block_region(block);
+
+        /* The region block is fully used so the fit algorithms skip it */
+        fit_remove(&region->block);
+        region->block.usage = region->block.size;
+        region_touch(&region->block);
+        region->region.live_blocks = 1;
+        block_account(&region->block, true);
+        meta = meta_get(&region->block);
+        if (meta != NULL) {
+            strcpy(meta->name, "slabs");
+        }
+        region->carved = 0;
+        region->live = 0;
+        arena->slab_region = region;
+    }
+
+    /* The first slab shares its granule with the region header */
+    granule = ((char *) region) + region->carved * SLAB_SIZE;
+    slab = region->carved == 0
+        ? (struct slab *) (region + 1) : (struct slab *) granule;
+
+    entry = pagemap_entry(granule, true);
+    if (entry == NULL) {
+        return NULL;
+    }
+
+    slab->region = region;
+    slab->end = granule + SLAB_SIZE;
+    region->carved++;
+    region->live++;
+    __atomic_store_n(entry, slab, __ATOMIC_RELEASE);
+
+    return slab;
+}
+
+/**
+ * Prepares a slab for a size class, preferring slabs on the empty list over
+ * carving new ones.
+ * @param arena - arena the slab is created in.
+ * @param cls - size class the slab will serve.
+ * @returns the slab (already on the partial list), or NULL on failure.
+ */
+static struct slab *slab_create(struct arena *arena, size_t cls)
+{
+    struct slab *slab = arena->slab_empty;
+
+    if (slab != NULL) {
+        slab_unlink(&arena->slab_empty, slab);
+        slab->region->live++;
+    }
+    else {
+        slab = slab_carve(arena);
+        if (slab == NULL) {
+            return NULL;
+        }
+    }
+
+    slab->cls = cls;
+    slab->live = 0;
+    slab->free_list = NULL;
+    slab->bump = (char *) ((((uintptr_t) (slab + 1)) + SLAB_CLASS_SIZE - 1)
+            & ~((uintptr_t) SLAB_CLASS_SIZE - 1));
+    slab_link(&arena->slab_partial[cls], slab);
+
+    return slab;
+}
+
+/**
+ * Moves a slab that no longer holds objects to the empty list. Once every
+ * slab of a fully carved region is empty, the region itself is unmapped.
+ * @param slab - the empty slab.
+ */
+static void slab_release(struct slab *slab)
+{
+    struct slab_region *region = slab->region;
+    struct arena *arena = region->region.arena;
+    struct slab **entry;
+    size_t i;
+
+    slab_link(&arena->slab_empty, slab);
+    region->live--;
+    if (region->live > 0 || region == arena->slab_region) {
+        return;
+    }
+
+    /* Forget all slabs of the region before it goes away */
+    for (i = 0; i < region->carved; i++) {
+        entry = pagemap_entry(((char *) region) + i * SLAB_SIZE, false);
+        slab_unlink(&arena->slab_empty, *entry);
+        __atomic_store_n(entry, NULL, __ATOMIC_RELEASE);
+    }
+
+    free_block_unsafe(&region->block + 1);
+}
+
+/**
+ * Allocates an object of a small size class.
+ * @param arena - arena to allocate from.
+ * @param cls - size class of the object.
+ * @returns pointer to the object, or NULL if the heap is exhausted.
+ */
+static void *slab_alloc_unsafe(struct arena *arena, size_t cls)
+{
+    struct slab *slab = arena->slab_partial[cls];
+    void *obj;
+
+    if (slab == NULL && (slab = slab_create(arena, cls)) == NULL) {
+        return NULL;
+    }
+
+    if (slab->free_list != NULL) {
+        obj = slab->free_list;
+        slab->free_list = *((void **) obj);
+    }
+    else {
+        obj = slab->bump;
+        slab->bump += slab_object_size(cls);
+    }
+    slab->live++;
+
+    /* Full slabs leave the partial list until an object is freed */
+    if (slab_full(slab)) {
+        slab_unlink(&arena->slab_partial[cls], slab);
+    }
+
+    return obj;
+}
+
+/**
+ * Returns an object to its slab.
+ * @param slab - slab holding the object.
+ * @param ptr - the object to free.
+ */
+static void slab_free_unsafe(struct slab *slab, void *ptr)
+{
+    struct arena *arena = slab->region->region.arena;
+
+    if (slab_full(slab)) {
+        slab_link(&arena->slab_partial[slab->cls], slab);
+    }
+
+    *((void **) ptr) = slab->free_list;
+    slab->free_list = ptr;
+    slab->live--;
+
+    if (slab->live == 0) {
+        slab_unlink(&arena->slab_partial[slab->cls], slab);
+        slab_release(slab);
+    }
+}
+
+/**
+ * Fills freshly allocated data with 0xAA bytes if the environment variable
+ * ALLOCATOR_SCRIBBLE is set to "1".
+ * @param ptr - data pointer of the allocated block.
+ * @param size - number of bytes to fill.
+ */
+void scribble_data(void *ptr, size_t size)
+{
+    char *scribble = getenv("ALLOCATOR_SCRIBBLE");
+    if (scribble != NULL && strcmp(scribble, "1") == 0) {
+        memset(ptr, 0xaa, size);
+    }
+}
+
+/**
+ * Splits a new block off the end of another one. The old block keeps
+ * everything before the offset, so any gap after its usage stays its slack.
+ * Callers take care of the free space index and the live block count.
+ * @param block - header of the block to split.
+ * @param offset - where the new block starts, in MEM_UNITs from the block.
+ * @param units - usage of the new block in MEM_UNITs.
+ * @returns header of the new block.
+ */
+static struct mem_block *block_split(struct mem_block *block,
+        uint32_t offset, uint32_t units)
+{
+    struct mem_block *new, *next;
+
+    new = (struct mem_block *) (((void *) block) + (size_t) offset * MEM_UNIT);
+    new->size = block->size - offset;
+    new->usage = units;
+    new->prev_size = offset;
+    new->region_offset = block->region_offset + offset;
+    meta_track(new);
+
+    /* Remove the spent size from the old block */
+    block->size = offset;
+    next = block_next(new);
+    if (next != NULL) {
+        next->prev_size = new->size;
+    }
+
+    return new;
+}
+
+/**
+ * Allocates a block from the block list, or a large block, with its data
+ * area aligned to the given boundary. For alignments above MEM_UNIT, the
+ * search asks for enough slack to cover the worst-case padding, but the block
+ * is placed at the first aligned spot, so the padding actually used is left
+ * as slack of the block before it rather than being wasted.
+ * @param arena - arena to allocate from.
+ * @param size - size of the memory segment to allocate.
+ * @param alignment - required alignment, a power of two of at least MEM_UNIT.
+ * @param dirty - if not NULL, receives how many leading bytes of the data
+ *        may not be zero, and the data isn't scribbled.
+ * @returns header of the allocated block, or NULL on failure.
+ */
+static struct mem_block *block_alloc_unsafe(struct arena *arena, size_t size,
+        size_t alignment, size_t *dirty)
+{
+    struct mem_block *allocated, *new;
+    struct mem_region *region;
+    size_t actual_size, search_size, clean;
+    uintptr_t data;
+    uint32_t units;
+
+    /* Sizes this close to SIZE_MAX can't be mapped anyway */
+    if (size > SIZE_MAX / 2 || alignment > SIZE_MAX / 4) {
+        return NULL;
+    }
+
+    /* Align the memory and include the block header into needed size */
+    actual_size = block_size_for(size);
+    search_size = actual_size + alignment - MEM_UNIT;
+
+    /* Large blocks get a mapping of their own, fresh and so zero */
+    if (search_size >= large_threshold() || search_size > BLOCK_MAX_SIZE) {
+        allocated = large_alloc(arena, actual_size, alignment);
+        if (allocated != NULL) {
+            block_account(allocated, true);
+        }
+        if (dirty != NULL) {
+            *dirty = 0;
+        }
+        else if (allocated != NULL) {
+            scribble_data((void *) (allocated + 1), size);
+        }
+        return allocated;
+    }
+    units = actual_size / MEM_UNIT;
+    
+    /* Check maybe we can use some existing block */
+    allocated = (struct mem_block *) reuse(arena, search_size);
+    
+    /* If no suitable block exists, expand to the new region */
+    if (allocated == NULL) {
+        allocated = (struct mem_block *) expand_heap(arena, search_size);
+        if (allocated == NULL) {
+            return NULL;
+        }
+    }
+
+    /* Make sure that current block can hold new data */
+    if ((size_t) (allocated->size - allocated->usage) * MEM_UNIT
+            < search_size) {
+        LOG_ERROR("WEIRD, CHOSEN BLOCK HASN'T ENOUGH SPACE %p\n", allocated);
+    }
+
+    /* The slack of the chosen block is about to change */
+    fit_remove(allocated);
+
+    /* One more block of the region is in use */
+    region = block_region(allocated);
+    region->live_blocks++;
+
+    /* First aligned data area after the part of the block in use */
+    data = ((uintptr_t) (allocated + 1)) + (size_t) allocated->usage * MEM_UNIT;
+    data = (data + alignment - 1) & ~((uintptr_t) alignment - 1);
+
+    /* Anything below the clean offset may have been written to; read it
+     * before the index writes links into the slack left after the block */
+    if (dirty != NULL) {
+        clean = (uintptr_t) region + region->clean;
+        *dirty = data >= clean ? 0 : clean - data < size ? clean - data : size;
+    }
+
+    /* If the block is free and aligned, just use it */
+    if (data == (uintptr_t) (allocated + 1)) {
+        allocated->usage = units;
+        fit_insert(allocated);
+    }
+    else {
+        /* Else, split this block into the old one and new; any padding
+         * stays slack of the old one */
+        new = block_split(allocated,
+                (data - (uintptr_t) (allocated + 1)) / MEM_UNIT, units);
+        fit_insert(allocated);
+        allocated = new;
+        fit_insert(allocated);
+    }
+    block_account(allocated, true);
+    region_touch(allocated);
+
+    /* Scribble if needed */
+    if (dirty == NULL) {
+        scribble_data((void *) (allocated + 1), size);
+    }
+
+    /* Return allocated block */
+    /* LOG("FINAL ALLOCATION RESULT %p\n", allocated + 1); */
+    return allocated;
+}
+
+/**
+ * Allocates an unnamed memory block with a given size from the block list.
+ * If environment variable ALLOCATOR_SCRIBBLE is set to "1" then
+ * allocated data memory is filled with 0xAA bytes.
+ * @see block_alloc_unsafe for the implementation of the allocation itself.
+ * @param arena - arena to allocate from.
+ * @param size - size of the memory segment to allocate.
+ * @returns pointer to the first byte of data inside the allocated segment.
+ */
+void *malloc_block_unsafe(struct arena *arena, size_t size)
+{
+    struct mem_block *allocated = block_alloc_unsafe(arena, size, MEM_UNIT,
+            NULL);
+
+    return allocated == NULL ? NULL : (void *) (allocated + 1);
+}
+
+/**
+ * Allocates a memory block whose data area is aligned to the given boundary.
+ * @see block_alloc_unsafe for the implementation of the allocation itself.
+ * @param arena - arena to allocate from.
+ * @param alignment - required alignment, a power of two.
+ * @param size - size of the memory segment to allocate.
+ * @returns pointer to the first byte of data inside the allocated segment.
+ */
+void *malloc_aligned_unsafe(struct arena *arena, size_t alignment,
+        size_t size)
+{
+    struct mem_block *allocated;
+
+    /* Every data area is aligned to a unit */
+    if (alignment <= MEM_UNIT) {
+        return malloc_unsafe(arena, size);
+    }
+
+    allocated = block_alloc_unsafe(arena, size, alignment, NULL);
+    return allocated == NULL ? NULL : (void *) (allocated + 1);
+}
+
+/**
+ * Allocates an unnamed memory block with a given size. Requests of up to
+ * SLAB_MAX_SIZE bytes are served from slabs, larger ones from the block list.
+ * Tagged arenas serve everything from the block list, so arena_reset only
+ * has regions to unmap.
+ * @see malloc_block_unsafe for the block list allocation.
+ * @param arena - arena to allocate from.
+ * @param size - size of the memory segment to allocate.
+ * @returns pointer to the first byte of data inside the allocated segment.
+ */
+void *malloc_unsafe(struct arena *arena, size_t size)
+{
+    size_t cls;
+    void *ptr;
+
+    if (size > SLAB_MAX_SIZE || arena->tag[0] != '\0') {
+        return malloc_block_unsafe(arena, size);
+    }
+
+    cls = slab_class(size);
+    ptr = slab_alloc_unsafe(arena, cls);
+    if (ptr != NULL) {
+        scribble_data(ptr, slab_object_size(cls));
+    }
+    return ptr;
+}
+
+/**
+ * Carves a run of blocks of the same size out of a single free stretch of
+ * memory: one search (or one new region) for the whole run, which is then
+ * split block after block, each one taking the slack left by the one before.
+ * @param arena - arena to allocate from.
+ * @param size - size of the data area of each block.
+ * @param n - number of blocks wanted.
+ * @param out - receives the data pointers.
+ * @returns number of blocks carved, at most n (0: the heap is exhausted).
+ */
+static size_t block_batch_unsafe(struct arena *arena, size_t size, size_t n,
+        void **out)
+{
+    size_t actual_size = block_size_for(size), i;
+    struct mem_block *first, *block;
+    struct mem_region *region;
+    uint32_t units = actual_size / MEM_UNIT;
+
+    /* Keep runs within the size regions grow to */
+    if (n > g_region_chunk_max / actual_size) {
+        n = g_region_chunk_max / actual_size > 0
+            ? g_region_chunk_max / actual_size : 1;
+    }
+
+    first = reuse(arena, n * actual_size);
+    if (first == NULL) {
+        first = expand_heap(arena, n * actual_size);
+        if (first == NULL) {
+            return 0;
+        }
+    }
+    fit_remove(first);
+    region = block_region(first);
+
+    /* A free region head takes the first block itself */
+    block = first;
+    for (i = 0; i < n; i++) {
+        if (block->usage == 0) {
+            block->usage = units;
+        }
+        else {
+            block = block_split(block, block->usage, units);
+        }
+        region_touch(block);
+        block_account(block, true);
+        scribble_data((void *) (block + 1), size);
+        out[i] = block + 1;
+    }
+    region->live_blocks += n;
+
+    /* Only the ends of the run can have slack left */
+    fit_insert(first);
+    if (block != first) {
+        fit_insert(block);
+    }
+    return n;
+}
+
+/**
+ * Allocates a number of unnamed blocks of the same size. Small objects come
+ * from slabs one after another, which bump through the same slab; other
+ * blocks are carved in runs by block_batch_unsafe.
+ * @param arena - arena to allocate from.
+ * @param size - size of each memory segment.
+ * @param n - number of segments to allocate.
+ * @param out - receives the data pointers.
+ * @returns number of segments allocated; fewer than n if the heap ran out.
+ */
+size_t malloc_batch_unsafe(struct arena *arena, size_t size, size_t n,
+        void **out)
+{
+    size_t done = 0, carved;
+
+    /* Large blocks have mappings of their own, so there's nothing to share */
+    if (size <= SLAB_MAX_SIZE || size > SIZE_MAX / 2
+            || block_size_for(size) >= large_threshold()) {
+        for (; done < n; done++) {
+            out[done] = malloc_unsafe(arena, size);
+            if (out[done] == NULL) {
+                break;
+            }
+        }
+        return done;
+    }
+
+    while (done < n) {
+        carved = block_batch_unsafe(arena, size, n - done, out + done);
+        if (carved == 0) {
+            break;
+        }
+        done += carved;
+    }
+    return done;
+}
+
+/**
+ * Reads where the statistics are dumped at exit from ALLOCATOR_STATS: "1" or
+ * "stderr" select the standard error stream, anything else names a file.
+ * @returns the setting, or NULL if statistics aren't dumped.
+ */
+static const char *stats_target(void)
+{
+    const char *target = getenv("ALLOCATOR_STATS");
+
+    if (target == NULL || *target == '\0' || strcmp(target, "0") == 0) {
+        return NULL;
+    }
+    return target;
+}
+
+/**
+ * Writes a chunk of records, which may wrap around the end of a ring, to the
+ * file of a stream. Callers hold the stream's lock, so chunks don't
+ * interleave.
+ * @param stream - stream to write to.
+ * @param thread - number of the thread that made the records.
+ * @param first - the first records.
+ * @param first_count - number of records at first.
+ * @param rest - records following those at first, or NULL.
+ * @param rest_count - number of records at rest.
+ */
+static void stream_write(struct stream *stream, uint32_t thread,
+        const union stream_record *first, size_t first_count,
+        const union stream_record *rest, size_t rest_count)
+{
+    struct trace_chunk chunk = { thread, first_count + rest_count };
+    struct iovec iov[3] = {
+        { &chunk, sizeof(chunk) },
+        { (void *) first, first_count * sizeof(*first) },
+        { (void *) rest, rest_count * sizeof(*rest) },
+    };
+
+    /* Streams are best effort: a failed write only loses the records. This
+     * can't log the failure, as logging may be what is being written. */
+    if (writev(stream->fd, iov, rest_count > 0 ? 3 : 2) < 0) {
+        return;
+    }
+}
+
+/**
+ * Writes out the records a thread has buffered. Callers hold the stream's
+ * lock.
+ * @param stream - stream the ring belongs to.
+ * @param ring - buffer to write out.
+ */
+static void stream_drain(struct stream *stream, struct stream_ring *ring)
+{
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = ring->tail;
+    size_t start = tail % STREAM_RING_RECORDS, count = head - tail, first;
+
+    if (count == 0) {
+        return;
+    }
+
+    first = STREAM_RING_RECORDS - start;
+    if (first > count) {
+        first = count;
+    }
+    stream_write(stream, ring->thread, &ring->records[start], first,
+            ring->records, count - first);
+    __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * Writes out the buffered records of all threads in a stream.
+ * @param stream - the stream.
+ */
+static void stream_flush(struct stream *stream)
+{
+    struct stream_ring *ring;
+
+    if (stream->fd < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&stream->lock);
+    for (ring = stream->rings; ring != NULL; ring = ring->next) {
+        stream_drain(stream, ring);
+    }
+    pthread_mutex_unlock(&stream->lock);
+}
+
+/**
+ * Writes out the buffered records of all threads every STREAM_FLUSH_MS, so
+ * the files keep up with threads that rarely fill their buffers.
+ * @param arg - unused.
+ * @returns never.
+ */
+static void *stream_flush_thread(void *arg)
+{
+    struct timespec ts = {
+        STREAM_FLUSH_MS / 1000, STREAM_FLUSH_MS % 1000 * 1000000
+    };
+
+    (void) arg;
+    for (;;) {
+        nanosleep(&ts, NULL);
+        stream_flush(&g_trace);
+        stream_flush(&g_log);
+    }
+    return NULL;
+}
+
+/**
+ * Stops the streams in the child after a fork: the parent's buffers were
+ * copied and would be written twice. A child that runs another program
+ * starts streams of its own.
+ */
+static void stream_fork_child(void)
+{
+    if (g_trace.fd >= 0) {
+        close(g_trace.fd);
+        g_trace.fd = -1;
+    }
+    if (g_log.fd >= 0) {
+        close(g_log.fd);
+        g_log.fd = -1;
+    }
+}
+
+/**
+ * Maps the buffer of a thread for a stream and adds it to the stream's list.
+ * @param stream - the stream.
+ * @param cache - cache of the calling thread.
+ * @returns the buffer, or NULL if it couldn't be mapped.
+ */
+static struct stream_ring *stream_ring_create(struct stream *stream,
+        struct tcache *cache)
+{
+    struct stream_ring *ring;
+
+    ring = mmap(NULL, sizeof(*ring), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        return NULL;
+    }
+    ring->thread = cache->stream_thread;
+
+    pthread_mutex_lock(&stream->lock);
+    ring->next = stream->rings;
+    if (stream->rings != NULL) {
+        stream->rings->prev = ring;
+    }
+    stream->rings = ring;
+    pthread_mutex_unlock(&stream->lock);
+    return ring;
+}
+
+/**
+ * Writes out and unmaps the buffer of an exiting thread. Later records of
+ * the thread are written directly.
+ * @param stream - the stream.
+ * @param slot - where the thread keeps its buffer; cleared.
+ */
+static void stream_ring_destroy(struct stream *stream,
+        struct stream_ring **slot)
+{
+    struct stream_ring *ring = *slot;
+
+    if (ring == NULL) {
+        return;
+    }
+    *slot = NULL;
+
+    /* A forked child no longer writes, and the lock may be stuck in it */
+    if (stream->fd >= 0) {
+        pthread_mutex_lock(&stream->lock);
+        stream_drain(stream, ring);
+        if (ring->prev != NULL) {
+            ring->prev->next = ring->next;
+        }
+        else {
+            stream->rings = ring->next;
+        }
+        if (ring->next != NULL) {
+            ring->next->prev = ring->prev;
+        }
+        pthread_mutex_unlock(&stream->lock);
+    }
+    munmap(ring, sizeof(*ring));
+}
+
+/**
+ * Adds a record to a stream. The record goes to the buffer of the calling
+ * thread without locking; threads without a registered cache and records
+ * made while the process exits are written to the file directly. Neither
+ * allocates, so this may be called with an arena lock held.
+ * @param stream - the stream, which must be on.
+ * @param slot - where the calling thread keeps its buffer for the stream.
+ * @param record - the record.
+ */
+static void stream_append(struct stream *stream, struct stream_ring **slot,
+        const union stream_record *record)
+{
+    struct tcache *cache = &g_tcache;
+    struct stream_ring *ring;
+    uint64_t head;
+
+    if (cache->stream_thread == 0) {
+        cache->stream_thread =
+            __atomic_add_fetch(&g_stream_threads, 1, __ATOMIC_RELAXED);
+    }
+
+    /* Only registered caches get a buffer, as their destructor unmaps it */
+    ring = *slot;
+    if (ring == NULL && cache->registered && !cache->disabled) {
+        ring = *slot = stream_ring_create(stream, cache);
+    }
+    if (ring == NULL || stream->sync) {
+        pthread_mutex_lock(&stream->lock);
+        stream_write(stream, cache->stream_thread, record, 1, NULL, 0);
+        pthread_mutex_unlock(&stream->lock);
+        return;
+    }
+
+    /* Make room by writing the buffer out if it is full */
+    head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)
+            == STREAM_RING_RECORDS) {
+        pthread_mutex_lock(&stream->lock);
+        stream_drain(stream, ring);
+        pthread_mutex_unlock(&stream->lock);
+    }
+    ring->records[head % STREAM_RING_RECORDS] = *record;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Creates the file of a stream and writes its header. A "%p" in the file
+ * name is replaced with the process ID, so programs started by a traced
+ * program don't overwrite its files.
+ * @param stream - the stream; turned on if the file could be written.
+ * @param path - name of the file.
+ * @param header - header of the file.
+ * @param len - size of the header.
+ * @returns the file descriptor, or -1 on failure.
+ */
+static int stream_open(struct stream *stream, const char *path,
+        const void *header, size_t len)
+{
+    const char *marker = strstr(path, "%p");
+    char name[PATH_MAX], digits[16];
+    size_t prefix, count = 0;
+    int fd, pid;
+
+    /* Spell out the process ID by hand; printf may allocate */
+    prefix = marker != NULL ? (size_t) (marker - path) : strlen(path);
+    if (prefix >= sizeof(name) - sizeof(digits)) {
+        return -1;
+    }
+    memcpy(name, path, prefix);
+    if (marker != NULL) {
+        for (pid = getpid(); pid > 0 || count == 0; pid /= 10) {
+            digits[count++] = '0' + pid % 10;
+        }
+        while (count > 0) {
+            name[prefix++] = digits[--count];
+        }
+        path = marker + 2;
+        if (prefix + strlen(path) >= sizeof(name)) {
+            return -1;
+        }
+        strcpy(name + prefix, path);
+    }
+    else {
+        name[prefix] = '\0';
+    }
+
+    fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOG_ERROR("CANNOT CREATE STREAM FILE (errno %d)\n", errno);
+        return -1;
+    }
+    if (write(fd, header, len) != (ssize_t) len) {
+        close(fd);
+        return -1;
+    }
+    stream->start = now_ns();
+    stream->fd = fd;
+    return fd;
+}
+
+/**
+ * Records a call in the trace, if ALLOCATOR_TRACE is set.
+ * @param op - the call.
+ * @param ptr - pointer returned by the call, or passed to free.
+ * @param arg - second argument of the call (see enum trace_op), or 0.
+ * @param size - requested size, or 0.
+ */
+static void trace_call(enum trace_op op, void *ptr, uint64_t arg,
+        size_t size)
+{
+    union stream_record record;
+
+    if (g_trace.fd < 0) {
+        return;
+    }
+
+    record.trace.time = now_ns() - g_trace.start;
+    record.trace.ptr = (uintptr_t) ptr;
+    record.trace.arg = arg;
+    record.trace.size = size < TRACE_SIZE_MAX ? size : TRACE_SIZE_MAX;
+    record.trace.op = op;
+    stream_append(&g_trace, &g_tcache.trace, &record);
+}
+
+/*
+ * Bounds of the allocator_log_sites section, provided by the linker. Weak,
+ * as the section doesn't exist if every message is compiled out.
+ */
+extern const struct log_site __start_allocator_log_sites[]
+    __attribute__((weak, visibility("hidden")));
+extern const struct log_site __stop_allocator_log_sites[]
+    __attribute__((weak, visibility("hidden")));
+
+/**
+ * Records a log message, if ALLOCATOR_LOG is set and the message's level is
+ * enabled. Called by the LOG macros of debug.h.
+ * @param site - call site of the message.
+ * @param arg0 - first argument of the message, or 0.
+ * @param arg1 - second argument of the message, or 0.
+ */
+void log_event(const struct log_site *site, uint64_t arg0, uint64_t arg1)
+{
+    union stream_record record;
+
+    if (g_log.fd < 0 || site->level > g_log_level) {
+        return;
+    }
+
+    record.log.time = now_ns() - g_log.start;
+    record.log.args[0] = arg0;
+    record.log.args[1] = arg1;
+    record.log.site = site - __start_allocator_log_sites;
+    record.log.reserved = 0;
+    stream_append(&g_log, &g_tcache.log, &record);
+}
+
+/**
+ * Opens the event log named by ALLOCATOR_LOG, if set, and describes every
+ * call site in its header. ALLOCATOR_LOG_LEVEL selects the highest level
+ * recorded (default: every level compiled in).
+ */
+static void log_config(void)
+{
+    const char *path = getenv("ALLOCATOR_LOG");
+    const struct log_site *site;
+    struct log_site_header entry;
+    struct log_header header = {
+        LOG_MAGIC, LOG_VERSION, sizeof(struct log_record),
+        __stop_allocator_log_sites - __start_allocator_log_sites, 0
+    };
+    struct iovec iov[4];
+
+    if (path == NULL || *path == '\0') {
+        return;
+    }
+    g_log_level = env_size("ALLOCATOR_LOG_LEVEL", LOG_LEVEL);
+    if (stream_open(&g_log, path, &header, sizeof(header)) < 0) {
+        return;
+    }
+
+    for (site = __start_allocator_log_sites;
+            site < __stop_allocator_log_sites; site++) {
+        iov[0] = (struct iovec) { &entry, sizeof(entry) };
+        iov[1] = (struct iovec) {
+            (void *) site->file, strlen(site->file) + 1
+        };
+        iov[2] = (struct iovec) {
+            (void *) site->func, strlen(site->func) + 1
+        };
+        iov[3] = (struct iovec) { (void *) site->fmt, strlen(site->fmt) + 1 };
+        entry.line = site->line;
+        entry.level = site->level;
+        entry.length = iov[1].iov_len + iov[2].iov_len + iov[3].iov_len;
+        if (writev(g_log.fd, iov, 4) < 0) {
+            break;
+        }
+    }
+}
+
+/**
+ * Opens the trace file named by ALLOCATOR_TRACE, if set.
+ */
+static void trace_config(void)
+{
+    const char *path = getenv("ALLOCATOR_TRACE");
+    struct trace_header header = {
+        TRACE_MAGIC, TRACE_VERSION, sizeof(struct trace_record)
+    };
+
+    if (path != NULL && *path != '\0') {
+        stream_open(&g_trace, path, &header, sizeof(header));
+    }
+}
+
+/**
+ * Opens the event log and the trace when the library is loaded, and starts
+ * the thread writing out their buffers. Runs before the program does, so no
+ * arena lock can be held while the thread is created.
+ */
+__attribute__((constructor))
+static void stream_init(void)
+{
+    pthread_t thread;
+
+    log_config();
+    trace_config();
+    if (g_trace.fd < 0 && g_log.fd < 0) {
+        return;
+    }
+
+    pthread_atfork(NULL, NULL, stream_fork_child);
+    if (pthread_create(&thread, NULL, stream_flush_thread, NULL) == 0) {
+        pthread_detach(thread);
+    }
+}
+
+/**
+ * Writes out the buffered records of all threads when the process exits.
+ * Records made after this, e.g. by later destructors, are written directly.
+ */
+__attribute__((destructor))
+static void stream_finish(void)
+{
+    g_trace.sync = true;
+    g_log.sync = true;
+    stream_flush(&g_trace);
+    stream_flush(&g_log);
+}
+
+/**
+ * Sets up the arenas and the settings they share, once. The number of
+ * arenas comes from ALLOCATOR_ARENAS (default: the number of online CPUs)
+ * and ALLOCATOR_ARENA_POLICY selects how threads are assigned to them.
+ */
+static void arena_init(void)
+{
+    char *policy = getenv("ALLOCATOR_ARENA_POLICY"), *profile;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t count;
+    unsigned int i;
+
+    count = env_size("ALLOCATOR_ARENAS", cpus > 0 ? cpus : 1);
+    if (count < 1) {
+        count = 1;
+    }
+    else if (count > ARENA_MAX) {
+        count = ARENA_MAX;
+    }
+    g_arena_count = count;
+    g_arena_policy = policy != NULL && strcmp(policy, "cpu") == 0
+        ? ARENA_CPU : ARENA_ROUND_ROBIN;
+
+    for (i = 0; i < g_arena_count; i++) {
+        pthread_mutex_init(&g_arenas[i].lock, NULL);
+        g_arenas[i].index = i;
+        g_arenas[i].fit_seed = 2463534242u + i;
+    }
+
+    /* Settings that span several variables are read before any arena runs */
+    fit_algorithm();
+    region_config();
+    retain_config();
+
+    /* Lock hold times cost two clock reads per call, so they are only
+     * measured when the statistics are going to be dumped */
+    g_stats_timing = stats_target() != NULL;
+
+    /* Sampling is on if a profile is dumped at exit or a rate is given */
+    profile = getenv("ALLOCATOR_PROFILE");
+    g_prof_rate = env_size("ALLOCATOR_PROFILE_RATE",
+            profile != NULL && *profile != '\0' ? PROF_RATE : 0);
+}
+
+/**
+ * Picks the arena the calling thread allocates from: with the round-robin
+ * policy, threads are given arenas in turn on first use and keep them; with
+ * the CPU policy, the arena of the CPU the thread is running on is used.
+ * @returns the arena.
+ */
+static struct arena *arena_get(void)
+{
+    struct arena *arena = g_thread_arena;
+    unsigned int next;
+    int cpu;
+
+    if (arena != NULL && g_arena_policy == ARENA_ROUND_ROBIN) {
+        return arena;
+    }
+    pthread_once(&g_arena_once, arena_init);
+
+    if (g_arena_policy == ARENA_CPU) {
+        cpu = sched_getcpu();
+        return &g_arenas[(cpu < 0 ? 0 : cpu) % g_arena_count];
+    }
+
+    next = __atomic_fetch_add(&g_arena_next, 1, __ATOMIC_RELAXED);
+    arena = &g_arenas[next % g_arena_count];
+    g_thread_arena = arena;
+    return arena;
+}
+
+/**
+ * Finds the arena owning an allocation. Safe to call without any lock, as
+ * the owner of a live allocation never changes.
+ * @param ptr - data pointer returned by the allocator.
+ * @returns the arena.
+ */
+static struct arena *ptr_arena(void *ptr)
+{
+    struct slab *slab = slab_of(ptr);
+
+    if (slab != NULL) {
+        return slab->region->region.arena;
+    }
+    return block_arena(((struct mem_block *) ptr) - 1);
+}
+
+/**
+ * Computes the usable size of an allocation. Needs no lock: the sizes of a
+ * live allocation are only changed by calls made with its pointer.
+ * @param ptr - data pointer returned by the allocator.
+ * @returns usable size of the data area in bytes.
+ */
+static size_t usable_size(void *ptr)
+{
+    struct slab *slab;
+
+    /* Small objects use their whole size class */
+    slab = slab_of(ptr);
+    if (slab != NULL) {
+        return slab_object_size(slab->cls);
+    }
+    return block_usable(((struct mem_block *) ptr) - 1);
+}
+
+/**
+ * Moves from holding one arena lock to another, for batches of objects that
+ * may belong to different arenas. Only one lock is ever held.
+ * @param locked - arena currently locked, or NULL.
+ * @param arena - arena to lock next, or NULL to only release.
+ * @returns the arena now locked.
+ */
+static struct arena *arena_switch(struct arena *locked, struct arena *arena)
+{
+    if (locked != arena) {
+        if (locked != NULL) {
+            arena_unlock(locked);
+        }
+        if (arena != NULL) {
+            arena_lock(arena);
+        }
+    }
+    return arena;
+}
+
+/**
+ * Adds to a statistics counter. Counters are read by other threads, so even
+ * those written by a single thread are accessed atomically; a relaxed load
+ * and store compile to plain moves, unlike the atomic add shared counters
+ * need.
+ * @param counter - counter to add to.
+ * @param n - amount to add (wrapping around to subtract).
+ * @param shared - true if other threads write the counter as well.
+ */
+static void stat_add(uint64_t *counter, uint64_t n, bool shared)
+{
+    if (shared) {
+        __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+    }
+    else {
+        __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED)
+                + n, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Adds one set of thread counters to another.
+ * @param total - counters to add to.
+ * @param stats - counters to add.
+ * @param shared - true if other threads write the total as well.
+ */
+static void stats_merge(struct thread_stats *total,
+        struct thread_stats *stats, bool shared)
+{
+    size_t i;
+
+    stat_add(&total->allocations,
+            __atomic_load_n(&stats->allocations, __ATOMIC_RELAXED), shared);
+    stat_add(&total->frees,
+            __atomic_load_n(&stats->frees, __ATOMIC_RELAXED), shared);
+    stat_add(&total->reallocs,
+            __atomic_load_n(&stats->reallocs, __ATOMIC_RELAXED), shared);
+    stat_add(&total->in_use,
+            __atomic_load_n(&stats->in_use, __ATOMIC_RELAXED), shared);
+    for (i = 0; i < STATS_SIZE_BINS; i++) {
+        stat_add(&total->sizes[i],
+                __atomic_load_n(&stats->sizes[i], __ATOMIC_RELAXED), shared);
+    }
+}
+
+/**
+ * Adds a thread cache to the list whose counters are summed up when
+ * statistics are read.
+ * @param cache - cache of the calling thread.
+ */
+static void stats_register(struct tcache *cache)
+{
+    pthread_mutex_lock(&g_stats_lock);
+    cache->stats_prev = NULL;
+    cache->stats_next = g_stats_threads;
+    if (g_stats_threads != NULL) {
+        g_stats_threads->stats_prev = cache;
+    }
+    g_stats_threads = cache;
+    pthread_mutex_unlock(&g_stats_lock);
+}
+
+/**
+ * Removes the cache of an exiting thread from the list, keeping its counters
+ * in those of the exited threads.
+ * @param cache - cache of the calling thread.
+ */
+static void stats_unregister(struct tcache *cache)
+{
+    pthread_mutex_lock(&g_stats_lock);
+    if (cache->stats_prev != NULL) {
+        cache->stats_prev->stats_next = cache->stats_next;
+    }
+    else {
+        g_stats_threads = cache->stats_next;
+    }
+    if (cache->stats_next != NULL) {
+        cache->stats_next->stats_prev = cache->stats_prev;
+    }
+    stats_merge(&g_stats_exited, &cache->stats, true);
+    pthread_mutex_unlock(&g_stats_lock);
+}
+
+/**
+ * Returns the objects held by a thread cache to their slabs.
+ * Registered as the destructor of g_tcache_key, so it runs on thread exit.
+ * @param arg - the thread cache to drain.
+ */
+static void tcache_drain(void *arg)
+{
+    struct tcache *cache = arg;
+    struct arena *locked = NULL;
+    void *obj;
+    size_t i;
+
+    /* Anything freed by later destructors goes straight to the heap */
+    cache->disabled = true;
+
+    for (i = 0; i < SLAB_CLASSES; i++) {
+        while ((obj = cache->bins[i]) != NULL) {
+            cache->bins[i] = *((void **) obj);
+            locked = arena_switch(locked, ptr_arena(obj));
+            slab_free_unsafe(slab_of(obj), obj);
+        }
+        cache->counts[i] = 0;
+    }
+    arena_switch(locked, NULL);
+
+    /* Later calls are counted with those of the exited threads */
+    stats_unregister(cache);
+    stream_ring_destroy(&g_trace, &cache->trace);
+    stream_ring_destroy(&g_log, &cache->log);
+}
+
+/**
+ * Creates the key whose destructor drains thread caches.
+ */
+static void tcache_init(void)
+{
+    pthread_key_create(&g_tcache_key, tcache_drain);
+}
+
+/**
+ * Retrieves the cache of the calling thread, registering it for draining on
+ * thread exit the first time it is used.
+ * @returns the thread cache, or NULL if the thread is being torn down.
+ */
+static struct tcache *tcache_get(void)
+{
+    struct tcache *cache = &g_tcache;
+
+    if (cache->disabled) {
+        return NULL;
+    }
+
+    if (!cache->registered) {
+        cache->registered = true;
+        pthread_once(&g_tcache_once, tcache_init);
+        pthread_setspecific(g_tcache_key, cache);
+        stats_register(cache);
+    }
+
+    return cache;
+}
+
+/**
+ * Pulls a batch of objects of the given class from the slabs of the
+ * thread's arena.
+ * @param cache - thread cache to fill.
+ * @param cls - class of the objects to allocate.
+ */
+static void tcache_refill(struct tcache *cache, size_t cls)
+{
+    struct arena *arena = arena_get();
+    void *obj;
+    int i;
+
+    arena_lock(arena);
+    remote_drain(arena);
+    for (i = 0; i < TCACHE_BATCH; i++) {
+        obj = slab_alloc_unsafe(arena, cls);
+        if (obj == NULL) {
+            break;
+        }
+        *((void **) obj) = cache->bins[cls];
+        cache->bins[cls] = obj;
+        cache->counts[cls]++;
+    }
+    arena_unlock(arena);
+}
+
+/**
+ * Returns a batch of objects of the given class to their slabs. Objects of
+ * other arenas are queued on their remote lists rather than locking them.
+ * @param cache - thread cache to flush.
+ * @param cls - class of the objects to release.
+ */
+static void tcache_flush(struct tcache *cache, size_t cls)
+{
+    struct arena *home = arena_get();
+    struct arena *arena;
+    bool locked = false;
+    void *obj;
+    int i;
+
+    for (i = 0; i < TCACHE_BATCH && cache->bins[cls] != NULL; i++) {
+        obj = cache->bins[cls];
+        cache->bins[cls] = *((void **) obj);
+        cache->counts[cls]--;
+
+        arena = ptr_arena(obj);
+        if (arena != home) {
+            remote_push(arena, obj);
+            continue;
+        }
+        if (!locked) {
+            arena_lock(home);
+            locked = true;
+        }
+        slab_free_unsafe(slab_of(obj), obj);
+    }
+    if (locked) {
+        arena_unlock(home);
+    }
+}
+
+/**
+ * Allocates a small object from the thread cache, refilling it in a batch
+ * from the shared slabs when the class is empty.
+ * @param cache - thread cache of the calling thread.
+ * @param size - size of the memory segment to allocate (<= SLAB_MAX_SIZE).
+ * @returns pointer to the first byte of data, or NULL if the heap is exhausted.
+ */
+static void *tcache_alloc(struct tcache *cache, size_t size)
+{
+    size_t cls = slab_class(size);
+    void *obj;
+
+    if (cache->bins[cls] == NULL) {
+        tcache_refill(cache, cls);
+        if (cache->bins[cls] == NULL) {
+            return NULL;
+        }
+    }
+
+    /* Pop the first cached object */
+    obj = cache->bins[cls];
+    cache->bins[cls] = *((void **) obj);
+    cache->counts[cls]--;
+
+    scribble_data(obj, slab_object_size(cls));
+    return obj;
+}
+
+/**
+ * Stores a freed small object in the thread cache, flushing a batch to the
+ * shared slabs when its class is full.
+ * @param cache - thread cache of the calling thread.
+ * @param ptr - the object to free.
+ * @param cls - size class of the object's slab.
+ */
+static void tcache_free(struct tcache *cache, void *ptr, size_t cls)
+{
+    if (cache->counts[cls] >= TCACHE_BIN_MAX) {
+        tcache_flush(cache, cls);
+    }
+
+    *((void **) ptr) = cache->bins[cls];
+    cache->bins[cls] = ptr;
+    cache->counts[cls]++;
+}
+
+/**
+ * Picks the histogram bucket of a requested size.
+ * @param size - requested size in bytes.
+ * @returns index into thread_stats.sizes.
+ */
+static size_t stats_bin(size_t size)
+{
+    if (size <= SLAB_MAX_SIZE) {
+        return slab_class(size);
+    }
+    /* 1025..2048 bytes go to the first bucket after the slab classes */
+    return SLAB_CLASSES + (64 - __builtin_clzll(size - 1)) - 11;
+}
+
+/**
+ * Finds the counters of the calling thread. Threads being torn down no
+ * longer have their own and share those of the exited threads.
+ * @param shared - set to true if the counters are shared.
+ * @returns the counters to update.
+ */
+static struct thread_stats *stats_get(bool *shared)
+{
+    struct tcache *cache = tcache_get();
+
+    *shared = cache == NULL;
+    return cache != NULL ? &cache->stats : &g_stats_exited;
+}
+
+/**
+ * Counts an allocation in the statistics of the calling thread.
+ * @param size - requested size.
+ * @param usable - usable size of the allocation.
+ */
+static void stats_alloc(size_t size, size_t usable)
+{
+    bool shared;
+    struct thread_stats *stats = stats_get(&shared);
+
+    stat_add(&stats->allocations, 1, shared);
+    stat_add(&stats->in_use, usable, shared);
+    stat_add(&stats->sizes[stats_bin(size)], 1, shared);
+}
+
+/**
+ * Counts a free in the statistics of the calling thread.
+ * @param usable - usable size of the freed allocation.
+ */
+static void stats_free(size_t usable)
+{
+    bool shared;
+    struct thread_stats *stats = stats_get(&shared);
+
+    stat_add(&stats->frees, 1, shared);
+    stat_add(&stats->in_use, -(uint64_t) usable, shared);
+}
+
+/**
+ * Counts a reallocation in the statistics of the calling thread.
+ * @param size - requested size.
+ * @param old_usable - usable size before the call.
+ * @param usable - usable size after the call.
+ */
+static void stats_realloc(size_t size, size_t old_usable, size_t usable)
+{
+    bool shared;
+    struct thread_stats *stats = stats_get(&shared);
+
+    stat_add(&stats->reallocs, 1, shared);
+    stat_add(&stats->in_use, (uint64_t) usable - old_usable, shared);
+    stat_add(&stats->sizes[stats_bin(size)], 1, shared);
+}
+
+/**
+ * Allocates an unnamed memory block with a given size, small ones from the
+ * thread cache. Shared by malloc and the C++ operator new. Thread-safe.
+ * @see malloc_unsafe for the implementation of the allocation itself.
+ * @param size - size of the memory segment to allocate.
+ * @returns pointer to the first byte of data inside the allocated segment.
+ */
+static void *malloc_cached(size_t size)
+{
+    struct prof_trace trace;
+    struct tcache *cache;
+    struct arena *arena;
+    bool sampled;
+    void *result;
+
+    cache = tcache_get();
+    sampled = prof_tick(cache, size);
+
+    /* Small requests are served by the thread cache without locking */
+    if (size <= SLAB_MAX_SIZE && cache != NULL && !sampled) {
+        result = tcache_alloc(cache, size);
+        if (result != NULL) {
+            stats_alloc(size, slab_object_size(slab_class(size)));
+            trace_call(TRACE_MALLOC, result, 0, size);
+        }
+        return result;
+    }
+
+    /* Sampled allocations get a block header, so free can find the sample */
+    if (sampled) {
+        prof_capture(cache, &trace);
+    }
+
+    /* Lock the thread's arena to protect the call, and release what other
+     * threads freed into it meanwhile */
+    arena = arena_get();
+    arena_lock(arena);
+    remote_drain(arena);
+
+    /* Make call to the unsafe function inside critical section */
+    if (sampled) {
+        result = malloc_block_unsafe(arena, size);
+        if (result != NULL) {
+            prof_record(result, size, &trace);
+        }
+    }
+    else {
+        result = malloc_unsafe(arena, size);
+    }
+
+    /* Unlock the mutex after call */
+    arena_unlock(arena);
+
+    /* Count the call in the thread's statistics and trace it */
+    if (result != NULL) {
+        stats_alloc(size, usable_size(result));
+        trace_call(TRACE_MALLOC, result, 0, size);
+    }
+
+    /* Return result of the guarded call */
+    return result;
+}
+
+/**
+ * Allocates an unnamed memory block with a given size. Thread-safe.
+ * @see malloc_cached for the implementation of the allocation itself.
+ * @param size - size of the memory segment to allocate.
+ * @returns pointer to the first byte of data inside the allocated segment.
+ */
+void *malloc(size_t size)
+{
+     LOG("ALLOCATING SIZE %zu\n", size);
+
+    return malloc_cached(size);
+}
+
+/**
+ * Allocates a named memory block with a given size.
+ * @see malloc_unsafe for the implementation of the allocation itself.
+ * @param arena - arena to allocate from.
+ * @param size - size of the memory segment to allocate.
+ * @param name - name of the block.
+ * @returns pointer to the first byte of data inside the allocated segment.
+ */
+void *malloc_name_unsafe(struct arena *arena, size_t size,
+        const char *name)
+{
+    struct block_meta *meta;
+    void *pointer;
+    
+    /* Allocate the unnamed block; names need a block header, so no slabs */
+    pointer = malloc_block_unsafe(arena, size);
+    if (pointer == NULL) {
+        return NULL;
+    }
+
+    /* Set the name for the block in the side table */
+    meta = meta_get(((struct mem_block *) pointer) - 1);
+    if (meta != NULL) {
+        strncpy(meta->name, name, sizeof(meta->name) - 1);
+        meta->name[sizeof(meta->name) - 1] = '\0';
+    }
+
+    /* Return allocated data region */
+    return pointer;
+}
+
+/**
+ * Allocates a named memory block with a given size. Thread-safe.
+ * @see malloc_name_unsafe for the implementation of the allocation itself.
+ * @param size - size of the memory segment to allocate.
+ * @param name - name of the block.
+ * @returns pointer to the first byte of data inside the allocated segment.
+ */
+void *malloc_name(size_t size, char *name)
+{
+    struct tcache *cache = tcache_get();
+    struct prof_trace trace;
+    struct arena *arena;
+    bool sampled;
+    void *result;
+
+    LOG("NAMED ALLOCATION WITH size = %zu, name at %p\n", size, name);
+
+    /* Named blocks always have a header, so they can be sampled as is */
+    sampled = prof_tick(cache, size);
+    if (sampled) {
+        prof_capture(cache, &trace);
+    }
+
+    /* Lock the thread's arena to protect the call */
+    arena = arena_get();
+    arena_lock(arena);
+    remote_drain(arena);
+
+    /* Make call to the unsafe function inside critical section */
+    result = malloc_name_unsafe(arena, size, name);
+    if (sampled && result != NULL) {
+        prof_record(result, size, &trace);
+    }
+
+    /* Unlock the mutex after call */
+    arena_unlock(arena);
+
+    /* Count the call in the thread's statistics and trace it */
+    if (result != NULL) {
+        stats_alloc(size, usable_size(result));
+        trace_call(TRACE_MALLOC, result, 0, size);
+    }
+
+    /* Return result of the guarded call */
+    return result;
+}
+
+/**
+ * Finds the arena of a tag, creating it on first use. Tags are told apart by
+ * their first TAG_NAME_BYTES - 1 bytes. The arenas of tags are never given
+ * back, so they can be looked up without a lock.
+ * @param tag - name of the tag.
+ * @param create - if true, a tag without an arena is given one.
+ * @returns the arena, or NULL if the tag is empty, has no arena (when not
+ *          creating one) or TAG_MAX tags are in use.
+ */
+static struct arena *tag_arena(const char *tag, bool create)
+{
+    struct arena *arena = NULL;
+    unsigned int count, i;
+
+    if (tag == NULL || *tag == '\0') {
+        return NULL;
+    }
+    pthread_once(&g_arena_once, arena_init);
+
+    /* Arenas are published only once they are set up */
+    count = __atomic_load_n(&g_tag_count, __ATOMIC_ACQUIRE);
+    for (i = 0; i < count; i++) {
+        if (strncmp(g_tags[i].tag, tag, TAG_NAME_BYTES - 1) == 0) {
+            return &g_tags[i];
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    /* Another thread may have created the tag in the meantime */
+    pthread_mutex_lock(&g_tag_lock);
+    for (; i < g_tag_count; i++) {
+        if (strncmp(g_tags[i].tag, tag, TAG_NAME_BYTES - 1) == 0) {
+            arena = &g_tags[i];
+            break;
+        }
+    }
+    if (arena == NULL && g_tag_count < TAG_MAX) {
+        arena = &g_tags[g_tag_count];
+        pthread_mutex_init(&arena->lock, NULL);
+        arena->index = ARENA_MAX + g_tag_count;
+        arena->fit_seed = 2463534242u + arena->index;
+        strncpy(arena->tag, tag, TAG_NAME_BYTES - 1);
+        __atomic_store_n(&g_tag_count, g_tag_count + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&g_tag_lock);
+    return arena;
+}
+
+/**
+ * Allocates a block from the arena of a tag, named after the tag. The blocks
+ * of a tag live in regions of their own, so tags don't fragment each other's
+ * memory and arena_reset can release all of them at once. They can still be
+ * freed and reallocated one by one, and stay in their tag. Thread-safe.
+ * @see malloc_name_unsafe for the implementation of the allocation itself.
+ * @param size - size of the memory segment to allocate.
+ * @param tag - name of the tag, created on first use; not empty.
+ * @returns pointer to the first byte of data inside the allocated segment,
+ *          or NULL on failure.
+ */
+void *malloc_tag(size_t size, const char *tag)
+{
+    struct tcache *cache = tcache_get();
+    struct prof_trace trace;
+    struct arena *arena;
+    bool sampled;
+    void *result;
+
+    LOG("TAGGED ALLOCATION WITH size = %zu, tag at %p\n", size, tag);
+
+    arena = tag_arena(tag, true);
+    if (arena == NULL) {
+        return NULL;
+    }
+
+    /* Tagged blocks always have a header, so they can be sampled as is */
+    sampled = prof_tick(cache, size);
+    if (sampled) {
+        prof_capture(cache, &trace);
+    }
+
+    /* Lock the tag's arena to protect the call */
+    arena_lock(arena);
+    remote_drain(arena);
+
+    /* Make call to the unsafe function inside critical section */
+    result = malloc_name_unsafe(arena, size, arena->tag);
+    if (sampled && result != NULL) {
+        prof_record(result, size, &trace);
+    }
+
+    /* Unlock the mutex after call */
+    arena_unlock(arena);
+
+    /* Count the call in the thread's statistics and trace it */
+    if (result != NULL) {
+        stats_alloc(size, usable_size(result));
+        trace_call(TRACE_MALLOC, result, 0, size);
+    }
+
+    /* Return result of the guarded call */
+    return result;
+}
+
+/**
+ * Moves the nodes of a subtree of the free space index to the spares.
+ * @param arena - arena owning the index.
+ * @param node - root of the subtree, or NULL.
+ */
+static void fit_recycle(struct arena *arena, struct fit_node *node)
+{
+    struct fit_node *left;
+
+    while (node != NULL) {
+        fit_recycle(arena, node->right);
+        left = node->left;
+        node->left = arena->fit_spare;
+        arena->fit_spare = node;
+        node = left;
+    }
+}
+
+/**
+ * Releases every block of a tag at once. The regions and large blocks of the
+ * tag's arena are unmapped as they are, without freeing any block, so the
+ * cost depends on the number of regions rather than blocks. The tag stays in
+ * use and starts out empty; the blocks it had must not be used or freed
+ * afterwards, and not be freed while the reset is in progress either.
+ * Traces don't record resets: replaying one treats the addresses as freed
+ * once they are handed out again. Thread-safe.
+ * @param tag - name of the tag.
+ * @returns 0, or ENOENT if nothing was ever allocated with the tag.
+ */
+int arena_reset(const char *tag)
+{
+    struct arena *arena = tag_arena(tag, false);
+    struct mem_region *region, *next;
+    struct prof_sample *sample;
+    struct thread_stats *stats;
+    size_t blocks, bytes;
+    bool shared;
+
+    LOG("ARENA RESET of tag at %p\n", tag);
+
+    if (arena == NULL) {
+        return ENOENT;
+    }
+
+    /* Frees queued by other threads were counted already, so they are
+     * applied rather than dropped with their regions */
+    arena_lock(arena);
+    remote_drain(arena);
+    LOG_INFO("RESETTING TAGGED ARENA %u\n", arena->index);
+
+    /* region_chunk is kept, so the next round maps fewer, larger regions */
+    for (region = arena->head; region != NULL; region = next) {
+        next = region->next;
+        region_unmap(region);
+    }
+    arena->head = NULL;
+    arena->tail = NULL;
+    while (arena->large != NULL) {
+        large_free(region_first(arena->large));
+    }
+    while (arena->retained != NULL) {
+        retained_unmap(arena->retained);
+    }
+
+    /* The index and the side table only described blocks that are gone */
+    fit_recycle(arena, arena->fit_root);
+    arena->fit_root = NULL;
+    arena->tlsf_first = 0;
+    memset(arena->tlsf_second, 0, sizeof(arena->tlsf_second));
+    memset(arena->tlsf_lists, 0, sizeof(arena->tlsf_lists));
+    if (arena->meta != NULL && munmap(arena->meta,
+                arena->meta_slots * sizeof(struct block_meta)) != 0) {
+        perror("munmap");
+    }
+    arena->meta = NULL;
+    arena->meta_slots = 0;
+    arena->meta_count = 0;
+    while ((sample = arena->prof_live) != NULL) {
+        arena->prof_live = sample->next;
+        sample->next = arena->prof_spare;
+        arena->prof_spare = sample;
+    }
+    arena->prof_count = 0;
+
+    blocks = arena->live_blocks;
+    bytes = arena->live_bytes;
+    arena->live_blocks = 0;
+    arena->live_bytes = 0;
+    arena_unlock(arena);
+
+    /* Count the blocks as freed by the calling thread */
+    stats = stats_get(&shared);
+    stat_add(&stats->frees, blocks, shared);
+    stat_add(&stats->in_use, -(uint64_t) bytes, shared);
+    return 0;
+}
+
+/**
+ * Reads what the arena of a tag has in use, after applying the frees other
+ * threads queued. The lock is taken directly, so reading isn't counted.
+ * @param arena - arena of the tag.
+ * @param stats - set to the blocks and bytes in use and the bytes mapped.
+ */
+static void tag_stats_read(struct arena *arena, struct tag_stats *stats)
+{
+    pthread_mutex_lock(&arena->lock);
+    remote_drain(arena);
+    stats->blocks = arena->live_blocks;
+    stats->bytes = arena->live_bytes;
+    stats->mapped = arena->stats.mapped + arena->stats.large_mapped;
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/**
+ * Reads what a tag has in use. Thread-safe.
+ * @param tag - name of the tag.
+ * @param stats - set to the tag's blocks in use, their usable bytes and the
+ *                bytes mapped for its regions (retained ones included) and
+ *                large blocks.
+ * @returns 0, or ENOENT if nothing was ever allocated with the tag.
+ */
+int arena_tag_stats(const char *tag, struct tag_stats *stats)
+{
+    struct arena *arena = tag_arena(tag, false);
+
+    if (arena == NULL) {
+        return ENOENT;
+    }
+    tag_stats_read(arena, stats);
+    return 0;
+}
+
+/**
+ * Merges a freed block into the slack of the block before it (or resets
+ * the usage of a region head) and counts it out of its region. The block
+ * holding the freed space is left out of the free space index, so a run of
+ * frees merging into the same block only indexes it once. Retiring the
+ * region once it is empty is left to the caller.
+ * @param current - header of the block to free; not a large block.
+ * @param unindexed - block the previous call left out of the index, or
+ *                    NULL; indexed now unless the freed block merges into
+ *                    it or is that block.
+ * @returns the block holding the freed space, for the caller to fit_insert.
+ */
+static struct mem_block *block_release(struct mem_block *current,
+        struct mem_block *unindexed)
+{
+    struct mem_region *region = block_region(current);
+    struct mem_block *prev = NULL, *next;
+
+    if (current->prev_size != 0) {
+        prev = (struct mem_block *) (((void *) current)
+                - (size_t) current->prev_size * MEM_UNIT);
+    }
+
+    /* A block left out that is freed now passes its slack on with it */
+    if (unindexed != NULL && unindexed != prev && unindexed != current) {
+        fit_insert(unindexed);
+    }
+    if (current != unindexed) {
+        fit_remove(current);
+    }
+    region->live_blocks--;
+
+    /* Region heads have nothing to merge into; reset the usage */
+    if (prev == NULL) {
+        current->usage = 0;
+        return current;
+    }
+
+    /* Merge the block into its neighbour, which precedes it in memory */
+    if (prev != unindexed) {
+        fit_remove(prev);
+    }
+    prev->size += current->size;
+    next = block_next(prev);
+    if (next != NULL) {
+        next->prev_size = prev->size;
+    }
+    meta_forget(current);
+    return prev;
+}
+
+/**
+ * Retires a region whose blocks have all been freed, and so merged into its
+ * head: the region leaves the list and is retained for reuse.
+ * @param region - the empty region.
+ */
+static void region_retire(struct mem_region *region)
+{
+    struct mem_block *current = region_first(region);
+
+    fit_remove(current);
+    meta_forget(current);
+
+    /* Fix the linked list so it points over the freed region */
+    if (region->prev != NULL) {
+        region->prev->next = region->next;
+    }
+    else {
+        region->arena->head = region->next;
+    }
+    if (region->next != NULL) {
+        region->next->prev = region->prev;
+    }
+    else {
+        region->arena->tail = region->prev;
+    }
+
+    retain_region(region);
+}
+
+/**
+ * Deallocates a memory block from the block list by the data pointer given.
+ * The freed block is merged into the slack of the block before it, so the
+ * only free blocks left in a region are region heads and merging takes
+ * constant time. When the region has no blocks in use, it is unmapped.
+ * @param ptr - data pointer of the block to free. If NULL, nothing is done.
+ */ 
+void free_block_unsafe(void *ptr)
+{
+    struct mem_block *current;
+    struct mem_region *region;
+
+    /* Freeing a NULL pointer does nothing */
+    if (ptr == NULL) {
+        return;
+    }
+
+    current = ((struct mem_block *) ptr) - 1;
+    region = block_region(current);
+    prof_release(current);
+    block_account(current, false);
+
+    /* Large blocks give their mapping back right away */
+    if (region->flags & REGION_LARGE) {
+        large_free(current);
+        return;
+    }
+
+    fit_insert(block_release(current, NULL));
+    if (region->live_blocks == 0) {
+        region_retire(region);
+    }
+}
+
+/**
+ * Deallocates a memory block by the data pointer given, returning small
+ * objects to their slab and everything else to the block list.
+ * @param ptr - data pointer of the block to free. If NULL, nothing is done.
+ */
+void free_unsafe(void *ptr)
+{
+    struct slab *slab;
+
+    /* Freeing a NULL pointer does nothing */
+    if (ptr == NULL) {
+        return;
+    }
+
+    slab = slab_of(ptr);
+    if (slab != NULL) {
+        slab_free_unsafe(slab, ptr);
+    }
+    else {
+        free_block_unsafe(ptr);
+    }
+}
+
+/**
+ * Ends a run of batched frees in a region: indexes the block block_release
+ * left out, and retires the region if it has emptied.
+ * @param region - region of the run, or NULL if there was none.
+ * @param merged - block left out of the index, or NULL.
+ */
+static void region_run_end(struct mem_region *region,
+        struct mem_block *merged)
+{
+    if (merged != NULL) {
+        fit_insert(merged);
+    }
+    if (region != NULL && region->live_blocks == 0) {
+        region_retire(region);
+    }
+}
+
+/**
+ * Deallocates a number of memory blocks, all owned by the same arena. Runs
+ * of blocks from the same region are freed in one pass: blocks that follow
+ * each other in memory merge into the same block, which is indexed once,
+ * and the region is only checked for being empty (and retired) once its run
+ * ends.
+ * @param ptrs - data pointers of the blocks to free; NULLs are skipped.
+ * @param n - number of pointers.
+ */
+void free_batch_unsafe(void **ptrs, size_t n)
+{
+    struct mem_region *region, *pending = NULL;
+    struct mem_block *block, *merged = NULL;
+    struct slab *slab;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        if (ptrs[i] == NULL) {
+            continue;
+        }
+
+        slab = slab_of(ptrs[i]);
+        if (slab != NULL) {
+            slab_free_unsafe(slab, ptrs[i]);
+            continue;
+        }
+
+        block = ((struct mem_block *) ptrs[i]) - 1;
+        region = block_region(block);
+        prof_release(block);
+        block_account(block, false);
+        if (region->flags & REGION_LARGE) {
+            large_free(block);
+            continue;
+        }
+
+        if (region != pending) {
+            region_run_end(pending, merged);
+            pending = region;
+            merged = NULL;
+        }
+        merged = block_release(block, merged);
+    }
+    region_run_end(pending, merged);
+}
+
+/**
+ * Deallocates memory whose slab and size class have already been found,
+ * from the page map and the slab header or from the size the caller passed.
+ * Thread-safe.
+ * @see free_unsafe for the implementation of the deallocation itself.
+ * @param ptr - data pointer of the block to free; not NULL.
+ * @param slab - slab holding the object, or NULL for blocks.
+ * @param cls - size class of the slab (unused for blocks).
+ */
+static void free_release(void *ptr, struct slab *slab, size_t cls)
+{
+    struct tcache *cache;
+    struct arena *arena;
+
+    /* Trace the call before the memory can be handed out again */
+    trace_call(TRACE_FREE, ptr, 0, 0);
+
+    /* Count the call while the sizes can still be read */
+    stats_free(slab != NULL ? slab_object_size(cls) : usable_size(ptr));
+
+    /* Small objects go back to the thread cache without locking */
+    if (slab != NULL && (cache = tcache_get()) != NULL) {
+        tcache_free(cache, ptr, cls);
+        return;
+    }
+    
+    /* Memory of another arena is queued for its owner without locking */
+    arena = ptr_arena(ptr);
+    if (arena != arena_get() && remote_fits(ptr, slab)) {
+        remote_push(arena, ptr);
+        return;
+    }
+
+    /* Lock the arena owning the memory to protect the call */
+    arena_lock(arena);
+
+    /* Make call to the unsafe function inside critical section */
+    free_unsafe(ptr);
+    
+    /* Unlock the mutex after call */
+    arena_unlock(arena);
+
+    /* Threads can't be started under the lock since they allocate */
+    if (g_retain_background && arena->retained != NULL) {
+        pthread_once(&g_retain_thread_once, retain_start_thread);
+    }
+}
+
+/**
+ * Deallocates a memory block by the data pointer given. Thread-safe.
+ * @see free_release for the implementation of the deallocation itself.
+ * @param ptr - data pointer of the block to free. If NULL, nothing is done.
+ */ 
+void free(void *ptr)
+{
+    struct slab *slab;
+
+     LOG("FREE request at %p\n", ptr);
+
+    /* Freeing a NULL pointer does nothing */
+    if (ptr == NULL) {
+        return;
+    }
+
+    slab = slab_of(ptr);
+    free_release(ptr, slab, slab != NULL ? slab->cls : 0);
+}
+
+/**
+ * Checks the size and alignment passed to a sized free against the
+ * allocation; only done in debug builds. Mismatches are logged as errors.
+ * @param ptr - data pointer of the block to free.
+ * @param slab - slab holding the object, or NULL for blocks.
+ * @param cls - size class derived from the size passed (slabs only).
+ * @param size - size passed by the caller (0: unknown).
+ * @param alignment - alignment passed by the caller (0: none).
+ * @returns the size class to free the object to: that of its slab if the
+ *          size passed disagrees with it.
+ */
+static size_t free_size_check(void *ptr, struct slab *slab, size_t cls,
+        size_t size, size_t alignment)
+{
+    if (alignment > MEM_UNIT && ((uintptr_t) ptr & (alignment - 1)) != 0) {
+        LOG_ERROR("ALIGNED FREE of %p not aligned to %zu\n", ptr, alignment);
+    }
+    if (alignment > MEM_UNIT && slab != NULL) {
+        LOG_ERROR("ALIGNED FREE of small object %p\n", ptr);
+    }
+    if (size == 0) {
+        return cls;
+    }
+
+    if (slab != NULL && slab->cls != cls) {
+        LOG_ERROR("SIZED FREE of %p with size %zu of another class\n",
+                ptr, size);
+        return slab->cls;
+    }
+    if (slab == NULL && size > usable_size(ptr)) {
+        LOG_ERROR("SIZED FREE of %p with size %zu beyond its block\n",
+                ptr, size);
+    }
+    return cls;
+}
+
+/**
+ * Deallocates memory whose size, and maybe alignment, the caller knows.
+ * Small objects go to the size class the size maps to, without reading the
+ * slab header; only the page map is consulted, since named, sampled and
+ * aligned allocations of small sizes live in blocks. Alignments above
+ * MEM_UNIT are always served from blocks, so for them not even the page map
+ * is (outside of debug builds, which check what they are given).
+ * @see free_release for the implementation of the deallocation itself.
+ * @param ptr - data pointer of the block to free. If NULL, nothing is done.
+ * @param size - size requested when the memory was allocated or last
+ *               reallocated (0: unknown, read from the allocation).
+ * @param alignment - alignment requested when the memory was allocated
+ *                    (0: none).
+ */
+static void free_known(void *ptr, size_t size, size_t alignment)
+{
+    struct slab *slab = NULL;
+    size_t cls = 0;
+
+    /* Freeing a NULL pointer does nothing */
+    if (ptr == NULL) {
+        return;
+    }
+
+    if (alignment <= MEM_UNIT || DEBUG) {
+        slab = slab_of(ptr);
+    }
+
+    /* realloc keeps an object in its slab only within the same class, and
+     * moves small objects to the class of their exact size, so the size
+     * always maps to the class of the slab */
+    if (slab != NULL) {
+        cls = size != 0 ? slab_class(size) : slab->cls;
+    }
+    if (DEBUG) {
+        cls = free_size_check(ptr, slab, cls, size, alignment);
+    }
+    free_release(ptr, slab, cls);
+}
+
+/**
+ * Deallocates memory whose size the caller knows (C23). Thread-safe.
+ * @see free_known for how the size is used.
+ * @param ptr - data pointer of the block to free. If NULL, nothing is done.
+ * @param size - size requested when the memory was allocated (or last
+ *               reallocated).
+ */
+void free_sized(void *ptr, size_t size)
+{
+    LOG("SIZED FREE request at %p, size %zu\n", ptr, size);
+
+    free_known(ptr, size, 0);
+}
+
+/**
+ * Deallocates aligned memory whose size the caller knows (C23).
+ * Thread-safe.
+ * @see free_known for how the size and alignment are used.
+ * @param ptr - data pointer of the block to free. If NULL, nothing is done.
+ * @param alignment - alignment requested when the memory was allocated.
+ * @param size - size requested when the memory was allocated.
+ */
+void free_aligned_sized(void *ptr, size_t alignment, size_t size)
+{
+    LOG("ALIGNED SIZED FREE request at %p, alignment %zu\n", ptr, alignment);
+
+    free_known(ptr, size, alignment);
+}
+
+/**
+ * Releases memory for the C++ operator delete (new.cpp), sized or not.
+ * @see free_known for how the size and alignment are used.
+ * @param ptr - data pointer of the block to free. If NULL, nothing is done.
+ * @param size - size passed to operator new (0: unknown).
+ * @param alignment - alignment passed to operator new (0: none).
+ */
+void allocator_delete(void *ptr, size_t size, size_t alignment)
+{
+    LOG("DELETE request at %p, size %zu\n", ptr, size);
+
+    free_known(ptr, size, alignment);
+}
+
+/**
+ * Allocates a number of unnamed memory blocks of the same size, taking the
+ * arena's lock once for all of them. Thread-safe. Batches bypass the thread
+ * cache and aren't sampled by the heap profiler.
+ * @see malloc_batch_unsafe for the implementation of the allocation itself.
+ * @param size - size of each memory segment.
+ * @param n - number of segments to allocate.
+ * @param out - receives the data pointers.
+ * @returns number of segments allocated (the first ones of out); fewer than
+ *          n if the heap ran out.
+ */
+size_t malloc_batch(size_t size, size_t n, void **out)
+{
+    struct arena *arena;
+    size_t done, i;
+
+    LOG("ALLOCATING BATCH OF %zu, size %zu\n", n, size);
+
+    /* Lock the thread's arena once for the whole batch */
+    arena = arena_get();
+    arena_lock(arena);
+    remote_drain(arena);
+    done = malloc_batch_unsafe(arena, size, n, out);
+    arena_unlock(arena);
+
+    /* Count the calls in the thread's statistics and trace them */
+    for (i = 0; i < done; i++) {
+        stats_alloc(size, usable_size(out[i]));
+        trace_call(TRACE_MALLOC, out[i], 0, size);
+    }
+    return done;
+}
+
+/**
+ * Deallocates a number of memory blocks. Thread-safe. Each run of pointers
+ * owned by the same arena is freed under a single lock, so pointers freed in
+ * the order malloc_batch returned them take one lock in all.
+ * @see free_batch_unsafe for the implementation of the deallocation itself.
+ * @param ptrs - data pointers of the blocks to free; NULLs are skipped.
+ * @param n - number of pointers.
+ */
+void free_batch(void **ptrs, size_t n)
+{
+    struct arena *locked = NULL, *arena;
+    bool retained = false;
+    struct slab *slab;
+    size_t i, end;
+
+    LOG("FREE BATCH OF %zu at %p\n", n, ptrs);
+
+    /* Trace and count the calls before the memory can be handed out again */
+    for (i = 0; i < n; i++) {
+        if (ptrs[i] != NULL) {
+            trace_call(TRACE_FREE, ptrs[i], 0, 0);
+            slab = slab_of(ptrs[i]);
+            stats_free(slab != NULL
+                    ? slab_object_size(slab->cls) : usable_size(ptrs[i]));
+        }
+    }
+
+    for (i = 0; i < n; i = end) {
+        end = i + 1;
+        if (ptrs[i] == NULL) {
+            continue;
+        }
+
+        /* Extend the run while the pointers belong to the same arena */
+        arena = ptr_arena(ptrs[i]);
+        while (end < n && (ptrs[end] == NULL
+                    || ptr_arena(ptrs[end]) == arena)) {
+            end++;
+        }
+
+        locked = arena_switch(locked, arena);
+        free_batch_unsafe(ptrs + i, end - i);
+        retained |= arena->retained != NULL;
+    }
+    arena_switch(locked, NULL);
+
+    /* Threads can't be started under the lock since they allocate */
+    if (g_retain_background && retained) {
+        pthread_once(&g_retain_thread_once, retain_start_thread);
+    }
+}
+
+/**
+ * Allocates memory for the array of elements with the given size and
+ * initializes memory with zeros. Memory known to be zero already, such as
+ * freshly mapped pages, isn't cleared again, so it isn't faulted in early.
+ * Thread-safe.
+ * @see malloc_unsafe for the implementation of the allocation itself.
+ * @param nmemb - count of elements to allocate memory for.
+ * @param size - size of the each element.
+ * @returns pointer to the first byte of data inside the allocated segment,
+ *          or NULL (with errno set to ENOMEM) if the size overflows.
+ */
+void *calloc(size_t nmemb, size_t size)
+{
+    struct prof_trace trace;
+    struct mem_block *block;
+    struct tcache *cache;
+    struct arena *arena;
+    size_t total, dirty;
+    bool sampled;
+    void *result;
+
+    /* Refuse element counts whose total size overflows */
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    total = nmemb * size;
+    dirty = total;
+
+    cache = tcache_get();
+    sampled = prof_tick(cache, total);
+
+    if (total <= SLAB_MAX_SIZE && cache != NULL && !sampled) {
+        /* Small requests are served by the thread cache */
+        result = tcache_alloc(cache, total);
+    }
+    else {
+        if (sampled) {
+            prof_capture(cache, &trace);
+        }
+
+        /* Lock the thread's arena to protect the call */
+        arena = arena_get();
+        arena_lock(arena);
+        remote_drain(arena);
+
+        /* Allocate the memory inside critical section; small objects are
+         * recycled too often to be worth tracking, unless sampled */
+        if (total <= SLAB_MAX_SIZE && !sampled) {
+            result = malloc_unsafe(arena, total);
+        }
+        else {
+            block = block_alloc_unsafe(arena, total, MEM_UNIT, &dirty);
+            result = block == NULL ? NULL : (void *) (block + 1);
+            if (sampled && result != NULL) {
+                prof_record(result, total, &trace);
+            }
+        }
+
+        /* Unlock the mutex after call */
+        arena_unlock(arena);
+    }
+
+    /* Zeroing the part of the memory that may have been used before */
+    if (result != NULL) {
+        memset(result, 0, dirty);
+    }
+
+    /* Count the call in the thread's statistics and trace it */
+    if (result != NULL) {
+        stats_alloc(total, usable_size(result));
+        trace_call(TRACE_CALLOC, result, 0, total);
+    }
+
+    /* Return result of the guarded call */
+    return result;
+}
+
+/**
+ * Computes how much room a growing block should get. If the environment
+ * variable ALLOCATOR_REALLOC_GROWTH is set to a percentage, blocks grown by
+ * realloc keep that much extra space in reserve, so vectors and string
+ * builders that are resized repeatedly mostly stay in place.
+ * @param size - requested size of the data area.
+ * @returns size of the data area to reserve.
+ */
+static size_t realloc_growth(size_t size)
+{
+    size_t reserve;
+
+    if (g_realloc_growth < 0) {
+        g_realloc_growth = env_size("ALLOCATOR_REALLOC_GROWTH", 0);
+    }
+
+    reserve = size / 100 * g_realloc_growth;
+    if (reserve > large_threshold()) {
+        reserve = large_threshold();
+    }
+    return size + reserve;
+}
+
+/**
+ * Changes the size of the given allocated block to the new one.
+ * If the given block is NULL, equal to malloc_unsafe(size).
+ * If the new size is 0, equal to free_unsafe(ptr).
+ * @see malloc_unsafe for the implementation of the allocation.
+ * @see free_unsafe for the implementation of the deallocation.
+ * @param arena - arena owning the block (or to allocate from, if NULL).
+ * @param ptr - data pointer of the existing block.
+ * @param size - new size for the block.
+ * @returns pointer to the first byte of data inside the resized segment.
+ */
+void *realloc_unsafe(struct arena *arena, void *ptr, size_t size)
+{
+    struct mem_block *current;
+    struct slab *slab;
+    size_t actual_size, capacity, reserved;
+    void *new;
+
+    /* If the pointer is NULL, then we simply malloc a new block */
+    if (ptr == NULL) {
+        return malloc_unsafe(arena, size);
+    }
+    
+    if (size == 0) {
+        /* Realloc to 0 is often the same as freeing the memory block... 
+         * But the C standard doesn't require this. 
+         * We will free the block and return NULL here. */
+        free_unsafe(ptr);
+        return NULL;
+    }
+
+    /* Small objects stay put unless they leave their size class */
+    slab = slab_of(ptr);
+    if (slab != NULL) {
+        capacity = slab_object_size(slab->cls);
+        if (size <= capacity && slab_class(size) == slab->cls) {
+            return ptr;
+        }
+
+        /* Growth slack only pays off outside slabs, and a small object
+         * must land in the class its size maps to for sized frees */
+        new = malloc_unsafe(arena, size > SLAB_MAX_SIZE
+                ? realloc_growth(size) : size);
+        if (new != NULL) {
+            memcpy(new, ptr, size < capacity ? size : capacity);
+            slab_free_unsafe(slab, ptr);
+        }
+        return new;
+    }
+
+    /* Sizes this close to SIZE_MAX can't be mapped anyway */
+    if (size > SIZE_MAX / 2) {
+        return NULL;
+    }
+
+    /* Align the memory and include the block header into needed size */
+    actual_size = block_size_for(size);
+
+    /* Large blocks that stay large are remapped instead of copied */
+    current = ((struct mem_block *) ptr) - 1;
+    if (block_region(current)->flags & REGION_LARGE) {
+        if (actual_size >= large_threshold()
+                || actual_size > BLOCK_MAX_SIZE) {
+            current = large_resize(current, actual_size);
+            return current == NULL ? NULL : (void *) (current + 1);
+        }
+
+        /* Below the threshold the data moves to a regular block; aligned
+         * large blocks may be small, so this isn't always a shrink */
+        capacity = block_region(current)->size - sizeof(struct mem_region)
+            - sizeof(struct mem_block);
+        new = malloc_unsafe(arena, size);
+        if (new != NULL) {
+            memcpy(new, ptr, size < capacity ? size : capacity);
+            block_account(current, false);
+            large_free(current);
+        }
+        return new;
+    }
+
+    /* Check if the current block can be resized in-place. Freed neighbours
+     * are merged into the block before them, so the block's size already
+     * covers all free space that follows it in the region. */
+    capacity = (size_t) current->usage * MEM_UNIT - sizeof(struct mem_block);
+    if ((size_t) current->size * MEM_UNIT >= actual_size) {
+        fit_remove(current);
+        block_account(current, false);
+        if (actual_size > (size_t) current->usage * MEM_UNIT) {
+            /* Grow into the free space, keeping some in reserve */
+            reserved = block_size_for(realloc_growth(size)) / MEM_UNIT;
+            current->usage = reserved < current->size
+                ? reserved : current->size;
+            region_touch(current);
+        }
+        else if (g_realloc_growth <= 0
+                || actual_size <= (size_t) current->usage * MEM_UNIT / 2) {
+            /* Shrink, handing the tail back as reusable free space */
+            current->usage = actual_size / MEM_UNIT;
+        }
+        block_account(current, true);
+        fit_insert(current);
+
+        /* And return itself */
+        return ptr;
+    }
+    else {
+        /* Else, can't resize in-place, so allocate new place; small
+         * objects get exactly their size, as in the slab case above */
+        new = malloc_unsafe(arena, size > SLAB_MAX_SIZE
+                ? realloc_growth(size) : size);
+        if (new == NULL) {
+            return NULL;
+        }
+
+        /* Copy the old contents (the block is growing, so all of them) */
+        memcpy(new, ptr, capacity);
+
+        /* And free old memory */
+        free_unsafe(ptr);
+
+        /* Return newly allocated */
+        return new;
+    }
+}
+
+/**
+ * Changes the size of the given allocated block to the new one.
+ * If the given block is NULL, equal to malloc_unsafe(size).
+ * If the new size is 0, equal to free_unsafe(ptr).
+ * Thread-safe.
+ * @see realloc_unsafe for for implementation of the reallocation itself.
+ * @param ptr - data pointer of the existing block.
+ * @param size - new size for the block.
+ * @returns pointer to the first byte of data inside the resized segment.
+ */
+void *realloc(void *ptr, size_t size)
+{
+    struct arena *arena;
+    size_t old_usable;
+    void *result;
+
+    /* The old size must be read before the block may move or go away */
+    old_usable = ptr == NULL ? 0 : usable_size(ptr);
+
+    /* Lock the arena owning the block (or the thread's) to protect the call */
+    arena = ptr == NULL ? arena_get() : ptr_arena(ptr);
+    arena_lock(arena);
+    remote_drain(arena);
+
+    /* Make call to the unsafe function inside critical section */
+    result = realloc_unsafe(arena, ptr, size);
+
+    /* Unlock the mutex after call */
+    arena_unlock(arena);
+
+    /* Count the call as what it turned out to be */
+    if (ptr == NULL) {
+        if (result != NULL) {
+            stats_alloc(size, usable_size(result));
+        }
+    }
+    else if (size == 0) {
+        stats_free(old_usable);
+    }
+    else if (result != NULL) {
+        stats_realloc(size, old_usable, usable_size(result));
+    }
+
+    /* Failed calls leave the block as it was, so they aren't traced */
+    if (result != NULL || (ptr != NULL && size == 0)) {
+        trace_call(TRACE_REALLOC, result, (uintptr_t) ptr, size);
+    }
+
+    /* Return result of the guarded call */
+    return result;
+}
+
+/**
+ * Allocates a memory block whose data area is aligned to the given boundary.
+ * Thread-safe.
+ * @see malloc_aligned_unsafe for the implementation of the allocation itself.
+ * @param alignment - required alignment, a power of two.
+ * @param size - size of the memory segment to allocate.
+ * @returns pointer to the first byte of data inside the allocated segment.
+ */
+static void *malloc_aligned(size_t alignment, size_t size)
+{
+    struct tcache *cache = tcache_get();
+    struct prof_trace trace;
+    struct arena *arena;
+    bool sampled;
+    void *result;
+
+    LOG("ALIGNED ALLOCATION WITH size = %zu, alignment = %zu\n",
+            size, alignment);
+
+    sampled = prof_tick(cache, size);
+    if (sampled) {
+        prof_capture(cache, &trace);
+    }
+
+    /* Lock the thread's arena to protect the call */
+    arena = arena_get();
+    arena_lock(arena);
+    remote_drain(arena);
+
+    /* Make call to the unsafe function inside critical section; sampled
+     * allocations need a block header even when any slab would do */
+    if (sampled && alignment <= MEM_UNIT) {
+        result = malloc_block_unsafe(arena, size);
+    }
+    else {
+        result = malloc_aligned_unsafe(arena, alignment, size);
+    }
+    if (sampled && result != NULL) {
+        prof_record(result, size, &trace);
+    }
+
+    /* Unlock the mutex after call */
+    arena_unlock(arena);
+
+    /* Count the call in the thread's statistics and trace it */
+    if (result != NULL) {
+        stats_alloc(size, usable_size(result));
+        trace_call(TRACE_MEMALIGN, result, alignment, size);
+    }
+
+    /* Return result of the guarded call */
+    return result;
+}
+
+/**
+ * Allocates memory for the C++ operator new (new.cpp): small requests go
+ * through the thread cache like malloc, aligned ones are placed at their
+ * boundary directly instead of being rounded up to a multiple of it.
+ * @param size - size of the memory segment to allocate.
+ * @param alignment - required alignment, a power of two (0: none).
+ * @returns pointer to the first byte of data inside the allocated segment,
+ *          or NULL if the heap is exhausted.
+ */
+void *allocator_new(size_t size, size_t alignment)
+{
+    LOG("NEW request of size %zu, alignment %zu\n", size, alignment);
+
+    if (alignment <= MEM_UNIT) {
+        return malloc_cached(size);
+    }
+    return malloc_aligned(alignment, size);
+}
+
+/**
+ * Allocates an aligned memory block (POSIX).
+ * @param memptr - where the pointer to the block is stored.
+ * @param alignment - a power of two multiple of sizeof(void *).
+ * @param size - size of the memory segment to allocate.
+ * @returns 0 on success, EINVAL for a bad alignment, ENOMEM if out of memory.
+ */
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *result;
+
+    if (alignment % sizeof(void *) != 0
+            || (alignment & (alignment - 1)) != 0 || alignment == 0) {
+        return EINVAL;
+    }
+
+    result = malloc_aligned(alignment, size);
+    if (result == NULL) {
+        return ENOMEM;
+    }
+
+    *memptr = result;
+    return 0;
+}
+
+/**
+ * Allocates an aligned memory block (C11).
+ * @param alignment - a power of two.
+ * @param size - size of the memory segment to allocate.
+ * @returns pointer to the block, or NULL on failure.
+ */
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return malloc_aligned(alignment, size);
+}
+
+/**
+ * Allocates an aligned memory block (obsolete). Alignments that aren't
+ * powers of two are rounded up to the next one, like glibc does.
+ * @param alignment - required alignment.
+ * @param size - size of the memory segment to allocate.
+ * @returns pointer to the block, or NULL on failure.
+ */
+void *memalign(size_t alignment, size_t size)
+{
+    size_t rounded = MEM_UNIT;
+
+    while (rounded < alignment && rounded <= SIZE_MAX / 4) {
+        rounded *= 2;
+    }
+    return malloc_aligned(rounded, size);
+}
+
+/**
+ * Allocates a page-aligned memory block (obsolete).
+ * @param size - size of the memory segment to allocate.
+ * @returns pointer to the block, or NULL on failure.
+ */
+void *valloc(size_t size)
+{
+    return malloc_aligned(getpagesize(), size);
+}
+
+/**
+ * Allocates a page-aligned memory block rounded up to whole pages
+ * (obsolete).
+ * @param size - size of the memory segment to allocate.
+ * @returns pointer to the block, or NULL on failure.
+ */
+void *pvalloc(size_t size)
+{
+    if (size > SIZE_MAX / 2) {
+        return NULL;
+    }
+    return malloc_aligned(getpagesize(), page_round(size == 0 ? 1 : size));
+}
+
+/**
+ * Reports how many bytes of an allocated block may be used. This covers the
+ * rounding done on allocation, so callers may grow into it without realloc.
+ * @param ptr - data pointer of the block. If NULL, 0 is returned.
+ * @returns usable size of the data area in bytes.
+ */
+size_t malloc_usable_size(void *ptr)
+{
+    if (ptr == NULL) {
+        return 0;
+    }
+    return usable_size(ptr);
+}
+
+/**
+ * Adds the counters of one arena to those of another.
+ * @param total - counters to add to.
+ * @param stats - counters to add.
+ */
+static void arena_stats_merge(struct arena_stats *total,
+        const struct arena_stats *stats)
+{
+    total->mapped += stats->mapped;
+    total->large_mapped += stats->large_mapped;
+    total->huge_mapped += stats->huge_mapped;
+    total->large_blocks += stats->large_blocks;
+    total->maps += stats->maps;
+    total->unmaps += stats->unmaps;
+    total->lock_acquired += stats->lock_acquired;
+    total->lock_contended += stats->lock_contended;
+    total->lock_wait_ns += stats->lock_wait_ns;
+    total->lock_hold_ns += stats->lock_hold_ns;
+    total->retained += stats->retained;
+}
+
+/**
+ * Copies the counters of an arena under its lock, taken directly so reading
+ * isn't counted.
+ * @param arena - arena to read.
+ * @param stats - set to the counters.
+ */
+static void arena_stats_copy(struct arena *arena, struct arena_stats *stats)
+{
+    pthread_mutex_lock(&arena->lock);
+    *stats = arena->stats;
+    stats->retained = arena->retained_bytes;
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/**
+ * Collects the counters of all threads and arenas.
+ * @param threads - set to the sum of the thread counters.
+ * @param arenas - set to the counters of each arena (g_arena_count entries).
+ * @param total - set to the sum of the arena counters, tagged arenas
+ *                included.
+ */
+static void stats_read(struct thread_stats *threads,
+        struct arena_stats *arenas, struct arena_stats *total)
+{
+    struct arena_stats tag;
+    struct tcache *cache;
+    unsigned int tags, i;
+
+    memset(threads, 0, sizeof(*threads));
+    pthread_mutex_lock(&g_stats_lock);
+    stats_merge(threads, &g_stats_exited, false);
+    for (cache = g_stats_threads; cache != NULL; cache = cache->stats_next) {
+        stats_merge(threads, &cache->stats, false);
+    }
+    pthread_mutex_unlock(&g_stats_lock);
+
+    memset(total, 0, sizeof(*total));
+    for (i = 0; i < g_arena_count; i++) {
+        arena_stats_copy(&g_arenas[i], &arenas[i]);
+        arena_stats_merge(total, &arenas[i]);
+    }
+    tags = __atomic_load_n(&g_tag_count, __ATOMIC_ACQUIRE);
+    for (i = 0; i < tags; i++) {
+        arena_stats_copy(&g_tags[i], &tag);
+        arena_stats_merge(total, &tag);
+    }
+}
+
+/**
+ * Computes the largest requested size counted in a histogram bucket.
+ * @param bin - index into thread_stats.sizes.
+ * @returns the size in bytes.
+ */
+static size_t stats_bin_max(size_t bin)
+{
+    if (bin < SLAB_CLASSES) {
+        return (bin + 1) * SLAB_CLASS_SIZE;
+    }
+    bin += 11 - SLAB_CLASSES;
+    return bin < 64 ? ((size_t) 1) << bin : SIZE_MAX;
+}
+
+/**
+ * Prints one line of malloc_stats: a name padded to a column and a value.
+ * @param fp - output stream.
+ * @param name - name of the counter.
+ * @param value - value of the counter.
+ */
+static void stats_line(FILE *fp, const char *name, uint64_t value)
+{
+    size_t len = strlen(name);
+
+    fputs(name, fp);
+    do {
+        fputc(' ', fp);
+    } while (++len < 18);
+    write_unsigned(fp, value);
+    fputc('\n', fp);
+}
+
+/**
+ * Prints the counters of an arena, or the sum of them, for malloc_stats.
+ * @param fp - output stream.
+ * @param stats - counters to print.
+ */
+static void stats_write_arena(FILE *fp, const struct arena_stats *stats)
+{
+    stats_line(fp, "mapped", stats->mapped);
+    stats_line(fp, "large mapped", stats->large_mapped);
+    stats_line(fp, "huge mapped", stats->huge_mapped);
+    stats_line(fp, "large blocks", stats->large_blocks);
+    stats_line(fp, "retained", stats->retained);
+    stats_line(fp, "maps", stats->maps);
+    stats_line(fp, "unmaps", stats->unmaps);
+    stats_line(fp, "lock acquired", stats->lock_acquired);
+    stats_line(fp, "lock contended", stats->lock_contended);
+    stats_line(fp, "lock wait ns", stats->lock_wait_ns);
+    stats_line(fp, "lock hold ns", stats->lock_hold_ns);
+}
+
+/**
+ * Prints the allocator statistics to standard error: the counters of each
+ * arena (if there are several), what each tag has in use, the totals and the
+ * allocation size histogram, as "<= size" lines for the buckets in use.
+ */
+void malloc_stats(void)
+{
+    struct arena_stats arenas[ARENA_MAX], total;
+    struct thread_stats threads;
+    struct tag_stats tag;
+    unsigned int tags, i;
+
+    stats_read(&threads, arenas, &total);
+
+    fputs("-- Allocator Statistics --\n", stderr);
+    if (g_arena_count > 1) {
+        for (i = 0; i < g_arena_count; i++) {
+            fputs("[ARENA]  ", stderr);
+            write_unsigned(stderr, i);
+            fputc('\n', stderr);
+            stats_write_arena(stderr, &arenas[i]);
+        }
+    }
+
+    tags = __atomic_load_n(&g_tag_count, __ATOMIC_ACQUIRE);
+    for (i = 0; i < tags; i++) {
+        tag_stats_read(&g_tags[i], &tag);
+        fputs("[TAG]    ", stderr);
+        fputs(g_tags[i].tag, stderr);
+        fputc('\n', stderr);
+        stats_line(stderr, "blocks", tag.blocks);
+        stats_line(stderr, "bytes", tag.bytes);
+        stats_line(stderr, "mapped", tag.mapped);
+    }
+
+    fputs("[TOTAL]\n", stderr);
+    stats_line(stderr, "allocations", threads.allocations);
+    stats_line(stderr, "frees", threads.frees);
+    stats_line(stderr, "reallocs", threads.reallocs);
+    stats_line(stderr, "in use", threads.in_use);
+    stats_write_arena(stderr, &total);
+
+    fputs("[SIZES]\n", stderr);
+    for (i = 0; i < STATS_SIZE_BINS; i++) {
+        if (threads.sizes[i] != 0) {
+            fputs("<= ", stderr);
+            write_unsigned(stderr, stats_bin_max(i));
+            fputc(' ', stderr);
+            write_unsigned(stderr, threads.sizes[i]);
+            fputc('\n', stderr);
+        }
+    }
+}
+
+/**
+ * Reports the allocator statistics in the layout of glibc's mallinfo2.
+ * Fields without a counterpart here (ordblks, smblks, usmblks, fsmblks)
+ * are 0.
+ * @returns the statistics: arena holds the bytes mapped for regions, hblks
+ *          and hblkhd the large blocks and their bytes, uordblks the bytes
+ *          in use, fordblks the mapped bytes not in use and keepcost the
+ *          bytes of retained regions.
+ */
+struct mallinfo2 mallinfo2(void)
+{
+    struct arena_stats arenas[ARENA_MAX], total;
+    struct thread_stats threads;
+    struct mallinfo2 info;
+    size_t mapped;
+
+    stats_read(&threads, arenas, &total);
+    mapped = total.mapped + total.large_mapped;
+
+    memset(&info, 0, sizeof(info));
+    info.arena = total.mapped;
+    info.hblks = total.large_blocks;
+    info.hblkhd = total.large_mapped;
+    info.uordblks = threads.in_use;
+    info.fordblks = mapped > threads.in_use ? mapped - threads.in_use : 0;
+    info.keepcost = total.retained;
+    return info;
+}
+
+/**
+ * Prints a JSON string, escaping what JSON requires.
+ * @param fp - output stream.
+ * @param str - string to print.
+ */
+static void json_string(FILE *fp, const char *str)
+{
+    fputc('"', fp);
+    for (; *str != '\0'; str++) {
+        if (*str == '"' || *str == '\\') {
+            fputc('\\', fp);
+            fputc(*str, fp);
+        }
+        else if ((unsigned char) *str < 0x20) {
+            fputs("\\u00", fp);
+            fputc("0123456789abcdef"[(unsigned char) *str >> 4], fp);
+            fputc("0123456789abcdef"[*str & 0xf], fp);
+        }
+        else {
+            fputc(*str, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+/**
+ * Prints a JSON member holding a number.
+ * @param fp - output stream.
+ * @param name - name of the member.
+ * @param value - value of the member.
+ * @param first - false if a comma has to separate it from the one before.
+ */
+static void json_field(FILE *fp, const char *name, uint64_t value,
+        bool first)
+{
+    if (!first) {
+        fputc(',', fp);
+    }
+    fputc('"', fp);
+    fputs(name, fp);
+    fputs("\":", fp);
+    write_unsigned(fp, value);
+}
+
+/**
+ * Prints the members holding the counters of an arena, or the sum of them.
+ * @param fp - output stream.
+ * @param stats - counters to print.
+ */
+static void json_arena(FILE *fp, const struct arena_stats *stats)
+{
+    json_field(fp, "mapped", stats->mapped, false);
+    json_field(fp, "large_mapped", stats->large_mapped, false);
+    json_field(fp, "huge_mapped", stats->huge_mapped, false);
+    json_field(fp, "large_blocks", stats->large_blocks, false);
+    json_field(fp, "retained", stats->retained, false);
+    json_field(fp, "maps", stats->maps, false);
+    json_field(fp, "unmaps", stats->unmaps, false);
+    json_field(fp, "lock_acquired", stats->lock_acquired, false);
+    json_field(fp, "lock_contended", stats->lock_contended, false);
+    json_field(fp, "lock_wait_ns", stats->lock_wait_ns, false);
+    json_field(fp, "lock_hold_ns", stats->lock_hold_ns, false);
+}
+
+/**
+ * Prints the allocator statistics as a single JSON object: the totals, an
+ * "arenas" array, a "tags" array and a "sizes" array of the histogram
+ * buckets in use.
+ * @param fp - output stream.
+ */
+static void stats_write_json(FILE *fp)
+{
+    struct arena_stats arenas[ARENA_MAX], total;
+    struct thread_stats threads;
+    struct tag_stats tag;
+    unsigned int tags, i;
+    bool first;
+
+    stats_read(&threads, arenas, &total);
+
+    fputc('{', fp);
+    json_field(fp, "allocations", threads.allocations, true);
+    json_field(fp, "frees", threads.frees, false);
+    json_field(fp, "reallocs", threads.reallocs, false);
+    json_field(fp, "in_use", threads.in_use, false);
+    json_arena(fp, &total);
+
+    fputs(",\"arenas\":[", fp);
+    for (i = 0; i < g_arena_count; i++) {
+        fputs(i == 0 ? "{" : ",{", fp);
+        json_field(fp, "index", i, true);
+        json_arena(fp, &arenas[i]);
+        fputc('}', fp);
+    }
+
+    fputs("],\"tags\":[", fp);
+    tags = __atomic_load_n(&g_tag_count, __ATOMIC_ACQUIRE);
+    for (i = 0; i < tags; i++) {
+        tag_stats_read(&g_tags[i], &tag);
+        fputs(i == 0 ? "{\"name\":" : ",{\"name\":", fp);
+        json_string(fp, g_tags[i].tag);
+        json_field(fp, "blocks", tag.blocks, false);
+        json_field(fp, "bytes", tag.bytes, false);
+        json_field(fp, "mapped", tag.mapped, false);
+        fputc('}', fp);
+    }
+
+    fputs("],\"sizes\":[", fp);
+    first = true;
+    for (i = 0; i < STATS_SIZE_BINS; i++) {
+        if (threads.sizes[i] != 0) {
+            fputs(first ? "{" : ",{", fp);
+            json_field(fp, "max", stats_bin_max(i), true);
+            json_field(fp, "count", threads.sizes[i], false);
+            fputc('}', fp);
+            first = false;
+        }
+    }
+    fputs("]}\n", fp);
+}
+
+/**
+ * Dumps the statistics as JSON when the process exits, if ALLOCATOR_STATS
+ * asks for it.
+ * @see stats_target for the values it takes.
+ */
+__attribute__((destructor))
+static void stats_dump(void)
+{
+    const char *target = stats_target();
+    FILE *fp;
+
+    if (target == NULL) {
+        return;
+    }
+
+    if (strcmp(target, "1") == 0 || strcmp(target, "stderr") == 0) {
+        stats_write_json(stderr);
+        return;
+    }
+
+    fp = fopen(target, "w");
+    if (fp == NULL) {
+        perror("fopen");
+        return;
+    }
+    stats_write_json(fp);
+    fclose(fp);
+}
+
+/**
+ * Maps a heap snapshot with room for a number of entries and their names.
+ * The buffers are mapped directly, so creating a snapshot doesn't touch the
+ * heap it is going to copy.
+ * @param capacity - number of entries to make room for (0: SNAPSHOT_INITIAL).
+ * @returns the snapshot, or NULL if it could not be mapped.
+ */
+struct heap_snapshot *heap_snapshot_create(size_t capacity)
+{
+    struct heap_snapshot *snapshot;
+    size_t page_sz = getpagesize(), entries, names, len;
+
+    if (capacity == 0) {
+        capacity = SNAPSHOT_INITIAL;
+    }
+    if (capacity > SIZE_MAX / 2 / (sizeof(struct snapshot_entry)
+                + SNAPSHOT_NAME_BYTES)) {
+        return NULL;
+    }
+
+    /* The structure, then the entries, then the names */
+    entries = (sizeof(*snapshot) + MEM_UNIT - 1) & ~(MEM_UNIT - 1);
+    names = entries + capacity * sizeof(struct snapshot_entry);
+    len = names + capacity * SNAPSHOT_NAME_BYTES + 1;
+    len = (len + page_sz - 1) & ~(page_sz - 1);
+
+    snapshot = mmap(NULL, len, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (snapshot == MAP_FAILED) {
+        return NULL;
+    }
+    snapshot->entries = (void *) snapshot + entries;
+    snapshot->capacity = capacity;
+    snapshot->names = (void *) snapshot + names;
+    snapshot->names_capacity = len - names;
+    snapshot->names_size = 1;
+    snapshot->mapped = len;
+    return snapshot;
+}
+
+/**
+ * Unmaps a heap snapshot.
+ * @param snapshot - snapshot to destroy, or NULL.
+ */
+void heap_snapshot_destroy(struct heap_snapshot *snapshot)
+{
+    if (snapshot != NULL) {
+        munmap(snapshot, snapshot->mapped);
+    }
+}
+
+/**
+ * Claims the next entry of a snapshot being taken. Entries past its capacity
+ * are only counted.
+ * @param snapshot - snapshot being taken.
+ * @param type - kind of the entry (an enum snapshot_type).
+ * @param arena - arena the entry belongs to.
+ * @returns the entry to fill in, or NULL if the snapshot is full.
+ */
+static struct snapshot_entry *snapshot_add(struct heap_snapshot *snapshot,
+        enum snapshot_type type, const struct arena *arena)
+{
+    struct snapshot_entry *entry;
+
+    if (snapshot->needed++ >= snapshot->capacity) {
+        return NULL;
+    }
+    entry = &snapshot->entries[snapshot->count++];
+    memset(entry, 0, sizeof(*entry));
+    entry->type = type;
+    entry->arena = arena->index;
+    return entry;
+}
+
+/**
+ * Copies the regions and blocks of an arena into a snapshot, in the order
+ * write_memory used to walk them. Callers hold the arena's lock.
+ * @param snapshot - snapshot being taken.
+ * @param arena - arena to copy.
+ * @param names - bytes of names seen so far, including those that didn't
+ *                fit; updated.
+ */
+static void snapshot_arena(struct heap_snapshot *snapshot,
+        struct arena *arena, size_t *names)
+{
+    struct mem_region *region;
+    struct mem_block *block;
+    struct block_meta *meta;
+    struct snapshot_entry *entry;
+    bool large = arena->head == NULL;
+    size_t len;
+
+    region = large ? arena->large : arena->head;
+    while (region != NULL) {
+        entry = snapshot_add(snapshot, SNAPSHOT_REGION, arena);
+        if (entry != NULL) {
+            entry->addr = (uintptr_t) region;
+            entry->size = region->size;
+            entry->flags = region->flags;
+        }
+
+        for (block = region_first(region); block != NULL;
+                block = block_next(block)) {
+            entry = snapshot_add(snapshot, SNAPSHOT_BLOCK, arena);
+            if (entry == NULL) {
+                continue;
+            }
+            entry->addr = (uintptr_t) block;
+
+            /* Large blocks keep their sizes in the region header */
+            if (region->flags & REGION_LARGE) {
+                entry->size = region->size - sizeof(struct mem_region);
+                entry->usage = region->usage;
+            }
+            else {
+                entry->size = (size_t) block->size * MEM_UNIT;
+                entry->usage = (size_t) block->usage * MEM_UNIT;
+            }
+
+            meta = block->named ? meta_find(arena, block) : NULL;
+            if (meta == NULL) {
+                continue;
+            }
+            entry->alloc_id = meta->alloc_id;
+            len = strnlen(meta->name, sizeof(meta->name) - 1);
+            if (len == 0) {
+                continue;
+            }
+
+            /* Names are only copied while they fit, but always counted */
+            if (*names + len + 1 <= snapshot->names_capacity) {
+                memcpy(snapshot->names + *names, meta->name, len);
+                snapshot->names[*names + len] = '\0';
+                entry->name = *names;
+                snapshot->names_size = *names + len + 1;
+            }
+            *names += len + 1;
+        }
+        region = region->next;
+
+        /* Large blocks are regions of their own and follow the list */
+        if (region == NULL && !large) {
+            region = arena->large;
+            large = true;
+        }
+    }
+}
+
+/**
+ * Copies the layout of the heap into a snapshot. Each arena is locked only
+ * while its own regions are copied, so the pause any thread sees is that of
+ * a walk over one arena; nothing is formatted or written until later, with
+ * heap_snapshot_write. Every arena is consistent in itself, but arenas are
+ * copied one after another.
+ * @param snapshot - snapshot to fill in, replacing what it held.
+ * @returns 0, or ENOSPC if the heap didn't fit: the snapshot then holds its
+ *          first entries and needed tells the capacity to create it with.
+ */
+int heap_snapshot_take(struct heap_snapshot *snapshot)
+{
+    struct arena *arena;
+    struct timespec ts;
+    size_t names = 1, by_names;
+
+    pthread_once(&g_arena_once, arena_init);
+
+    snapshot->count = 0;
+    snapshot->needed = 0;
+    snapshot->names[0] = '\0';
+    snapshot->names_size = 1;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    snapshot->time = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    snapshot->arenas = g_arena_count
+        + __atomic_load_n(&g_tag_count, __ATOMIC_ACQUIRE);
+
+    for (arena = arena_next(NULL); arena != NULL; arena = arena_next(arena)) {
+        arena_lock(arena);
+        remote_drain(arena);
+        snapshot_arena(snapshot, arena, &names);
+        arena_unlock(arena);
+    }
+
+    /* Names that didn't fit call for more entries, too */
+    by_names = (names + SNAPSHOT_NAME_BYTES - 1) / SNAPSHOT_NAME_BYTES;
+    if (names > snapshot->names_capacity && by_names > snapshot->needed) {
+        snapshot->needed = by_names;
+    }
+    return snapshot->count < snapshot->needed ? ENOSPC : 0;
+}
+
+/**
+ * Prints an entry of a snapshot in the text format of write_memory.
+ * @param fp - output stream.
+ * @param snapshot - snapshot holding the entry.
+ * @param entry - entry to print.
+ */
+static void snapshot_write_text(FILE *fp,
+        const struct heap_snapshot *snapshot,
+        const struct snapshot_entry *entry)
+{
+    void *addr = (void *) (uintptr_t) entry->addr;
+
+    fputs(entry->type == SNAPSHOT_REGION ? "[REGION] " : "[BLOCK]  ", fp);
+    write_pointer(fp, addr);
+    fputc('-', fp);
+    write_pointer(fp, addr + entry->size);
+    if (entry->type == SNAPSHOT_BLOCK) {
+        fputs(" (", fp);
+        write_unsigned(fp, entry->alloc_id);
+        fputs(") '", fp);
+        fputs(snapshot->names + entry->name, fp);
+        fputc('\'', fp);
+    }
+    fputc(' ', fp);
+    write_unsigned(fp, entry->size);
+    if (entry->type == SNAPSHOT_BLOCK) {
+        fputc(' ', fp);
+        write_unsigned(fp, entry->usage);
+        fputc(' ', fp);
+        write_unsigned(fp, entry->usage == 0
+                ? 0 : entry->usage - sizeof(struct mem_block));
+    }
+    fputc('\n', fp);
+}
+
+/**
+ * Prints a snapshot as one JSON object: its time, its arena count, and its
+ * regions, each holding its blocks.
+ * @param fp - output stream.
+ * @param snapshot - snapshot to print.
+ */
+static void snapshot_write_json(FILE *fp,
+        const struct heap_snapshot *snapshot)
+{
+    const struct snapshot_entry *entry;
+    bool region = false, block = false;
+    size_t i;
+
+    fputc('{', fp);
+    json_field(fp, "time", snapshot->time, true);
+    json_field(fp, "arenas", snapshot->arenas, false);
+    json_field(fp, "complete", snapshot->count >= snapshot->needed, false);
+    fputs(",\"regions\":[", fp);
+    for (i = 0; i < snapshot->count; i++) {
+        entry = &snapshot->entries[i];
+        if (entry->type == SNAPSHOT_REGION) {
+            fputs(region ? "]},{" : "{", fp);
+            region = true;
+            block = false;
+            json_field(fp, "arena", entry->arena, true);
+            fputs(",\"start\":\"", fp);
+            write_pointer(fp, (void *) (uintptr_t) entry->addr);
+            fputc('"', fp);
+            json_field(fp, "size", entry->size, false);
+            json_field(fp, "large", entry->flags & REGION_LARGE, false);
+            fputs(",\"blocks\":[", fp);
+            continue;
+        }
+
+        fputs(block ? ",{" : "{", fp);
+        block = true;
+        fputs("\"start\":\"", fp);
+        write_pointer(fp, (void *) (uintptr_t) entry->addr);
+        fputc('"', fp);
+        json_field(fp, "size", entry->size, false);
+        json_field(fp, "usage", entry->usage, false);
+        json_field(fp, "requested", entry->usage == 0
+                ? 0 : entry->usage - sizeof(struct mem_block), false);
+        json_field(fp, "alloc_id", entry->alloc_id, false);
+        fputs(",\"name\":", fp);
+        json_string(fp, snapshot->names + entry->name);
+        fputc('}', fp);
+    }
+    fputs(region ? "]}]}\n" : "]}\n", fp);
+}
+
+/**
+ * Writes a snapshot out. Nothing is locked, so a snapshot taken with
+ * heap_snapshot_take can be written at leisure, even to a slow stream.
+ * @param snapshot - snapshot to write.
+ * @param fp - output stream.
+ * @param format - SNAPSHOT_TEXT for the text of write_memory (which the
+ *                 visualizer reads), SNAPSHOT_JSON, or SNAPSHOT_BINARY for
+ *                 a snapshot_header, the entries and the name table (which
+ *                 tools/snapdecode turns into text).
+ */
+void heap_snapshot_write(const struct heap_snapshot *snapshot, FILE *fp,
+        enum heap_snapshot_format format)
+{
+    struct snapshot_header header;
+    int arena = -1;
+    size_t i;
+
+    switch (format) {
+    case SNAPSHOT_TEXT:
+        fputs("-- Current Memory State --\n", fp);
+        for (i = 0; i < snapshot->count; i++) {
+            /* With several arenas, each one is introduced by its number */
+            if (snapshot->arenas > 1 && snapshot->entries[i].arena != arena) {
+                arena = snapshot->entries[i].arena;
+                fputs("[ARENA]  ", fp);
+                write_unsigned(fp, arena);
+                fputc('\n', fp);
+            }
+            snapshot_write_text(fp, snapshot, &snapshot->entries[i]);
+        }
+        break;
+    case SNAPSHOT_JSON:
+        snapshot_write_json(fp, snapshot);
+        break;
+    case SNAPSHOT_BINARY:
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+        header.version = SNAPSHOT_VERSION;
+        header.entry_size = sizeof(struct snapshot_entry);
+        header.time = snapshot->time;
+        header.entries = snapshot->count;
+        header.names = snapshot->names_size;
+        header.arenas = snapshot->arenas;
+        header.block_header = sizeof(struct mem_block);
+        fwrite(&header, sizeof(header), 1, fp);
+        fwrite(snapshot->entries, sizeof(struct snapshot_entry),
+                snapshot->count, fp);
+        fwrite(snapshot->names, 1, snapshot->names_size, fp);
+        break;
+    }
+}
+
+/**
+ * Makes room for more bytes in a profile buffer, doubling its capacity.
+ * @param buf - buffer to grow.
+ * @param len - number of bytes about to be appended.
+ * @returns true if there is room, false if growing failed.
+ */
+static bool prof_reserve(struct prof_buf *buf, size_t len)
+{
+    size_t cap = buf->cap == 0 ? 4096 : buf->cap;
+    uint8_t *data;
+
+    if (buf->failed) {
+        return false;
+    }
+    if (buf->len + len <= buf->cap) {
+        return true;
+    }
+
+    while (cap < buf->len + len) {
+        cap *= 2;
+    }
+    data = realloc(buf->data, cap);
+    if (data == NULL) {
+        buf->failed = true;
+        return false;
+    }
+    buf->data = data;
+    buf->cap = cap;
+    return true;
+}
+
+/**
+ * Appends a protocol buffer varint.
+ * @param buf - buffer to append to.
+ * @param value - value to encode.
+ */
+static void pb_varint(struct prof_buf *buf, uint64_t value)
+{
+    if (!prof_reserve(buf, 10)) {
+        return;
+    }
+    while (value >= 0x80) {
+        buf->data[buf->len++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    buf->data[buf->len++] = value;
+}
+
+/**
+ * Appends a varint field.
+ * @param buf - buffer to append to.
+ * @param field - field number.
+ * @param value - value of the field.
+ */
+static void pb_uint(struct prof_buf *buf, unsigned int field, uint64_t value)
+{
+    pb_varint(buf, field << 3);
+    pb_varint(buf, value);
+}
+
+/**
+ * Appends a length-delimited field: a string, an embedded message or a
+ * packed array.
+ * @param buf - buffer to append to.
+ * @param field - field number.
+ * @param data - contents of the field.
+ * @param len - length of the contents.
+ */
+static void pb_bytes(struct prof_buf *buf, unsigned int field,
+        const void *data, size_t len)
+{
+    pb_varint(buf, (field << 3) | 2);
+    pb_varint(buf, len);
+    if (prof_reserve(buf, len)) {
+        memcpy(buf->data + buf->len, data, len);
+        buf->len += len;
+    }
+}
+
+/**
+ * Appends a length-delimited field holding a scratch buffer, then empties
+ * the scratch buffer for reuse.
+ * @param buf - buffer to append to.
+ * @param field - field number.
+ * @param msg - encoded contents of the field.
+ */
+static void pb_message(struct prof_buf *buf, unsigned int field,
+        struct prof_buf *msg)
+{
+    pb_bytes(buf, field, msg->data, msg->len);
+    buf->failed |= msg->failed;
+    msg->len = 0;
+}
+
+/**
+ * Appends an entry to the string table of a profile (field 6).
+ * @param buf - profile buffer.
+ * @param strings - number of strings so far, incremented.
+ * @param str - string to add.
+ * @returns index of the string.
+ */
+static uint64_t pb_string(struct prof_buf *buf, uint64_t *strings,
+        const char *str)
+{
+    pb_bytes(buf, 6, str, strlen(str));
+    return (*strings)++;
+}
+
+/**
+ * Appends a ValueType message (type and unit string indexes).
+ * @param buf - buffer to append to.
+ * @param msg - scratch buffer.
+ * @param field - field number.
+ * @param type - string index of the type.
+ * @param unit - string index of the unit.
+ */
+static void pb_value_type(struct prof_buf *buf, struct prof_buf *msg,
+        unsigned int field, uint64_t type, uint64_t unit)
+{
+    pb_uint(msg, 1, type);
+    pb_uint(msg, 2, unit);
+    pb_message(buf, field, msg);
+}
+
+/**
+ * Reads the executable mappings of the process from /proc/self/maps and
+ * appends them as Mapping messages (field 3), with IDs starting from 1.
+ * @param buf - profile buffer.
+ * @param msg - scratch buffer.
+ * @param strings - number of strings in the profile, for the file names.
+ * @param count - set to the number of mappings.
+ * @returns the address ranges of the mappings (to be freed), or NULL.
+ */
+static struct prof_mapping *prof_mappings(struct prof_buf *buf,
+        struct prof_buf *msg, uint64_t *strings, size_t *count)
+{
+    struct prof_mapping *maps = NULL, *grown;
+    unsigned long start, limit, offset;
+    char line[4096], perms[8], *path;
+    size_t cap = 0;
+    FILE *fp;
+    int skip;
+
+    *count = 0;
+    fp = fopen("/proc/self/maps", "r");
+    if (fp == NULL) {
+        return NULL;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        skip = 0;
+        if (sscanf(line, "%lx-%lx %7s %lx %*s %*s %n",
+                    &start, &limit, perms, &offset, &skip) < 4
+                || skip == 0 || perms[2] != 'x') {
+            continue;
+        }
+        path = line + skip;
+        path[strcspn(path, "\n")] = '\0';
+
+        if (*count == cap) {
+            cap = cap == 0 ? 64 : cap * 2;
+            grown = realloc(maps, cap * sizeof(*maps));
+            if (grown == NULL) {
+                break;
+            }
+            maps = grown;
+        }
+        maps[*count].start = start;
+        maps[*count].limit = limit;
+        maps[*count].offset = offset;
+        (*count)++;
+
+        pb_uint(msg, 1, *count);
+        pb_uint(msg, 2, start);
+        pb_uint(msg, 3, limit);
+        pb_uint(msg, 4, offset);
+        pb_uint(msg, 5, pb_string(buf, strings, path));
+        pb_message(buf, 3, msg);
+    }
+
+    fclose(fp);
+    return maps;
+}
+
+/**
+ * Finds or adds the location ID of a return address.
+ * @param table - location table, a power of two in size and never full.
+ * @param mask - size of the table minus one.
+ * @param locations - number of locations so far, incremented on adds.
+ * @param address - the return address.
+ * @returns the entry of the address.
+ */
+static struct prof_location *prof_location(struct prof_location *table,
+        size_t mask, uint64_t *locations, uintptr_t address)
+{
+    size_t i = (address * 0x9e3779b97f4a7c15ULL >> 32) & mask;
+
+    while (table[i].address != 0 && table[i].address != address) {
+        i = (i + 1) & mask;
+    }
+    if (table[i].address == 0) {
+        table[i].address = address;
+        table[i].id = ++(*locations);
+    }
+    return &table[i];
+}
+
+/**
+ * Writes a heap profile of the live sampled allocations in the pprof
+ * format (an uncompressed profile.proto message), which `pprof` reads
+ * directly. Sample values are scaled up by the sampling probability, so
+ * they estimate all live objects and bytes. Samples of named blocks carry
+ * their name in a "name" label. Stacks aren't symbolized; the executable
+ * mappings are included so pprof can do it.
+ * @param fp - output stream.
+ */
+void write_profile(FILE *fp)
+{
+    struct prof_buf buf = { 0 }, msg = { 0 }, packed = { 0 };
+    struct prof_sample *samples, *sample;
+    struct prof_location *table, *loc;
+    struct prof_mapping *maps;
+    struct block_meta *meta;
+    struct arena *arena;
+    size_t total = 0, count = 0, nmaps, frames, mask, size, i, j, k;
+    uint64_t strings = 0, locations = 0, name_key;
+    char (*names)[sizeof(meta->name)];
+    double scale;
+
+    /* Copy the samples out, so nothing is encoded under an arena lock */
+    pthread_once(&g_arena_once, arena_init);
+    for (arena = arena_next(NULL); arena != NULL; arena = arena_next(arena)) {
+        arena_lock(arena);
+        total += arena->prof_count;
+        arena_unlock(arena);
+    }
+    samples = malloc((total + 1) * sizeof(*samples));
+    names = malloc((total + 1) * sizeof(*names));
+    if (samples == NULL || names == NULL) {
+        free(samples);
+        free(names);
+        return;
+    }
+    for (arena = arena_next(NULL); arena != NULL; arena = arena_next(arena)) {
+        arena_lock(arena);
+        for (sample = arena->prof_live; sample != NULL && count < total;
+                sample = sample->next) {
+            samples[count] = *sample;
+            meta = meta_find(arena, sample->block);
+            memcpy(names[count], meta != NULL ? meta->name : "",
+                    sizeof(names[count]));
+            count++;
+        }
+        arena_unlock(arena);
+    }
+
+    /* The string table starts with the empty string */
+    pb_string(&buf, &strings, "");
+    pb_string(&buf, &strings, "inuse_objects");
+    pb_string(&buf, &strings, "count");
+    pb_string(&buf, &strings, "inuse_space");
+    pb_string(&buf, &strings, "bytes");
+    pb_string(&buf, &strings, "space");
+    name_key = pb_string(&buf, &strings, "name");
+    pb_value_type(&buf, &msg, 1, 1, 2);
+    pb_value_type(&buf, &msg, 1, 3, 4);
+    pb_value_type(&buf, &msg, 11, 5, 4);
+    pb_uint(&buf, 12, g_prof_rate);
+
+    maps = prof_mappings(&buf, &msg, &strings, &nmaps);
+
+    /* Size the location table for every frame being distinct */
+    frames = 0;
+    for (i = 0; i < count; i++) {
+        frames += samples[i].trace.depth;
+    }
+    for (mask = 15; mask < frames * 2; mask = mask * 2 + 1);
+    table = calloc(mask + 1, sizeof(*table));
+
+    for (i = 0; table != NULL && i < count; i++) {
+        sample = &samples[i];
+        for (j = 0; j < sample->trace.depth; j++) {
+            /* Return addresses point past the call; pprof wants the call */
+            loc = prof_location(table, mask, &locations,
+                    (uintptr_t) sample->trace.stack[j] - 1);
+            pb_varint(&packed, loc->id);
+        }
+        pb_message(&msg, 1, &packed);
+
+        /* An allocation of size bytes is sampled with probability
+         * 1 - exp(-size / rate); divide by it to estimate the total */
+        size = sample->size > 0 ? sample->size : 1;
+        scale = 1.0 / (1.0 - exp(-(double) size / g_prof_rate));
+        pb_varint(&packed, (uint64_t) (scale + 0.5));
+        pb_varint(&packed, (uint64_t) (scale * size + 0.5));
+        pb_message(&msg, 2, &packed);
+
+        if (names[i][0] != '\0') {
+            names[i][sizeof(names[i]) - 1] = '\0';
+            pb_uint(&packed, 1, name_key);
+            pb_uint(&packed, 2, pb_string(&buf, &strings, names[i]));
+            pb_message(&msg, 3, &packed);
+        }
+        pb_message(&buf, 2, &msg);
+    }
+
+    /* Locations point at the mapping holding their address */
+    for (i = 0; table != NULL && i <= mask; i++) {
+        if (table[i].address == 0) {
+            continue;
+        }
+        table[i].mapping = 0;
+        for (k = 0; k < nmaps; k++) {
+            if (table[i].address >= maps[k].start
+                    && table[i].address < maps[k].limit) {
+                table[i].mapping = k + 1;
+                break;
+            }
+        }
+        pb_uint(&msg, 1, table[i].id);
+        if (table[i].mapping != 0) {
+            pb_uint(&msg, 2, table[i].mapping);
+        }
+        pb_uint(&msg, 3, table[i].address);
+        pb_message(&buf, 4, &msg);
+    }
+
+    if (buf.failed || table == NULL) {
+        fputs("write_profile: out of memory\n", stderr);
+    }
+    else {
+        fwrite(buf.data, 1, buf.len, fp);
+    }
+
+    free(table);
+    free(maps);
+    free(samples);
+    free(names);
+    free(buf.data);
+    free(msg.data);
+    free(packed.data);
+}
+
+/**
+ * Writes the heap profile when the process exits, to the file named by the
+ * ALLOCATOR_PROFILE environment variable, if set.
+ * @see write_profile for the format.
+ */
+__attribute__((destructor))
+static void prof_dump(void)
+{
+    const char *path = getenv("ALLOCATOR_PROFILE");
+    FILE *fp;
+
+    if (path == NULL || *path == '\0') {
+        return;
+    }
+
+    fp = fopen(path, "w");
+    if (fp == NULL) {
+        perror("fopen");
+        return;
+    }
+    write_profile(fp);
+    fclose(fp);
 }
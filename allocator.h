@@ -8,65 +8,871 @@
 #define ALLOCATOR_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <malloc.h>
+#include "trace.h"
+#include "snapshot.h"
+#include "debug.h"
 
 /* -- Helper functions -- */
 void print_memory(void);
 void write_memory(FILE *fp);
+void write_profile(FILE *fp);
+
+/* -- Heap snapshots -- */
+
+/**
+ * Output formats of heap_snapshot_write.
+ */
+enum heap_snapshot_format {
+    SNAPSHOT_TEXT,   /*!< The text of write_memory, read by the visualizer */
+    SNAPSHOT_JSON,   /*!< One JSON object, regions holding their blocks */
+    SNAPSHOT_BINARY, /*!< snapshot_header, entries, then the name table */
+};
+
+struct heap_snapshot;
+struct heap_snapshot *heap_snapshot_create(size_t capacity);
+int heap_snapshot_take(struct heap_snapshot *snapshot);
+void heap_snapshot_write(const struct heap_snapshot *snapshot, FILE *fp,
+        enum heap_snapshot_format format);
+void heap_snapshot_destroy(struct heap_snapshot *snapshot);
 
 /* -- C Memory API functions -- */
 void *malloc(size_t size);
 void free(void *ptr);
+void free_sized(void *ptr, size_t size);
+void free_aligned_sized(void *ptr, size_t alignment, size_t size);
 void *calloc(size_t nmemb, size_t size);
 void *realloc(void *ptr, size_t size);
+int posix_memalign(void **memptr, size_t alignment, size_t size);
+void *aligned_alloc(size_t alignment, size_t size);
+void *memalign(size_t alignment, size_t size);
+void *valloc(size_t size);
+void *pvalloc(size_t size);
+size_t malloc_usable_size(void *ptr);
+void malloc_stats(void);
+struct mallinfo2 mallinfo2(void);
+
+/* -- Batch API -- */
+size_t malloc_batch(size_t size, size_t n, void **out);
+void free_batch(void **ptrs, size_t n);
+
+/* -- Tagged arenas -- */
+
+/**
+ * What a tag has in use, as reported by arena_tag_stats.
+ */
+struct tag_stats {
+    size_t blocks; /*!< Blocks in use */
+    size_t bytes;  /*!< Usable bytes of the blocks in use */
+    size_t mapped; /*!< Bytes mapped for the tag's regions and large blocks */
+};
+
+void *malloc_tag(size_t size, const char *tag);
+int arena_reset(const char *tag);
+int arena_tag_stats(const char *tag, struct tag_stats *stats);
+
+/* -- Unsynchronized implementations (callers hold the arena's lock) -- */
+struct arena;
+void *malloc_unsafe(struct arena *arena, size_t size);
+void *malloc_block_unsafe(struct arena *arena, size_t size);
+void *malloc_aligned_unsafe(struct arena *arena, size_t alignment,
+        size_t size);
+void *malloc_name_unsafe(struct arena *arena, size_t size,
+        const char *name);
+void free_unsafe(void *ptr);
+void free_block_unsafe(void *ptr);
+size_t malloc_batch_unsafe(struct arena *arena, size_t size, size_t n,
+        void **out);
+void free_batch_unsafe(void **ptrs, size_t n);
+void *realloc_unsafe(struct arena *arena, void *ptr, size_t size);
+
+/* -- Arena tuning -- */
+
+/**
+ * Largest number of arenas. The count defaults to the number of online CPUs
+ * and can be set with the ALLOCATOR_ARENAS environment variable.
+ */
+#define ARENA_MAX 64
+
+/**
+ * Largest number of tags given to malloc_tag, each of which gets an arena
+ * of its own besides those threads are assigned to.
+ */
+#define TAG_MAX 64
+
+/** Bytes of a tag's name that are kept, including the terminating NUL. */
+#define TAG_NAME_BYTES 32
+
+/* -- Region growth tuning -- */
+
+/**
+ * Smallest region mapped by expand_heap. Can be overridden with the
+ * ALLOCATOR_REGION_MIN environment variable.
+ */
+#define REGION_CHUNK_MIN (64 * 1024)
+
+/**
+ * Largest chunk size regions grow to. Can be overridden with the
+ * ALLOCATOR_REGION_MAX environment variable.
+ */
+#define REGION_CHUNK_MAX (4 * 1024 * 1024)
+
+/* -- Huge page tuning -- */
+
+/**
+ * Huge pages are 2^HUGE_PAGE_SHIFT bytes. With the ALLOCATOR_HUGEPAGES
+ * environment variable set, regions are whole huge pages and aligned to them.
+ */
+#define HUGE_PAGE_SHIFT 21
+
+/** Size of a huge page. */
+#define HUGE_PAGE_SIZE (1UL << HUGE_PAGE_SHIFT)
+
+/* -- Empty region retention tuning -- */
+
+/**
+ * Largest amount of empty regions kept for reuse instead of being unmapped.
+ * Can be overridden with the ALLOCATOR_RETAIN_MAX environment variable.
+ */
+#define RETAIN_MAX (16 * 1024 * 1024)
+
+/**
+ * Milliseconds after which a retained region is purged with madvise; after
+ * twice as long it is unmapped. Can be overridden with the
+ * ALLOCATOR_RETAIN_DECAY_MS environment variable.
+ */
+#define RETAIN_DECAY_MS 1000
+
+/* -- Large allocation tuning -- */
+
+/**
+ * Blocks of at least this many bytes (including the header) get a mapping
+ * of their own. Can be overridden with the ALLOCATOR_LARGE_THRESHOLD
+ * environment variable.
+ */
+#define LARGE_THRESHOLD (1024 * 1024)
+
+/** Region flag: the region is a single large block with its own mapping. */
+#define REGION_LARGE 0x1
+
+/** Region flag: the region was advised to be backed by transparent huge
+ *  pages. */
+#define REGION_HUGE 0x2
+
+/** Region flag: the region was mapped from the hugetlb pool. Such memory
+ *  cannot be purged page by page, only unmapped. */
+#define REGION_HUGETLB 0x4
+
+/* -- Block layout -- */
+
+/** Granularity of block sizes and alignment of every data area. */
+#define MEM_UNIT 16
+
+/**
+ * Largest block that can live in a shared region; the block header counts
+ * usage in 31 bits of MEM_UNITs. Bigger blocks are always large blocks.
+ */
+#define BLOCK_MAX_SIZE ((size_t) 1 << 34)
+
+/**
+ * If METADATA is enabled, every block gets an allocation ID in the metadata
+ * side table; otherwise only named blocks have an entry. The Makefile ties it
+ * to DEBUG.
+ */
+#ifndef METADATA
+#define METADATA 1
+#endif
+
+/** Initial number of slots of each arena's metadata side table. */
+#define META_INITIAL_SLOTS 1024
+
+/* -- Free space index tuning -- */
+
+/**
+ * Smallest slack that can hold a block (a header with an empty data area);
+ * blocks with less room after their usage are not indexed.
+ */
+#define FIT_MIN_SLACK (sizeof(struct mem_block))
+
+/** Size of the chunks that free space index nodes are carved from. */
+#define FIT_NODE_CHUNK (64 * 1024)
+
+/**
+ * log2 of the number of lists each power of two of slack is split into by
+ * the TLSF index (ALLOCATOR_ALGORITHM=tlsf). More lists waste less of the
+ * rounding up a search does; the second-level bitmaps hold up to 32.
+ */
+#define TLSF_SL_BITS 4
+#define TLSF_SL_COUNT (1u << TLSF_SL_BITS)
+
+/**
+ * First-level classes of the TLSF index: one for slack below TLSF_SL_COUNT
+ * units, and one for each power of two above, up to the 32 bits slack in
+ * MEM_UNITs is held in.
+ */
+#define TLSF_FL_COUNT (32 - TLSF_SL_BITS + 1)
+
+/* -- Heap profiling tuning -- */
+
+/**
+ * Mean number of bytes allocated between two samples of the heap profiler,
+ * used when ALLOCATOR_PROFILE is set. Can be overridden with the
+ * ALLOCATOR_PROFILE_RATE environment variable.
+ */
+#define PROF_RATE (512 * 1024)
+
+/** Deepest stack trace recorded for a sample. */
+#define PROF_DEPTH 32
+
+/** Size of the chunks that sample records are carved from. */
+#define PROF_CHUNK (64 * 1024)
+
+/* -- Trace and log buffering tuning -- */
+
+/** Records each thread buffers per stream before they are written out. */
+#define STREAM_RING_RECORDS 2048
+
+/** Milliseconds between writes of the buffered records in the background. */
+#define STREAM_FLUSH_MS 100
+
+/* -- Heap snapshot tuning -- */
+
+/** Bytes of block names a snapshot makes room for per entry. */
+#define SNAPSHOT_NAME_BYTES 8
+
+/** Entries made room for by heap_snapshot_create(0) and write_memory. */
+#define SNAPSHOT_INITIAL 4096
+
+/* -- Small object tuning -- */
+
+/** Slabs are 2^SLAB_SHIFT bytes and aligned to their size. */
+#define SLAB_SHIFT 12
+
+/** Size of a single slab. */
+#define SLAB_SIZE (1UL << SLAB_SHIFT)
+
+/** Smallest region that slabs are carved from (see expand_heap). */
+#define SLAB_REGION_SIZE (16 * SLAB_SIZE)
+
+/** Granularity of the small object size classes. */
+#define SLAB_CLASS_SIZE 16
+
+/** Largest request (in bytes) served from slabs. */
+#define SLAB_MAX_SIZE 1024
+
+/** Number of small object size classes. */
+#define SLAB_CLASSES (SLAB_MAX_SIZE / SLAB_CLASS_SIZE)
+
+/** Address bits resolved by each level of the slab page map. */
+#define PAGEMAP_LEVEL_BITS 18
+
+/** Number of entries in each level of the slab page map. */
+#define PAGEMAP_LEVEL_SIZE (1UL << PAGEMAP_LEVEL_BITS)
+
+/* -- Thread cache tuning -- */
+
+/** Objects moved between a thread cache and the shared slabs at once. */
+#define TCACHE_BATCH 16
+
+/** Maximum number of objects a thread keeps in a single class. */
+#define TCACHE_BIN_MAX (TCACHE_BATCH * 4)
 
 /* -- Data Structures and Globals -- */
 
 /**
- * Defines metadata structure for both memory 'regions' and 'blocks.' This
- * structure is prefixed before each allocation's data area.
+ * Defines metadata structure for memory 'blocks.' This structure is prefixed
+ * before each allocation's data area. Sizes are kept in MEM_UNITs so that the
+ * header fits in a single unit; the next block in memory starts right after
+ * this one, and the region is found at a fixed distance before it.
+ * Allocation IDs and names live in the metadata side table.
  */
 struct mem_block {
+    /** Size of the block in MEM_UNITs, including the header. */
+    uint32_t size;
+
     /**
-     * Each allocation is given a unique ID number. If an allocation is split in
-     * two, then the resulting new block will be given a new ID.
+     * Space used in MEM_UNITs, including the header; if usage == 0, then the
+     * block has been freed.
      */
-    unsigned long alloc_id;
+    uint32_t usage : 31;
+
+    /** Set if the block has an entry in the metadata side table. */
+    uint32_t named : 1;
 
     /**
-     * The name of this memory block. If the user doesn't specify a name for the
-     * block, it should be auto-generated based on the allocation ID.
+     * Size of the block right before this one in memory, in MEM_UNITs, or 0
+     * if this is the first block of its region.
      */
-    char name[32];
+    uint32_t prev_size;
 
-    /** Size of the memory region */
+    /** Distance from the start of the region to this block in MEM_UNITs. */
+    uint32_t region_offset;
+};
+
+/**
+ * Header placed at the start of every mapped memory region, followed by the
+ * region's first block. Aligned to MEM_UNIT so the first block is, too.
+ */
+struct mem_region {
+    /** Size of the region in bytes, from this header to the mapping end. */
     size_t size;
 
-    /** Space used; if usage == 0, then the block has been freed. */
+    /** Neighbours in the arena's region list (or its large block list). */
+    struct mem_region *next;
+    struct mem_region *prev;
+
+    /** Arena owning the region; blocks are always freed to it. */
+    struct arena *arena;
+
+    /**
+     * Each region is given a unique, increasing ID number when it joins the
+     * region list; the block list is ordered by it.
+     */
+    unsigned long id;
+
+    /** Number of blocks of the region that are in use. */
+    unsigned int live_blocks;
+
+    /** REGION_* flags describing the region. */
+    unsigned int flags;
+
+    /**
+     * Space used (in bytes, including the block header) by the block of a
+     * large region, whose size may not fit into the block header.
+     */
     size_t usage;
 
     /**
-     * Pointer to the start of the mapped memory region. This simplifies the
-     * process of finding where memory mappings begin.
+     * Offset from this header from which the region is known to hold only
+     * zeros: the pages were freshly mapped or purged with MADV_DONTNEED and
+     * no block has used them since. Lets calloc skip clearing them.
+     */
+    size_t clean;
+} __attribute__((aligned(MEM_UNIT)));
+
+/**
+ * Entry of the metadata side table, keyed by block header address.
+ */
+struct block_meta {
+    /** Block the entry belongs to, or NULL for an empty slot. */
+    const struct mem_block *block;
+
+    /**
+     * Each allocation is given a unique ID number. If an allocation is split in
+     * two, then the resulting new block will be given a new ID.
      */
-    struct mem_block *region_start;
+    unsigned long alloc_id;
+
+    /** The name of this memory block, set with malloc_name. */
+    char name[32];
+
+    /** Heap profile sample taken of the block, or NULL. */
+    struct prof_sample *sample;
+};
+
+/**
+ * Stack trace of an allocation, taken before the arena is locked.
+ */
+struct prof_trace {
+    /** Return addresses, innermost first. */
+    void *stack[PROF_DEPTH];
+
+    /** Number of addresses in stack. */
+    unsigned int depth;
+};
+
+/**
+ * Live allocation sampled by the heap profiler. Samples are linked into a
+ * list per arena and found from their block through the metadata side table.
+ */
+struct prof_sample {
+    /** Header of the sampled block. */
+    const struct mem_block *block;
+
+    /** Requested size. */
+    size_t size;
+
+    /** Neighbours in the arena's list of live samples (or spare records). */
+    struct prof_sample *next;
+    struct prof_sample *prev;
+
+    /** Where the block was allocated. */
+    struct prof_trace trace;
+};
+
+/**
+ * Growable output buffer used while encoding a heap profile.
+ */
+struct prof_buf {
+    /** Encoded bytes, their number and the capacity of data. */
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+
+    /** Set if growing the buffer failed; the output is then incomplete. */
+    bool failed;
+};
+
+/**
+ * Executable mapping of the process, so pprof can symbolize addresses.
+ */
+struct prof_mapping {
+    /** Address range and offset of the range in the mapped file. */
+    uintptr_t start;
+    uintptr_t limit;
+    uintptr_t offset;
+};
+
+/**
+ * Entry of the table assigning location IDs to return addresses.
+ */
+struct prof_location {
+    /** Return address, or 0 for an empty slot. */
+    uintptr_t address;
+
+    /** Location ID (starting from 1) and mapping ID (0 if unknown). */
+    uint64_t id;
+    uint64_t mapping;
+};
+
+/**
+ * A record of one of the streams; both kinds have the same size.
+ */
+union stream_record {
+    struct trace_record trace;
+    struct log_record log;
+};
+
+/**
+ * Buffer of the records one thread makes in a stream, mapped when the thread
+ * first makes one. The thread appends at head; records up to tail have been
+ * written out. Writing happens under the stream's lock, from the background
+ * thread or from the owner when the ring is full.
+ */
+struct stream_ring {
+    /** Records appended and written out so far. */
+    uint64_t head;
+    uint64_t tail;
+
+    /** Number of the thread in the stream. */
+    uint32_t thread;
+
+    /** Neighbours in the stream's list of rings. */
+    struct stream_ring *next;
+    struct stream_ring *prev;
+
+    /** The records, indexed by their count modulo STREAM_RING_RECORDS. */
+    union stream_record records[STREAM_RING_RECORDS];
+};
+
+/**
+ * A file of fixed-size records written by all threads: the allocation trace
+ * or the event log.
+ */
+struct stream {
+    /** File the records go to, or -1 if the stream is off. */
+    int fd;
+
+    /** Set once the process exits; records are then written directly. */
+    bool sync;
+
+    /** Time the stream was started, in nanoseconds. */
+    uint64_t start;
+
+    /** Guards writing to fd and the list of rings. */
+    pthread_mutex_t lock;
+
+    /** Buffers of the threads. */
+    struct stream_ring *rings;
+};
+
+/**
+ * Bookkeeping of an empty region that is kept for reuse instead of being
+ * unmapped. Stored right after the region header, in the first page, which
+ * is never purged.
+ */
+struct retained_region {
+    /** Neighbours in the retained list (oldest first). */
+    struct retained_region *next;
+    struct retained_region *prev;
+
+    /** Time (CLOCK_MONOTONIC, in milliseconds) the region became empty. */
+    unsigned long retired_ms;
+
+    /** Set once the pages of the region have been released with madvise. */
+    bool purged;
+
+    /** Set if the purge used MADV_DONTNEED, so the pages read as zeros. */
+    bool zeroed;
+};
+
+/**
+ * A copy of the heap layout. Its buffers are mapped when the snapshot is
+ * created, so taking it neither allocates nor disturbs the heap it copies;
+ * each arena is only locked while its own entries are copied.
+ */
+struct heap_snapshot {
+    /** Entries and their capacity, and how many the last take copied. */
+    struct snapshot_entry *entries;
+    size_t capacity;
+    size_t count;
+
+    /** Name table, its capacity and size in bytes. */
+    char *names;
+    size_t names_capacity;
+    size_t names_size;
 
     /**
-     * If this block is the beginning of a mapped memory region, the region_size
-     * member indicates the size of the mapping. In subsequent (split) blocks,
-     * this is undefined.
+     * Capacity the last take needed; if more than capacity, the snapshot is
+     * incomplete and should be taken again with a bigger one.
      */
-    size_t region_size;
+    size_t needed;
+
+    /** Time the snapshot was taken (CLOCK_REALTIME, in nanoseconds). */
+    uint64_t time;
+
+    /** Number of arenas in use. */
+    unsigned int arenas;
+
+    /** Size of the mapping holding this structure and its buffers. */
+    size_t mapped;
+};
+
+/**
+ * Placement policies selectable with the ALLOCATOR_ALGORITHM environment
+ * variable. The variable is read once, when the index is first used.
+ */
+enum fit_algorithm {
+    FIT_UNSET = 0, /*!< ALLOCATOR_ALGORITHM hasn't been read yet */
+    FIT_FIRST,     /*!< "first_fit" (default) */
+    FIT_BEST,      /*!< "best_fit" */
+    FIT_WORST,     /*!< "worst_fit" */
+    FIT_TLSF,      /*!< "tlsf": two-level segregated fit, in constant time */
+    FIT_NONE,      /*!< Unknown algorithm: blocks are never reused */
+};
+
+/**
+ * Huge page modes selectable with the ALLOCATOR_HUGEPAGES environment
+ * variable. Each falls back to the next when its pages aren't available.
+ */
+enum huge_mode {
+    HUGE_OFF = 0, /*!< Unset or "0": normal pages (default) */
+    HUGE_THP,     /*!< "1" or "thp": transparent huge pages */
+    HUGE_TLB,     /*!< "hugetlb": the hugetlb pool, then THP */
+};
+
+/**
+ * Node of the free space index: a treap describing the slack that follows
+ * the usage of one block. Ordering depends on the algorithm:
+ *  - first fit: block list order (region creation order, then address),
+ *    with the largest slack of each subtree kept for pruning the search;
+ *  - best fit: slack, then block list order;
+ *  - worst fit: slack, then reverse block list order.
+ * Nodes live outside the heap so blocks of any size can be indexed.
+ */
+struct fit_node {
+    /** Children in the treap. */
+    struct fit_node *left;
+    struct fit_node *right;
+
+    /** Block whose slack this node describes. */
+    struct mem_block *block;
 
-    /** Next block in the chain */
+    /** ID of the block's region, i.e. the region's list order. */
+    unsigned long region_id;
+
+    /** Free bytes after the usage of the block. */
+    size_t slack;
+
+    /** Largest slack in this subtree. */
+    size_t max_slack;
+
+    /** Heap priority of the treap. */
+    unsigned int priority;
+};
+
+/**
+ * Links of a block in a list of the TLSF index, kept in the block's own
+ * slack right after its usage (after the header of a free region head), so
+ * indexing and unindexing a block take constant time and no memory.
+ */
+struct tlsf_link {
+    struct mem_block *prev;
     struct mem_block *next;
 };
 
-static struct mem_block *g_head = NULL; /*!< Start (head) of our linked list */
+/**
+ * A single slab: one SLAB_SIZE granule holding objects of one size class.
+ * Objects carry no header; the slab is found through the page map. Objects
+ * that were never handed out are carved with a bump pointer, freed ones are
+ * kept in a list linked through their first word.
+ */
+struct slab {
+    /** Neighbours in the partial list of the class, or in the empty list. */
+    struct slab *next;
+    struct slab *prev;
+
+    /** Region this slab was carved from. */
+    struct slab_region *region;
+
+    /** Freed objects available for reuse. */
+    void *free_list;
+
+    /** Next object that has never been handed out. */
+    char *bump;
+
+    /** End of the object area. */
+    char *end;
+
+    /** Size class of the objects. */
+    unsigned int cls;
+
+    /** Number of objects currently handed out. */
+    unsigned int live;
+};
+
+/**
+ * Header of a region that slabs are carved from. The embedded block keeps the
+ * region in the regular block list, marked as fully used.
+ */
+struct slab_region {
+    /** Regular region header. */
+    struct mem_region region;
+
+    /** Block list entry covering the whole region. */
+    struct mem_block block;
+
+    /** Number of slabs carved from the region so far. */
+    size_t carved;
+
+    /** Number of carved slabs that are not on the empty list. */
+    size_t live;
+};
+
+/**
+ * Buckets of the allocation size histogram: one per slab class, then one per
+ * power of two from 2K up to 2^64.
+ */
+#define STATS_SIZE_BINS (SLAB_CLASSES + 54)
+
+/**
+ * Counters each thread keeps for the calls it makes. Only the thread writes
+ * them; they are combined with those of the other threads when read.
+ */
+struct thread_stats {
+    /** Calls to the allocation functions, to free and to realloc. */
+    uint64_t allocations;
+    uint64_t frees;
+    uint64_t reallocs;
+
+    /** Usable bytes allocated minus those freed. Memory is often freed by
+     *  another thread, so only the sum over all threads is meaningful. */
+    uint64_t in_use;
+
+    /** Allocations and reallocations by requested size. */
+    uint64_t sizes[STATS_SIZE_BINS];
+};
+
+/**
+ * Counters each arena keeps under its lock.
+ */
+struct arena_stats {
+    /** Bytes mapped for regions (retained ones included) and large blocks. */
+    uint64_t mapped;
+    uint64_t large_mapped;
+
+    /** Bytes of regions mapped to be backed by huge pages (a part of
+     *  mapped). */
+    uint64_t huge_mapped;
+
+    /** Number of large blocks mapped. */
+    uint64_t large_blocks;
+
+    /** Mappings made and given back, for regions and large blocks alike. */
+    uint64_t maps;
+    uint64_t unmaps;
+
+    /** Times the lock was taken, and how many of those had to wait. */
+    uint64_t lock_acquired;
+    uint64_t lock_contended;
+
+    /** Nanoseconds spent waiting for the lock and holding it. Hold times are
+     *  only measured when ALLOCATOR_STATS is set. */
+    uint64_t lock_wait_ns;
+    uint64_t lock_hold_ns;
+
+    /** Bytes of retained regions; only filled in when stats are read. */
+    uint64_t retained;
+};
+
+/**
+ * Per-thread cache of small objects. Cached objects still count as allocated
+ * in their slabs; the thread simply hands them out again without taking the
+ * heap lock. The link to the next cached object is stored in the object.
+ */
+struct tcache {
+    /** Heads of the per-class lists of cached objects. */
+    void *bins[SLAB_CLASSES];
+
+    /** Number of objects in each of the lists. */
+    unsigned int counts[SLAB_CLASSES];
+
+    /** Set once the thread exit destructor has been registered. */
+    bool registered;
+
+    /** Set while the thread is being torn down; the cache is bypassed. */
+    bool disabled;
+
+    /** Bytes left to allocate before the next profiler sample, and the
+     *  state of the generator drawing the distances (0: not seeded). */
+    uint64_t prof_left;
+    uint64_t prof_seed;
+
+    /** Set while the thread takes a stack trace, which may allocate. */
+    bool prof_busy;
+
+    /** Trace and log buffers of the thread (NULL until it makes a record)
+     *  and its number in both (0: not assigned yet). */
+    struct stream_ring *trace;
+    struct stream_ring *log;
+    uint32_t stream_thread;
+
+    /** Counters of the thread, and its neighbours in g_stats_threads. */
+    struct thread_stats stats;
+    struct tcache *stats_next;
+    struct tcache *stats_prev;
+};
+
+/**
+ * Ways of assigning threads to arenas, selected with the
+ * ALLOCATOR_ARENA_POLICY environment variable.
+ */
+enum arena_policy {
+    ARENA_ROUND_ROBIN = 0, /*!< "round_robin" (default): fixed per thread */
+    ARENA_CPU,             /*!< "cpu": the arena of the current CPU */
+};
+
+/**
+ * An independent heap: every arena has its own lock, regions, free space
+ * index, slabs and retained regions, so threads using different arenas don't
+ * contend. Memory is always returned to the arena owning its region.
+ */
+struct arena {
+    /** Objects freed by threads using other arenas, linked through their
+     *  first word. Pushed and taken atomically, without the lock. */
+    void *remote;
+
+    /** Protects everything below. */
+    pthread_mutex_t lock;
+
+    /** Position in g_arenas, or ARENA_MAX plus the position in g_tags. */
+    unsigned int index;
+
+    /** Name of a tagged arena, or "" for the arenas threads are assigned. */
+    char tag[TAG_NAME_BYTES];
+
+    /** Start and end of the region list. */
+    struct mem_region *head;
+    struct mem_region *tail;
+
+    /** List of large blocks. */
+    struct mem_region *large;
+
+    /** Minimum size of the next region, growing with every mapping. */
+    size_t region_chunk;
+
+    /** Metadata side table, its capacity and number of entries. */
+    struct block_meta *meta;
+    size_t meta_slots;
+    size_t meta_count;
+
+    /** Free space index, its unused nodes and treap priority generator. */
+    struct fit_node *fit_root;
+    struct fit_node *fit_spare;
+    unsigned int fit_seed;
+
+    /** TLSF index: first-level classes with a non-empty list, the
+     *  non-empty lists of each class, and the lists. */
+    uint32_t tlsf_first;
+    uint32_t tlsf_second[TLSF_FL_COUNT];
+    struct mem_block *tlsf_lists[TLSF_FL_COUNT][TLSF_SL_COUNT];
+
+    /** Slabs with room per class, slabs holding no objects, and the region
+     *  slabs are being carved from. */
+    struct slab *slab_partial[SLAB_CLASSES];
+    struct slab *slab_empty;
+    struct slab_region *slab_region;
+
+    /** Retained empty regions (oldest first, and newest) and their size. */
+    struct retained_region *retained;
+    struct retained_region *retained_tail;
+    size_t retained_bytes;
+
+    /** Blocks in use and their usable bytes. A region of slabs counts as a
+     *  single block; tagged arenas have none. */
+    size_t live_blocks;
+    size_t live_bytes;
+
+    /** Counters of the arena, and when the lock was taken (in nanoseconds,
+     *  only set when hold times are measured). */
+    struct arena_stats stats;
+    uint64_t lock_since;
+
+    /** Live heap profile samples, their number and unused records. */
+    struct prof_sample *prof_live;
+    size_t prof_count;
+    struct prof_sample *prof_spare;
+};
+
+static struct arena g_arenas[ARENA_MAX]; /*!< The arenas */
+static unsigned int g_arena_count = 0; /*!< Arenas in use */
+static unsigned int g_arena_next = 0; /*!< Round-robin assignment counter */
+static enum arena_policy g_arena_policy; /*!< Thread assignment policy */
+static struct arena g_tags[TAG_MAX]; /*!< Arenas of malloc_tag's tags */
+static unsigned int g_tag_count = 0; /*!< Tags in use */
+static pthread_mutex_t g_tag_lock =
+        PTHREAD_MUTEX_INITIALIZER; /*!< Serializes the creation of tags */
+static pthread_once_t g_arena_once =
+        PTHREAD_ONCE_INIT; /*!< Guards the setup of the arenas */
+static __thread struct arena *g_thread_arena
+        __attribute__((tls_model("initial-exec"))); /*!< This thread's arena */
+static size_t g_large_threshold = 0; /*!< Size of large blocks (unset: 0) */
+static long g_realloc_growth = -1; /*!< Realloc reserve in % (unset: -1) */
+static size_t g_region_chunk = 0; /*!< Size of an arena's first region */
+static size_t g_region_chunk_max = 0; /*!< Limit of the region growth */
+static enum huge_mode g_huge_pages = HUGE_OFF; /*!< Huge page backing */
+static size_t g_retain_max = (size_t) -1; /*!< Per-arena retention limit */
+static unsigned long g_retain_decay_ms = 0; /*!< Retention decay time */
+static bool g_retain_background = false; /*!< Purge from a helper thread */
+static pthread_once_t g_retain_thread_once =
+        PTHREAD_ONCE_INIT; /*!< Guards the start of the purge thread */
 static unsigned long g_allocations = 0; /*!< Allocation counter */
-static pthread_mutex_t g_heap_lock = 
-        PTHREAD_MUTEX_INITIALIZER; /*!< Mutex that protects memory operations*/
+static unsigned long g_regions = 0; /*!< Region counter */
+static enum fit_algorithm g_fit_algorithm = FIT_UNSET; /*!< Fit policy */
+static struct slab **g_pagemap[PAGEMAP_LEVEL_SIZE]; /*!< Granule -> slab */
+static pthread_key_t g_tcache_key; /*!< Drains thread caches on thread exit */
+static pthread_once_t g_tcache_once =
+        PTHREAD_ONCE_INIT; /*!< Guards creation of g_tcache_key */
+static __thread struct tcache g_tcache
+        __attribute__((tls_model("initial-exec"))); /*!< This thread's cache */
+static pthread_mutex_t g_stats_lock =
+        PTHREAD_MUTEX_INITIALIZER; /*!< Guards g_stats_threads */
+static struct tcache *g_stats_threads = NULL; /*!< Caches of live threads */
+static struct thread_stats g_stats_exited; /*!< Counters of ended threads */
+static bool g_stats_timing = false; /*!< Measure lock hold times */
+static size_t g_prof_rate = 0; /*!< Mean bytes between samples (off: 0) */
+static struct stream g_trace = {
+    -1, false, 0, PTHREAD_MUTEX_INITIALIZER, NULL
+}; /*!< Allocation trace (ALLOCATOR_TRACE) */
+static struct stream g_log = {
+    -1, false, 0, PTHREAD_MUTEX_INITIALIZER, NULL
+}; /*!< Event log (ALLOCATOR_LOG) */
+static uint32_t g_stream_threads = 0; /*!< Threads numbered in streams */
+static unsigned int g_log_level = LOG_LEVEL; /*!< Runtime log level */
 
 #endif
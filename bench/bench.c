@@ -0,0 +1,609 @@
+/**
+ * @file bench.c
+ *
+ * Multithreaded allocator benchmarks. Each run executes one workload for a
+ * fixed time with whatever malloc is linked in or preloaded, and prints a
+ * single JSON object with its throughput, latency percentiles, peak RSS and
+ * fragmentation. See run.sh for the driver comparing allocators.
+ *
+ * Usage: bench <workload> [threads] [seconds]
+ * Workloads: larson, threadtest, prodcons, realloc, mixed, latency.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+/** One operation in this many is timed for the latency histogram, except
+ *  in the latency workload, which times them all. */
+#define LATENCY_SAMPLE 64
+
+/** Sub-buckets per power of two in the latency histogram. */
+#define HIST_SUB 8
+
+/** Buckets of the latency histogram (nanoseconds up to 2^64). */
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+/** Objects each larson thread keeps live. */
+#define LARSON_SLOTS 1000
+
+/** Replacements a larson thread makes before handing its slots on. */
+#define LARSON_ROUND 10000
+
+/** Objects a threadtest thread allocates before freeing them all. */
+#define THREADTEST_BATCH 1000
+
+/** Capacity of each producer/consumer queue. */
+#define QUEUE_SIZE 1024
+
+/** Objects each mixed or latency thread keeps live. */
+#define MIXED_SLOTS 2000
+
+/** Size a realloc buffer grows to before it is freed. */
+#define REALLOC_MAX (1024 * 1024)
+
+/**
+ * State of one benchmark thread. Counters read by the sampler are written
+ * with relaxed atomics.
+ */
+struct worker {
+    pthread_t thread;
+    unsigned int index;
+    uint64_t seed;
+
+    /** Operations (malloc, free and realloc calls) done so far. */
+    uint64_t ops;
+
+    /** Bytes requested by this thread minus those it freed. Frees of other
+     *  threads' memory make it negative; only the sum is meaningful. */
+    int64_t live;
+
+    /** Latency histogram of the timed operations, and the slowest one. */
+    uint64_t hist[HIST_BUCKETS];
+    uint64_t max_ns;
+
+    /** Slots the thread works on (larson, mixed). */
+    void **slots;
+    size_t *sizes;
+
+    /** Queue shared with the partner thread (prodcons). */
+    struct queue *queue;
+};
+
+/**
+ * Single-producer single-consumer queue of allocations.
+ */
+struct queue {
+    void *items[QUEUE_SIZE];
+    size_t sizes[QUEUE_SIZE];
+    uint64_t head;
+    uint64_t tail;
+};
+
+/**
+ * Slot arrays handed between larson threads.
+ */
+struct larson_set {
+    void *slots[LARSON_SLOTS];
+    size_t sizes[LARSON_SLOTS];
+};
+
+static volatile bool g_stop = false; /*!< Set when the time is up */
+static unsigned int g_sample = LATENCY_SAMPLE; /*!< Timing one op in this */
+static struct larson_set *volatile g_larson_mailbox; /*!< Set handed on */
+
+/**
+ * Reads the monotonic clock.
+ * @returns current time in nanoseconds.
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Draws a pseudo-random number (xorshift64*).
+ * @param w - worker holding the generator state.
+ * @returns the number.
+ */
+static uint64_t rnd(struct worker *w)
+{
+    w->seed ^= w->seed >> 12;
+    w->seed ^= w->seed << 25;
+    w->seed ^= w->seed >> 27;
+    return w->seed * 0x2545f4914f6cdd1dULL;
+}
+
+/**
+ * Draws a size uniformly from a range.
+ * @param w - worker holding the generator state.
+ * @param min - smallest size.
+ * @param max - largest size.
+ * @returns the size.
+ */
+static size_t rnd_size(struct worker *w, size_t min, size_t max)
+{
+    return min + rnd(w) % (max - min + 1);
+}
+
+/**
+ * Maps a latency to its histogram bucket: HIST_SUB buckets per power of two.
+ * @param ns - latency in nanoseconds.
+ * @returns the bucket.
+ */
+static unsigned int hist_bucket(uint64_t ns)
+{
+    unsigned int log;
+
+    if (ns < HIST_SUB) {
+        return ns;
+    }
+    log = 63 - __builtin_clzll(ns);
+    return log * HIST_SUB + ((ns >> (log - 3)) & (HIST_SUB - 1));
+}
+
+/**
+ * Computes the smallest latency counted in a histogram bucket.
+ * @param bucket - the bucket.
+ * @returns the latency in nanoseconds.
+ */
+static uint64_t hist_value(unsigned int bucket)
+{
+    unsigned int log = bucket / HIST_SUB;
+
+    if (bucket < HIST_SUB) {
+        return bucket;
+    }
+    return (1ULL << log) + ((uint64_t) (bucket % HIST_SUB) << (log - 3));
+}
+
+/**
+ * Counts an operation, timing one in g_sample of them.
+ * @param w - worker doing the operation.
+ * @returns start time if the operation is timed, or 0.
+ */
+static uint64_t op_begin(struct worker *w)
+{
+    return (w->ops % g_sample) == 0 ? now_ns() : 0;
+}
+
+/**
+ * Finishes an operation started with op_begin.
+ * @param w - worker doing the operation.
+ * @param start - value returned by op_begin.
+ */
+static void op_end(struct worker *w, uint64_t start)
+{
+    uint64_t ns;
+
+    if (start != 0) {
+        ns = now_ns() - start;
+        w->hist[hist_bucket(ns)]++;
+        if (ns > w->max_ns) {
+            w->max_ns = ns;
+        }
+    }
+    __atomic_store_n(&w->ops, w->ops + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Allocates memory, touching it like a real user would.
+ * @param w - worker doing the allocation.
+ * @param size - size to allocate.
+ * @returns the allocation.
+ */
+static void *bench_malloc(struct worker *w, size_t size)
+{
+    uint64_t start = op_begin(w);
+    char *ptr = malloc(size);
+
+    op_end(w, start);
+    if (ptr == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    ptr[0] = ptr[size - 1] = 1;
+    __atomic_store_n(&w->live, w->live + size, __ATOMIC_RELAXED);
+    return ptr;
+}
+
+/**
+ * Frees memory allocated with bench_malloc.
+ * @param w - worker doing the free.
+ * @param ptr - the allocation.
+ * @param size - its requested size.
+ */
+static void bench_free(struct worker *w, void *ptr, size_t size)
+{
+    uint64_t start = op_begin(w);
+
+    free(ptr);
+    op_end(w, start);
+    __atomic_store_n(&w->live, w->live - size, __ATOMIC_RELAXED);
+}
+
+/**
+ * Larson-style server churn: each thread replaces random objects of 16 to
+ * 512 bytes, and after every round hands its set over to another thread,
+ * which frees the objects the first one allocated.
+ * @param arg - the worker.
+ */
+static void *larson(void *arg)
+{
+    struct worker *w = arg;
+    struct larson_set *set = calloc(1, sizeof(*set)), *next;
+    size_t i, n;
+
+    for (i = 0; i < LARSON_SLOTS; i++) {
+        set->sizes[i] = rnd_size(w, 16, 512);
+        set->slots[i] = bench_malloc(w, set->sizes[i]);
+    }
+
+    while (!g_stop) {
+        for (n = 0; n < LARSON_ROUND; n++) {
+            i = rnd(w) % LARSON_SLOTS;
+            bench_free(w, set->slots[i], set->sizes[i]);
+            set->sizes[i] = rnd_size(w, 16, 512);
+            set->slots[i] = bench_malloc(w, set->sizes[i]);
+        }
+        next = __atomic_exchange_n(&g_larson_mailbox, set, __ATOMIC_ACQ_REL);
+        if (next != NULL) {
+            set = next;
+        }
+        else {
+            /* Nobody handed a set on yet: start a new one */
+            set = calloc(1, sizeof(*set));
+            for (i = 0; i < LARSON_SLOTS; i++) {
+                set->sizes[i] = rnd_size(w, 16, 512);
+                set->slots[i] = bench_malloc(w, set->sizes[i]);
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Hoard's threadtest: each thread allocates a batch of 64 byte objects and
+ * frees them all, over and over.
+ * @param arg - the worker.
+ */
+static void *threadtest(void *arg)
+{
+    struct worker *w = arg;
+    void **batch = malloc(THREADTEST_BATCH * sizeof(void *));
+    size_t i;
+
+    while (!g_stop) {
+        for (i = 0; i < THREADTEST_BATCH; i++) {
+            batch[i] = bench_malloc(w, 64);
+        }
+        for (i = 0; i < THREADTEST_BATCH; i++) {
+            bench_free(w, batch[i], 64);
+        }
+    }
+    free(batch);
+    return NULL;
+}
+
+/**
+ * Producer/consumer pipeline: even threads allocate messages of 16 to 4096
+ * bytes and queue them, odd threads free them.
+ * @param arg - the worker.
+ */
+static void *prodcons(void *arg)
+{
+    struct worker *w = arg;
+    struct queue *q = w->queue;
+    uint64_t pos;
+    size_t size;
+
+    if (w->index % 2 == 0) {
+        while (!g_stop) {
+            pos = q->head;
+            while (pos - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)
+                    >= QUEUE_SIZE) {
+                if (g_stop) {
+                    return NULL;
+                }
+                sched_yield();
+            }
+            size = rnd_size(w, 16, 4096);
+            q->items[pos % QUEUE_SIZE] = bench_malloc(w, size);
+            q->sizes[pos % QUEUE_SIZE] = size;
+            __atomic_store_n(&q->head, pos + 1, __ATOMIC_RELEASE);
+        }
+    }
+    else {
+        for (;;) {
+            pos = q->tail;
+            while (__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == pos) {
+                if (g_stop) {
+                    return NULL;
+                }
+                sched_yield();
+            }
+            bench_free(w, q->items[pos % QUEUE_SIZE],
+                    q->sizes[pos % QUEUE_SIZE]);
+            __atomic_store_n(&q->tail, pos + 1, __ATOMIC_RELEASE);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Realloc growth: each thread grows buffers from 16 bytes to REALLOC_MAX in
+ * steps of up to a quarter of their size, like a string builder, then frees
+ * them.
+ * @param arg - the worker.
+ */
+static void *realloc_growth(void *arg)
+{
+    struct worker *w = arg;
+    size_t size, grown;
+    uint64_t start;
+    char *buf;
+
+    while (!g_stop) {
+        size = 16;
+        buf = bench_malloc(w, size);
+        while (size < REALLOC_MAX && !g_stop) {
+            grown = size + rnd_size(w, 1, size / 4 + 1);
+            start = op_begin(w);
+            buf = realloc(buf, grown);
+            op_end(w, start);
+            if (buf == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+            buf[grown - 1] = 1;
+            __atomic_store_n(&w->live, w->live + grown - size,
+                    __ATOMIC_RELAXED);
+            size = grown;
+        }
+        bench_free(w, buf, size);
+    }
+    return NULL;
+}
+
+/**
+ * Mixed sizes: each thread replaces random objects whose sizes are 80%
+ * small (16 to 256 bytes), 15% medium (up to 64K) and 5% large (up to 4M).
+ * @param arg - the worker.
+ */
+static void *mixed(void *arg)
+{
+    struct worker *w = arg;
+    size_t i, pick;
+
+    for (i = 0; i < MIXED_SLOTS; i++) {
+        w->sizes[i] = 0;
+    }
+
+    while (!g_stop) {
+        i = rnd(w) % MIXED_SLOTS;
+        if (w->sizes[i] != 0) {
+            bench_free(w, w->slots[i], w->sizes[i]);
+        }
+        pick = rnd(w) % 100;
+        if (pick < 80) {
+            w->sizes[i] = rnd_size(w, 16, 256);
+        }
+        else if (pick < 95) {
+            w->sizes[i] = rnd_size(w, 257, 64 * 1024);
+        }
+        else {
+            w->sizes[i] = rnd_size(w, 64 * 1024 + 1, 4 * 1024 * 1024);
+        }
+        w->slots[i] = bench_malloc(w, w->sizes[i]);
+    }
+    return NULL;
+}
+
+/**
+ * Worst-case latency: each thread replaces random objects of 1K to 16K,
+ * above the slab sizes, so every call goes through the free space index
+ * of a heap riddled with holes of all sizes. Every call is timed, so the
+ * maximum is the slowest call made rather than the slowest one sampled.
+ * @param arg - the worker.
+ */
+static void *latency(void *arg)
+{
+    struct worker *w = arg;
+    size_t i;
+
+    for (i = 0; i < MIXED_SLOTS; i++) {
+        w->sizes[i] = rnd_size(w, 1025, 16 * 1024);
+        w->slots[i] = bench_malloc(w, w->sizes[i]);
+    }
+
+    while (!g_stop) {
+        i = rnd(w) % MIXED_SLOTS;
+        bench_free(w, w->slots[i], w->sizes[i]);
+        w->sizes[i] = rnd_size(w, 1025, 16 * 1024);
+        w->slots[i] = bench_malloc(w, w->sizes[i]);
+    }
+    return NULL;
+}
+
+/**
+ * Reads the resident set size of the process.
+ * @returns RSS in bytes.
+ */
+static uint64_t rss_bytes(void)
+{
+    unsigned long size, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+
+    if (fp != NULL) {
+        if (fscanf(fp, "%lu %lu", &size, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(fp);
+    }
+    return (uint64_t) resident * sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * Finds the latency below which a fraction of the timed operations fall.
+ * @param hist - merged latency histogram.
+ * @param total - number of timed operations.
+ * @param fraction - the fraction, e.g. 0.99.
+ * @returns the latency in nanoseconds.
+ */
+static uint64_t percentile(const uint64_t *hist, uint64_t total,
+        double fraction)
+{
+    uint64_t seen = 0, target = (uint64_t) (total * fraction);
+    unsigned int i;
+
+    /* The whole of the operations ends with the slowest one */
+    if (target >= total) {
+        target = total > 0 ? total - 1 : 0;
+    }
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen > target) {
+            return hist_value(i);
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    void *(*run)(void *);
+    const char *workload, *label, *algorithm, *baseline;
+    unsigned int threads, i, j;
+    uint64_t hist[HIST_BUCKETS] = { 0 };
+    uint64_t start, elapsed, ops, timed, max_ns, rss, peak_rss = 0;
+    uint64_t peak_live = 0;
+    int64_t live;
+    struct worker *workers;
+    struct queue *queues;
+    struct rusage usage;
+    double seconds, rate;
+
+    if (argc < 2) {
+        fputs("usage: bench <larson|threadtest|prodcons|realloc|mixed"
+                "|latency> [threads] [seconds]\n", stderr);
+        return 1;
+    }
+    workload = argv[1];
+    threads = argc > 2 ? strtoul(argv[2], NULL, 10) : 4;
+    seconds = argc > 3 ? strtod(argv[3], NULL) : 1.0;
+    if (threads < 1) {
+        threads = 1;
+    }
+
+    if (strcmp(workload, "larson") == 0) {
+        run = larson;
+    }
+    else if (strcmp(workload, "threadtest") == 0) {
+        run = threadtest;
+    }
+    else if (strcmp(workload, "prodcons") == 0) {
+        run = prodcons;
+        threads += threads % 2;
+    }
+    else if (strcmp(workload, "realloc") == 0) {
+        run = realloc_growth;
+    }
+    else if (strcmp(workload, "mixed") == 0) {
+        run = mixed;
+    }
+    else if (strcmp(workload, "latency") == 0) {
+        run = latency;
+        g_sample = 1;
+    }
+    else {
+        fprintf(stderr, "bench: unknown workload '%s'\n", workload);
+        return 1;
+    }
+
+    workers = calloc(threads, sizeof(*workers));
+    queues = calloc(threads / 2 + 1, sizeof(*queues));
+    for (i = 0; i < threads; i++) {
+        workers[i].index = i;
+        workers[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+        workers[i].queue = &queues[i / 2];
+        workers[i].slots = calloc(MIXED_SLOTS, sizeof(void *));
+        workers[i].sizes = calloc(MIXED_SLOTS, sizeof(size_t));
+    }
+
+    start = now_ns();
+    for (i = 0; i < threads; i++) {
+        pthread_create(&workers[i].thread, NULL, run, &workers[i]);
+    }
+
+    /* Sample the live bytes and RSS while the workers run */
+    do {
+        usleep(10000);
+        live = 0;
+        for (i = 0; i < threads; i++) {
+            live += __atomic_load_n(&workers[i].live, __ATOMIC_RELAXED);
+        }
+        rss = rss_bytes();
+        if (live > 0 && (uint64_t) live > peak_live) {
+            peak_live = live;
+        }
+        if (rss > peak_rss) {
+            peak_rss = rss;
+        }
+        elapsed = now_ns() - start;
+    } while (elapsed < seconds * 1e9);
+
+    g_stop = true;
+    for (i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    elapsed = now_ns() - start;
+
+    ops = timed = max_ns = 0;
+    for (i = 0; i < threads; i++) {
+        ops += workers[i].ops;
+        if (workers[i].max_ns > max_ns) {
+            max_ns = workers[i].max_ns;
+        }
+        for (j = 0; j < HIST_BUCKETS; j++) {
+            hist[j] += workers[i].hist[j];
+            timed += workers[i].hist[j];
+        }
+    }
+    rate = ops / (elapsed / 1e9);
+    getrusage(RUSAGE_SELF, &usage);
+
+    label = getenv("BENCH_LABEL");
+    algorithm = getenv("ALLOCATOR_ALGORITHM");
+    baseline = getenv("BENCH_BASELINE");
+    printf("{\"workload\":\"%s\",\"allocator\":\"%s\",\"algorithm\":\"%s\","
+            "\"threads\":%u,\"seconds\":%.3f,\"ops\":%lu,"
+            "\"ops_per_sec\":%.0f,",
+            workload, label != NULL ? label : "default",
+            algorithm != NULL ? algorithm : "", threads, elapsed / 1e9,
+            (unsigned long) ops, rate);
+    if (baseline != NULL && strtod(baseline, NULL) > 0) {
+        printf("\"vs_baseline\":%.3f,", rate / strtod(baseline, NULL));
+    }
+    printf("\"latency_ns\":{\"p50\":%lu,\"p99\":%lu,\"p999\":%lu,"
+            "\"max\":%lu},",
+            (unsigned long) percentile(hist, timed, 0.5),
+            (unsigned long) percentile(hist, timed, 0.99),
+            (unsigned long) percentile(hist, timed, 0.999),
+            (unsigned long) max_ns);
+    printf("\"peak_rss_kb\":%ld,\"peak_live_kb\":%lu,"
+            "\"fragmentation\":%.3f}\n",
+            usage.ru_maxrss, (unsigned long) (peak_live / 1024),
+            peak_live > 0 ? (double) peak_rss / peak_live : 0.0);
+    return 0;
+}
@@ -0,0 +1,510 @@
+/**
+ * @file replay.c
+ *
+ * Replays an allocation trace written with ALLOCATOR_TRACE against whatever
+ * malloc is linked in or preloaded, and prints a single JSON object with the
+ * time the calls took and the fragmentation they left. The calls of all
+ * threads are merged by timestamp and replayed in one thread, so every run
+ * of a trace makes the same calls in the same order.
+ *
+ * Usage: replay <trace>
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <malloc.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../trace.h"
+
+/** Steps replayed between two reads of the RSS, which aren't timed. */
+#define REPLAY_SAMPLE 1024
+
+/** Initial number of entries of the pointer table. */
+#define MAP_INITIAL 4096
+
+/**
+ * A record of the trace, with its timestamp at hand for sorting.
+ */
+struct event {
+    uint64_t time;
+    const struct trace_record *record;
+};
+
+/**
+ * A call to replay. Pointers of the trace are replaced by slots, so the
+ * replay doesn't depend on the addresses the traced allocator handed out.
+ */
+struct step {
+    /** Requested size, and the alignment of TRACE_MEMALIGN steps. */
+    uint64_t size;
+    uint64_t arg;
+
+    /** Slot holding the allocation. */
+    uint32_t slot;
+
+    /** The call (an enum trace_op). */
+    uint8_t op;
+};
+
+/**
+ * An allocation made by the replay.
+ */
+struct slot {
+    void *ptr;
+    size_t size;
+};
+
+/**
+ * Entry of the table mapping live pointers of the trace to slots.
+ */
+struct map_entry {
+    /** Pointer in the trace, or 0 for an empty entry. */
+    uint64_t key;
+    uint32_t slot;
+};
+
+/**
+ * Live pointers of the trace while it is turned into steps.
+ */
+struct map {
+    struct map_entry *entries;
+    size_t cap;
+    size_t count;
+};
+
+/*
+ * The replay's own memory is mapped directly, so it neither takes part in
+ * the allocator's fragmentation nor shows up in its statistics.
+ */
+
+/**
+ * Maps zeroed memory, exiting if that fails.
+ * @param size - number of bytes.
+ * @param populate - fault the pages in right away.
+ * @returns the memory.
+ */
+static void *pages(size_t size, bool populate)
+{
+    void *ptr = mmap(NULL, size == 0 ? 1 : size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | (populate ? MAP_POPULATE : 0),
+            -1, 0);
+
+    if (ptr == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return ptr;
+}
+
+/**
+ * Unmaps memory mapped with pages.
+ * @param ptr - the memory.
+ * @param size - number of bytes given to pages.
+ */
+static void pages_free(void *ptr, size_t size)
+{
+    munmap(ptr, size == 0 ? 1 : size);
+}
+
+/**
+ * Reads the monotonic clock.
+ * @returns current time in nanoseconds.
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Reads the anonymous part of the resident set size, leaving out mapped
+ * files such as the program and its libraries. Uses plain system calls, as
+ * stdio would allocate.
+ * @returns RSS in bytes.
+ */
+static uint64_t rss_bytes(void)
+{
+    unsigned long resident, shared;
+    char buf[128], *end;
+    ssize_t len;
+    int fd = open("/proc/self/statm", O_RDONLY);
+
+    if (fd < 0) {
+        return 0;
+    }
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) {
+        return 0;
+    }
+    buf[len] = '\0';
+
+    /* Fields: size, resident, shared, ... (in pages) */
+    strtoul(buf, &end, 10);
+    resident = strtoul(end, &end, 10);
+    shared = strtoul(end, &end, 10);
+    return (uint64_t) (resident - shared) * sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * Sorts events by time. A merge sort, as it is stable: calls of one thread
+ * made within the same nanosecond stay in order.
+ * @param events - events to sort.
+ * @param tmp - scratch space for as many events.
+ * @param count - number of events.
+ */
+static void sort_events(struct event *events, struct event *tmp, size_t count)
+{
+    size_t mid = count / 2, i = 0, j = mid, k = 0;
+
+    if (count < 2) {
+        return;
+    }
+    sort_events(events, tmp, mid);
+    sort_events(events + mid, tmp, count - mid);
+
+    while (i < mid && j < count) {
+        if (events[j].time < events[i].time) {
+            tmp[k++] = events[j++];
+        }
+        else {
+            tmp[k++] = events[i++];
+        }
+    }
+    while (i < mid) {
+        tmp[k++] = events[i++];
+    }
+    memcpy(events, tmp, k * sizeof(*events));
+}
+
+/**
+ * Finds the table entry of a pointer, or the empty entry it would go to.
+ * @param map - the table.
+ * @param key - pointer in the trace.
+ * @returns the entry.
+ */
+static struct map_entry *map_entry(struct map *map, uint64_t key)
+{
+    size_t i = (key >> 4) * 0x9e3779b97f4a7c15ULL & (map->cap - 1);
+
+    while (map->entries[i].key != 0 && map->entries[i].key != key) {
+        i = (i + 1) & (map->cap - 1);
+    }
+    return &map->entries[i];
+}
+
+/**
+ * Adds a pointer to the table, doubling it when it gets half full.
+ * @param map - the table.
+ * @param key - pointer in the trace, not yet in the table.
+ * @param slot - slot of the allocation.
+ */
+static void map_insert(struct map *map, uint64_t key, uint32_t slot)
+{
+    struct map_entry *old = map->entries, *entry;
+    size_t old_cap = map->cap, i;
+
+    if ((map->count + 1) * 2 > map->cap) {
+        map->cap = old_cap * 2;
+        map->entries = pages(map->cap * sizeof(*entry), false);
+        for (i = 0; i < old_cap; i++) {
+            if (old[i].key != 0) {
+                *map_entry(map, old[i].key) = old[i];
+            }
+        }
+        pages_free(old, old_cap * sizeof(*old));
+    }
+
+    entry = map_entry(map, key);
+    entry->key = key;
+    entry->slot = slot;
+    map->count++;
+}
+
+/**
+ * Removes an entry from the table, moving up the entries after it that
+ * would no longer be found.
+ * @param map - the table.
+ * @param entry - entry to remove.
+ */
+static void map_remove(struct map *map, struct map_entry *entry)
+{
+    size_t hole = entry - map->entries, i = hole, home;
+
+    for (;;) {
+        i = (i + 1) & (map->cap - 1);
+        if (map->entries[i].key == 0) {
+            break;
+        }
+        home = (map->entries[i].key >> 4) * 0x9e3779b97f4a7c15ULL
+            & (map->cap - 1);
+        /* Move the entry if its home isn't between the hole and it */
+        if (((i - home) & (map->cap - 1)) >= ((i - hole) & (map->cap - 1))) {
+            map->entries[hole] = map->entries[i];
+            hole = i;
+        }
+    }
+    map->entries[hole].key = 0;
+    map->count--;
+}
+
+/**
+ * Turns the merged records into steps. Records that don't fit together,
+ * which only happens when calls of different threads raced within the
+ * resolution of the clock, are repaired or skipped and counted.
+ * @param events - records in time order.
+ * @param count - number of records.
+ * @param steps - where the steps are stored (room for 2 * count).
+ * @param nsteps - set to the number of steps.
+ * @param nslots - set to the number of slots used.
+ * @returns number of records skipped or repaired.
+ */
+static size_t resolve(const struct event *events, size_t count,
+        struct step *steps, size_t *nsteps, uint32_t *nslots)
+{
+    struct map map = {
+        pages(MAP_INITIAL * sizeof(struct map_entry), false), MAP_INITIAL, 0
+    };
+    struct map_entry *entry;
+    uint32_t *spare = pages(count * sizeof(uint32_t), false);
+    size_t i, n = 0, nspare = 0, odd = 0;
+    uint32_t slot, next = 0;
+    const struct trace_record *r;
+    uint8_t op;
+
+    for (i = 0; i < count; i++) {
+        r = events[i].record;
+        op = r->op;
+
+        /* Take over the slot of a freed or reallocated pointer */
+        if (op == TRACE_FREE || (op == TRACE_REALLOC && r->arg != 0)) {
+            entry = map_entry(&map, op == TRACE_FREE ? r->ptr : r->arg);
+            if (entry->key == 0) {
+                /* Its allocation wasn't traced; keep what the call made */
+                odd++;
+                if (op == TRACE_FREE || r->ptr == 0) {
+                    continue;
+                }
+                op = TRACE_MALLOC;
+                slot = nspare > 0 ? spare[--nspare] : next++;
+            }
+            else {
+                slot = entry->slot;
+                map_remove(&map, entry);
+                if (op == TRACE_FREE || r->ptr == 0) {
+                    steps[n++] = (struct step) { 0, 0, slot, op };
+                    spare[nspare++] = slot;
+                    continue;
+                }
+            }
+        }
+        else if (r->ptr == 0) {
+            continue;
+        }
+        else {
+            slot = nspare > 0 ? spare[--nspare] : next++;
+        }
+
+        /* A pointer that is still live must have been freed meanwhile */
+        entry = map_entry(&map, r->ptr);
+        if (entry->key != 0) {
+            odd++;
+            steps[n++] = (struct step) { 0, 0, entry->slot, TRACE_FREE };
+            spare[nspare++] = entry->slot;
+            map_remove(&map, entry);
+        }
+
+        steps[n++] = (struct step) { r->size, r->arg, slot, op };
+        map_insert(&map, r->ptr, slot);
+    }
+
+    pages_free(map.entries, map.cap * sizeof(*map.entries));
+    pages_free(spare, count * sizeof(uint32_t));
+    *nsteps = n;
+    *nslots = next;
+    return odd;
+}
+
+/**
+ * Writes to every page of an allocation from an offset on, as the traced
+ * program would have, so that it becomes resident.
+ * @param ptr - the allocation.
+ * @param from - first byte that may not have been written yet.
+ * @param size - size of the allocation.
+ */
+static void touch(char *ptr, size_t from, size_t size)
+{
+    size_t i;
+
+    for (i = from; i < size; i += 4096) {
+        ((volatile char *) ptr)[i] = 1;
+    }
+    if (size > from) {
+        ((volatile char *) ptr)[size - 1] = 1;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const struct trace_header *header;
+    const struct trace_chunk *chunk;
+    const char *algorithm;
+    struct event *events, *tmp;
+    struct step *steps, *step;
+    struct slot *slots, *slot;
+    struct stat st;
+    size_t count = 0, nsteps, odd, failed = 0, i, j, end;
+    uint64_t elapsed = 0, start, rss, base_rss, peak_rss = 0;
+    int64_t live = 0, peak_live = 0;
+    uint32_t nslots, threads = 0;
+    const uint8_t *data;
+    size_t off;
+    void *result;
+    int fd;
+
+    if (argc != 2) {
+        fputs("usage: replay <trace>\n", stderr);
+        return 1;
+    }
+
+    fd = open(argv[1], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0
+            || st.st_size < (off_t) sizeof(*header)) {
+        fprintf(stderr, "replay: cannot read '%s'\n", argv[1]);
+        return 1;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    header = (const struct trace_header *) data;
+    if (memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0
+            || header->version != TRACE_VERSION
+            || header->record_size != sizeof(struct trace_record)) {
+        fprintf(stderr, "replay: '%s' is not a version %d trace\n", argv[1],
+                TRACE_VERSION);
+        return 1;
+    }
+
+    /* Count the records; a trace cut short ends at its last whole chunk */
+    for (off = sizeof(*header); off + sizeof(*chunk) <= (size_t) st.st_size;
+            off = end) {
+        chunk = (const struct trace_chunk *) (data + off);
+        end = off + sizeof(*chunk) + chunk->count * sizeof(struct trace_record);
+        if (end > (size_t) st.st_size) {
+            fprintf(stderr, "replay: trace truncated at byte %zu\n", off);
+            break;
+        }
+        count += chunk->count;
+    }
+
+    /* Collect and merge the records of all threads */
+    events = pages(count * sizeof(*events), false);
+    for (off = sizeof(*header), i = 0; i < count; off = end) {
+        chunk = (const struct trace_chunk *) (data + off);
+        end = off + sizeof(*chunk) + chunk->count * sizeof(struct trace_record);
+        for (j = 0; j < chunk->count; j++) {
+            events[i].record = (const struct trace_record *)
+                (data + off + sizeof(*chunk)) + j;
+            events[i].time = events[i].record->time;
+            i++;
+        }
+        if (chunk->thread > threads) {
+            threads = chunk->thread;
+        }
+    }
+    tmp = pages(count * sizeof(*tmp), false);
+    sort_events(events, tmp, count);
+    pages_free(tmp, count * sizeof(*tmp));
+
+    steps = pages(2 * count * sizeof(*steps), false);
+    odd = resolve(events, count, steps, &nsteps, &nslots);
+    pages_free(events, count * sizeof(*events));
+    munmap((void *) data, st.st_size);
+
+    /* Everything the replay needs is resident before the baseline is read */
+    slots = pages(nslots * sizeof(*slots), true);
+    base_rss = rss_bytes();
+
+    for (i = 0; i < nsteps; i = end) {
+        end = i + REPLAY_SAMPLE < nsteps ? i + REPLAY_SAMPLE : nsteps;
+
+        start = now_ns();
+        for (j = i; j < end; j++) {
+            step = &steps[j];
+            slot = &slots[step->slot];
+            switch (step->op) {
+            case TRACE_MALLOC:
+                result = malloc(step->size);
+                break;
+            case TRACE_CALLOC:
+                result = calloc(1, step->size);
+                break;
+            case TRACE_MEMALIGN:
+                result = memalign(step->arg, step->size);
+                break;
+            case TRACE_REALLOC:
+                result = realloc(slot->ptr, step->size);
+                if (result == NULL && step->size != 0) {
+                    failed++;
+                    continue;
+                }
+                touch(result, slot->size, step->size);
+                live += (int64_t) step->size - slot->size;
+                slot->ptr = result;
+                slot->size = step->size;
+                continue;
+            default:
+                free(slot->ptr);
+                live -= slot->size;
+                slot->ptr = NULL;
+                slot->size = 0;
+                continue;
+            }
+            if (result == NULL) {
+                failed++;
+                continue;
+            }
+            touch(result, 0, step->size);
+            live += step->size;
+            slot->ptr = result;
+            slot->size = step->size;
+        }
+        elapsed += now_ns() - start;
+
+        rss = rss_bytes();
+        if (rss > peak_rss) {
+            peak_rss = rss;
+        }
+        if (live > peak_live) {
+            peak_live = live;
+        }
+    }
+    peak_rss = peak_rss > base_rss ? peak_rss - base_rss : 0;
+
+    algorithm = getenv("ALLOCATOR_ALGORITHM");
+    printf("{\"trace\":\"%s\",\"algorithm\":\"%s\",\"threads\":%u,"
+            "\"records\":%zu,\"steps\":%zu,\"repaired\":%zu,\"failed\":%zu,"
+            "\"seconds\":%.6f,\"ops_per_sec\":%.0f,\"peak_live_kb\":%lu,"
+            "\"peak_rss_kb\":%lu,\"fragmentation\":%.3f}\n",
+            argv[1], algorithm != NULL ? algorithm : "", threads, count,
+            nsteps, odd, failed, elapsed / 1e9,
+            elapsed > 0 ? nsteps / (elapsed / 1e9) : 0.0,
+            (unsigned long) (peak_live / 1024),
+            (unsigned long) (peak_rss / 1024),
+            peak_live > 0 ? (double) peak_rss / peak_live : 0.0);
+    return 0;
+}
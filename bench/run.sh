@@ -0,0 +1,69 @@
+#!/usr/bin/env bash
+#
+# Runs the benchmark workloads against glibc malloc and against allocator.so
+# with each ALLOCATOR_ALGORITHM, printing a JSON array with one object per run
+# to stdout and a summary table to stderr. Runs of allocator.so carry
+# "vs_baseline", their throughput relative to glibc on the same workload.
+#
+# Usage: run.sh [workload...]
+# Environment: BENCH_THREADS (default: online CPUs, at least 2),
+#              BENCH_SECONDS (default: 1), BENCH_LIB (default: the
+#              allocator.so next to this script).
+
+dir="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+bench="${dir}/bench"
+lib="${BENCH_LIB:-${dir}/allocator.so}"
+threads="${BENCH_THREADS:-$(nproc)}"
+seconds="${BENCH_SECONDS:-1}"
+workloads=("$@")
+algorithms=(first_fit best_fit worst_fit tlsf)
+
+if [[ ${#workloads[@]} -eq 0 ]]; then
+    workloads=(larson threadtest prodcons realloc mixed latency)
+fi
+if [[ ${threads} -lt 2 ]]; then
+    threads=2
+fi
+
+# Prints a field of a result object (numbers only)
+field() {
+    sed -n "s/.*\"$2\":\([0-9.]*\).*/\1/p" <<< "$1"
+}
+
+# Prints one row of the summary table
+summary() {
+    printf '%-11s %-10s %-10s %12s %8s %8s %9s %10s %7s\n' "$@" >&2
+}
+
+summary workload allocator algorithm ops/sec vs_glibc p99_ns max_ns \
+    peak_rss_kb frag
+
+first=1
+echo "["
+for workload in "${workloads[@]}"; do
+    result="$(BENCH_LABEL=glibc "${bench}" "${workload}" "${threads}" \
+        "${seconds}")" || exit 1
+    baseline="$(field "${result}" ops_per_sec)"
+    [[ ${first} -eq 1 ]] || echo ","
+    first=0
+    echo -n "  ${result}"
+    summary "${workload}" glibc - "${baseline}" 1.000 \
+        "$(field "${result}" p99)" "$(field "${result}" max)" \
+        "$(field "${result}" peak_rss_kb)" \
+        "$(field "${result}" fragmentation)"
+
+    for algorithm in "${algorithms[@]}"; do
+        result="$(LD_PRELOAD="${lib}" ALLOCATOR_ALGORITHM="${algorithm}" \
+            BENCH_LABEL=allocator BENCH_BASELINE="${baseline}" \
+            "${bench}" "${workload}" "${threads}" "${seconds}")" || exit 1
+        echo ","
+        echo -n "  ${result}"
+        summary "${workload}" allocator "${algorithm}" \
+            "$(field "${result}" ops_per_sec)" \
+            "$(field "${result}" vs_baseline)" "$(field "${result}" p99)" \
+            "$(field "${result}" max)" "$(field "${result}" peak_rss_kb)" \
+            "$(field "${result}" fragmentation)"
+    done
+done
+echo
+echo "]"
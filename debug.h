@@ -1,16 +1,22 @@
 /**
  * @file
  *
- * Helps facilitate debugging by providing basic logging functionality. Unlike
- * printf-style debugging, the log messages can be enabled/disabled by changing 
- * the value of DEBUG.
+ * Helps facilitate debugging by providing basic logging functionality. Log
+ * messages aren't formatted when they are made: each one becomes a fixed-size
+ * binary record (call site, arguments, thread and time) in a buffer of the
+ * calling thread, which is written to the file named by ALLOCATOR_LOG. The
+ * logdecode tool (tools/logdecode.c) turns the records into text offline, so
+ * logging never goes through stdio while an allocation is in progress.
+ *
+ * Messages above LOG_LEVEL are compiled out; ALLOCATOR_LOG_LEVEL lowers the
+ * level further at run time.
  */
 
 #ifndef _DEBUG_H_
 #define _DEBUG_H_
 
-#include <stdio.h>
-#include <unistd.h>
+#include <stdint.h>
+#include "trace.h"
 
 /**
  * If DEBUG is not set, it will be enabled by default.
@@ -20,8 +26,8 @@
 #endif
 
 /**
- * DEBUG_COLOR determines whether debug output is colorized. It is enabled by
- * default.
+ * DEBUG_COLOR determines whether decoded log output is colorized when it
+ * goes to a terminal. It is enabled by default.
  */
 #ifndef DEBUG_COLOR
 #define DEBUG_COLOR 1
@@ -33,52 +39,170 @@
 #define COLOR_RESET "\033[0m"
 #endif
 
+/** Log levels: errors, region mappings, and every allocator call. */
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_INFO  2
+#define LOG_LEVEL_DEBUG 3
+
 /**
- * Prints an unformatted log message (single string).
- *
- * Example Usage:
- * LOGP("Hello world!");
+ * Highest level of the messages compiled in (0 compiles out all of them).
+ * Follows DEBUG unless set explicitly.
+ */
+#ifndef LOG_LEVEL
+#define LOG_LEVEL (DEBUG ? LOG_LEVEL_DEBUG : 0)
+#endif
+
+/** First bytes of every log file. */
+#define LOG_MAGIC "ALLOCLOG"
+
+/** Log format version, bumped on incompatible changes. */
+#define LOG_VERSION 1
+
+/**
+ * Call site of a log message. Sites are placed in the allocator_log_sites
+ * section, so the log can describe all of them in its header and records
+ * only need an index into the table.
+ */
+struct log_site {
+    const char *file;
+    const char *func;
+    const char *fmt;
+    uint32_t line;
+    uint32_t level;
+};
+
+/**
+ * Header at the start of a log file. The call sites follow, each a
+ * log_site_header and its file name, function name and format as
+ * NUL-terminated strings; then chunks of records, laid out like those of a
+ * trace (see trace.h).
+ */
+struct log_header {
+    /** LOG_MAGIC, without its terminating NUL. */
+    char magic[8];
+
+    /** LOG_VERSION. */
+    uint32_t version;
+
+    /** Size of a log_record, so readers can reject foreign layouts. */
+    uint32_t record_size;
+
+    /** Number of call sites described after the header. */
+    uint32_t sites;
+    uint32_t reserved;
+};
+
+/**
+ * Description of a call site in the log header.
+ */
+struct log_site_header {
+    uint32_t line;
+    uint16_t level;
+
+    /** Length of the three strings that follow, NULs included. */
+    uint16_t length;
+};
+
+/**
+ * A single log message.
+ */
+struct log_record {
+    /** Nanoseconds since the log was started. */
+    uint64_t time;
+
+    /** Arguments of the message, converted to 64 bits. */
+    uint64_t args[2];
+
+    /** Index of the call site in the log header. */
+    uint32_t site;
+    uint32_t reserved;
+};
+
+/**
+ * Records a log message; called by the LOG macros.
+ * @param site - call site of the message.
+ * @param arg0 - first argument of the message, or 0.
+ * @param arg1 - second argument of the message, or 0.
  */
-#define LOGP(str) \
+void log_event(const struct log_site *site, uint64_t arg0, uint64_t arg1)
+    __attribute__((visibility("hidden")));
+
+/**
+ * Lets the compiler check a log format against its arguments. Never called.
+ */
+static inline void log_check(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2)));
+static inline void log_check(const char *fmt, ...)
+{
+    (void) fmt;
+}
+
+/** Picks the first two arguments of a message, padded with zeros. */
+#define LOG_ARGS(_0, arg0, arg1, ...) \
+    (uint64_t) (uintptr_t) (arg0), (uint64_t) (uintptr_t) (arg1)
+
+/**
+ * Records a log message of a given level. Messages take at most two
+ * arguments, which must be integers or pointers: the decoder only has their
+ * values.
+ */
+#define LOG_AT(level, fmt, ...) \
     do { \
-        if (DEBUG) { \
-            if (DEBUG_COLOR) { \
-                if (isatty(STDERR_FILENO)) { \
-                    fprintf(stderr, "%s%s%s:%d:%s%s()%s: %s", \
-                            COLOR_RED, __FILE__, COLOR_RESET, \
-                            __LINE__, \
-                            COLOR_BLUE, __func__, COLOR_RESET, \
-                            str); \
-                    break; \
-                } \
-                fprintf(stderr, "%s:%d:%s(): %s", \
-                        __FILE__, __LINE__, __func__, str); \
-            } \
+        static const struct log_site log_site \
+            __attribute__((section("allocator_log_sites"), aligned(8))) \
+            = { __FILE__, __func__, fmt, __LINE__, level }; \
+        if (0) { \
+            log_check(fmt, ##__VA_ARGS__); \
         } \
+        log_event(&log_site, LOG_ARGS(0, ##__VA_ARGS__, 0, 0)); \
     } while (0)
 
 /**
- * Prints a formatted log message.
- *
- * Example Usage:
- * LOG("Hello %s, your lucky number is %d\n", "World", 42);
+ * Stands in for a compiled out message, still checking its arguments.
  */
-#define LOG(fmt, ...) \
+#define LOG_NONE(fmt, ...) \
     do { \
-        if (DEBUG) { \
-            if (DEBUG_COLOR) { \
-                if (isatty(STDERR_FILENO)) { \
-                    fprintf(stderr, "%s%s%s:%d:%s%s()%s: " fmt, \
-                            COLOR_RED, __FILE__, COLOR_RESET, \
-                            __LINE__, \
-                            COLOR_BLUE, __func__, COLOR_RESET, \
-                            __VA_ARGS__); \
-                    break; \
-                } \
-                fprintf(stderr, "%s:%d:%s(): " fmt, __FILE__, \
-                        __LINE__, __func__, __VA_ARGS__); \
-            } \
+        if (0) { \
+            log_check(fmt, ##__VA_ARGS__); \
         } \
     } while (0)
 
+/**
+ * Logs a formatted message about a single allocator call.
+ *
+ * Example Usage:
+ * LOG("FREE request at %p\n", ptr);
+ */
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG(fmt, ...) LOG_AT(LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
+#else
+#define LOG(fmt, ...) LOG_NONE(fmt, ##__VA_ARGS__)
+#endif
+
+/**
+ * Logs a formatted message about memory being mapped or unmapped.
+ */
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(fmt, ...) LOG_AT(LOG_LEVEL_INFO, fmt, ##__VA_ARGS__)
+#else
+#define LOG_INFO(fmt, ...) LOG_NONE(fmt, ##__VA_ARGS__)
+#endif
+
+/**
+ * Logs a formatted message about an unexpected condition.
+ */
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(fmt, ...) LOG_AT(LOG_LEVEL_ERROR, fmt, ##__VA_ARGS__)
+#else
+#define LOG_ERROR(fmt, ...) LOG_NONE(fmt, ##__VA_ARGS__)
+#endif
+
+/**
+ * Logs an unformatted message (a string literal).
+ *
+ * Example Usage:
+ * LOGP("Hello world!\n");
+ */
+#define LOGP(str) LOG(str)
+
 #endif
@@ -0,0 +1,164 @@
+/**
+ * @file new.cpp
+ *
+ * Replacement global operators new and delete, so C++ programs reach the
+ * allocator directly instead of through libstdc++'s operators and malloc.
+ * Every form is covered: plain and array, nothrow, sized delete, and the
+ * std::align_val_t aligned forms. Sized deletes pass the size on, which
+ * lets small objects skip their slab header; aligned news are placed at
+ * their boundary rather than rounded up to a multiple of it.
+ */
+
+#include <cstddef>
+#include <new>
+#include "new.h"
+
+/**
+ * Allocates memory the way operator new must: on failure, the new handler
+ * is called to make room and the allocation retried, until there is no
+ * handler left and std::bad_alloc is thrown.
+ * @param size - size of the memory segment to allocate.
+ * @param alignment - required alignment (0: none).
+ * @returns pointer to the memory.
+ */
+static void *new_throw(std::size_t size, std::size_t alignment)
+{
+    void *ptr;
+    std::new_handler handler;
+
+    while ((ptr = allocator_new(size, alignment)) == nullptr) {
+        handler = std::get_new_handler();
+        if (handler == nullptr) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+    return ptr;
+}
+
+/**
+ * Allocates memory the way the nothrow operator new must: like new_throw,
+ * but returning nullptr where it would throw.
+ * @param size - size of the memory segment to allocate.
+ * @param alignment - required alignment (0: none).
+ * @returns pointer to the memory, or nullptr on failure.
+ */
+static void *new_nothrow(std::size_t size, std::size_t alignment) noexcept
+{
+    try {
+        return new_throw(size, alignment);
+    }
+    catch (...) {
+        return nullptr;
+    }
+}
+
+/* -- Allocation -- */
+
+void *operator new(std::size_t size)
+{
+    return new_throw(size, 0);
+}
+
+void *operator new[](std::size_t size)
+{
+    return new_throw(size, 0);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+    return new_nothrow(size, 0);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept
+{
+    return new_nothrow(size, 0);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment)
+{
+    return new_throw(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment)
+{
+    return new_throw(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment,
+        const std::nothrow_t &) noexcept
+{
+    return new_nothrow(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment,
+        const std::nothrow_t &) noexcept
+{
+    return new_nothrow(size, static_cast<std::size_t>(alignment));
+}
+
+/* -- Deallocation -- */
+
+void operator delete(void *ptr) noexcept
+{
+    allocator_delete(ptr, 0, 0);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+    allocator_delete(ptr, 0, 0);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept
+{
+    allocator_delete(ptr, 0, 0);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept
+{
+    allocator_delete(ptr, 0, 0);
+}
+
+void operator delete(void *ptr, std::size_t size) noexcept
+{
+    allocator_delete(ptr, size, 0);
+}
+
+void operator delete[](void *ptr, std::size_t size) noexcept
+{
+    allocator_delete(ptr, size, 0);
+}
+
+void operator delete(void *ptr, std::align_val_t alignment) noexcept
+{
+    allocator_delete(ptr, 0, static_cast<std::size_t>(alignment));
+}
+
+void operator delete[](void *ptr, std::align_val_t alignment) noexcept
+{
+    allocator_delete(ptr, 0, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void *ptr, std::align_val_t alignment,
+        const std::nothrow_t &) noexcept
+{
+    allocator_delete(ptr, 0, static_cast<std::size_t>(alignment));
+}
+
+void operator delete[](void *ptr, std::align_val_t alignment,
+        const std::nothrow_t &) noexcept
+{
+    allocator_delete(ptr, 0, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void *ptr, std::size_t size,
+        std::align_val_t alignment) noexcept
+{
+    allocator_delete(ptr, size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete[](void *ptr, std::size_t size,
+        std::align_val_t alignment) noexcept
+{
+    allocator_delete(ptr, size, static_cast<std::size_t>(alignment));
+}
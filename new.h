@@ -0,0 +1,40 @@
+/**
+ * @file new.h
+ *
+ * Entry points the C++ operators new and delete (new.cpp) call. They are
+ * hidden, so the operators reach the allocator without going through the
+ * PLT, and so never through malloc and free.
+ */
+
+#ifndef NEW_H
+#define NEW_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Allocates memory for operator new.
+ * @param size - size of the memory segment to allocate.
+ * @param alignment - required alignment, a power of two (0: none).
+ * @returns pointer to the memory, or NULL if the heap is exhausted.
+ */
+void *allocator_new(size_t size, size_t alignment)
+    __attribute__((visibility("hidden")));
+
+/**
+ * Releases memory for operator delete.
+ * @param ptr - memory to release, or NULL.
+ * @param size - size passed to operator new (0: unknown).
+ * @param alignment - alignment passed to operator new (0: none).
+ */
+void allocator_delete(void *ptr, size_t size, size_t alignment)
+    __attribute__((visibility("hidden")));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,85 @@
+/**
+ * @file snapshot.h
+ *
+ * Format of the binary heap snapshots written by heap_snapshot_write, shared
+ * by the allocator and the snapdecode tool (tools/snapdecode.c).
+ *
+ * A snapshot starts with a snapshot_header. Its entries follow, then its name
+ * table: the NUL-terminated names of the blocks, starting with an empty one
+ * that unnamed blocks point at.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+
+/** First bytes of every binary heap snapshot. */
+#define SNAPSHOT_MAGIC "ALLOCSNP"
+
+/** Format version, bumped on incompatible changes. */
+#define SNAPSHOT_VERSION 1
+
+/** Kinds of heap snapshot entries. */
+enum snapshot_type {
+    SNAPSHOT_REGION = 1, /*!< A region; its blocks follow it */
+    SNAPSHOT_BLOCK,      /*!< A block of the region before it */
+};
+
+/**
+ * A region or block as seen by a heap snapshot. Entries are in the order
+ * write_memory prints them: by arena, then in region and block list order.
+ */
+struct snapshot_entry {
+    /** Address of the region header or block header. */
+    uint64_t addr;
+
+    /** Size in bytes: of the whole region, or of the block and its slack. */
+    uint64_t size;
+
+    /** Bytes used by a block, header included (0: free). */
+    uint64_t usage;
+
+    /** Allocation ID of a block (0: none recorded). */
+    uint64_t alloc_id;
+
+    /** Offset of the block's name in the name table (0: unnamed). */
+    uint32_t name;
+
+    /** Arena the entry belongs to. */
+    uint16_t arena;
+
+    /** An enum snapshot_type. */
+    uint8_t type;
+
+    /** REGION_* flags of a region. */
+    uint8_t flags;
+};
+
+/**
+ * Header at the start of a binary heap snapshot.
+ */
+struct snapshot_header {
+    /** SNAPSHOT_MAGIC, without its terminating NUL. */
+    char magic[8];
+
+    /** SNAPSHOT_VERSION, and the size of a snapshot_entry. */
+    uint32_t version;
+    uint32_t entry_size;
+
+    /** Time the snapshot was taken (CLOCK_REALTIME, in nanoseconds). */
+    uint64_t time;
+
+    /** Number of entries and size of the name table in bytes. */
+    uint64_t entries;
+    uint64_t names;
+
+    /** Number of arenas in use. */
+    uint32_t arenas;
+
+    /** Size of a block header, which the requested size of a block leaves
+     *  out. */
+    uint32_t block_header;
+};
+
+#endif
@@ -0,0 +1,281 @@
+/**
+ * @file logdecode.c
+ *
+ * Turns an event log written with ALLOCATOR_LOG into the text the LOG macros
+ * describe, one line per message:
+ *
+ * allocator.c:3213:free(): FREE request at 0x7fbb48ea1050
+ *
+ * The messages of all threads are merged by time. With -t, every line is
+ * prefixed with the time since the log was started and the thread number.
+ *
+ * Usage: logdecode [-t] <log>
+ */
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../debug.h"
+
+/**
+ * Call site described in the log header.
+ */
+struct site {
+    const char *file;
+    const char *func;
+    const char *fmt;
+    uint32_t line;
+};
+
+/**
+ * A message of the log, with the thread that made it.
+ */
+struct message {
+    const struct log_record *record;
+    uint32_t thread;
+
+    /** Position in the file, which keeps messages made at once in order. */
+    size_t index;
+};
+
+/**
+ * Reads a whole file.
+ * @param path - name of the file.
+ * @param len - set to the size of the file.
+ * @returns the contents, or NULL on failure.
+ */
+static char *read_file(const char *path, size_t *len)
+{
+    FILE *fp = fopen(path, "rb");
+    size_t cap = 1 << 16, n;
+    char *data = NULL, *grown;
+
+    if (fp == NULL) {
+        return NULL;
+    }
+    *len = 0;
+    for (;;) {
+        grown = realloc(data, cap);
+        if (grown == NULL) {
+            free(data);
+            fclose(fp);
+            return NULL;
+        }
+        data = grown;
+        n = fread(data + *len, 1, cap - *len, fp);
+        *len += n;
+        if (*len < cap) {
+            break;
+        }
+        cap *= 2;
+    }
+    fclose(fp);
+    return data;
+}
+
+/**
+ * Orders messages by time, then by position in the file.
+ */
+static int message_compare(const void *a, const void *b)
+{
+    const struct message *x = a, *y = b;
+
+    if (x->record->time != y->record->time) {
+        return x->record->time < y->record->time ? -1 : 1;
+    }
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/**
+ * Prints a message, formatting each conversion of the format with the next
+ * argument. Conversions are rebuilt with the argument cast back to the type
+ * their length modifier calls for.
+ * @param fmt - format of the message.
+ * @param args - the two arguments of the record.
+ */
+static void print_message(const char *fmt, const uint64_t *args)
+{
+    char spec[32];
+    size_t len;
+    unsigned int next = 0;
+    uint64_t arg;
+    bool wide;
+
+    while (*fmt != '\0') {
+        if (*fmt != '%') {
+            putchar(*fmt++);
+            continue;
+        }
+        if (fmt[1] == '%') {
+            putchar('%');
+            fmt += 2;
+            continue;
+        }
+
+        /* Copy flags, width, precision and length up to the conversion */
+        len = strspn(fmt + 1, "-+ #0123456789.hlLqjzt") + 2;
+        if (len >= sizeof(spec) || fmt[len - 1] == '\0') {
+            fputs(fmt, stdout);
+            return;
+        }
+        memcpy(spec, fmt, len);
+        spec[len] = '\0';
+        fmt += len;
+
+        arg = next < 2 ? args[next] : 0;
+        next++;
+        wide = strpbrk(spec, "lLqjzt") != NULL;
+        switch (spec[len - 1]) {
+        case 'p':
+            printf(spec, (void *) (uintptr_t) arg);
+            break;
+        case 'd':
+        case 'i':
+            if (wide) {
+                printf(spec, (long long) arg);
+            }
+            else {
+                printf(spec, (int) arg);
+            }
+            break;
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o':
+            if (wide) {
+                printf(spec, (unsigned long long) arg);
+            }
+            else {
+                printf(spec, (unsigned int) arg);
+            }
+            break;
+        case 'c':
+            printf(spec, (int) arg);
+            break;
+        default:
+            /* Strings and floating point values aren't recorded */
+            printf("<%s>", spec);
+            break;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const struct log_header *header;
+    struct log_site_header entry;
+    struct trace_chunk chunk;
+    struct log_record *records;
+    struct message *messages;
+    struct site *sites, *site;
+    size_t len, off, end, count = 0, i, j;
+    const char *path;
+    bool times = false, color;
+    char *data;
+
+    if (argc == 3 && strcmp(argv[1], "-t") == 0) {
+        times = true;
+        path = argv[2];
+    }
+    else if (argc == 2) {
+        path = argv[1];
+    }
+    else {
+        fputs("usage: logdecode [-t] <log>\n", stderr);
+        return 1;
+    }
+
+    data = read_file(path, &len);
+    if (data == NULL) {
+        fprintf(stderr, "logdecode: cannot read '%s'\n", path);
+        return 1;
+    }
+    header = (const struct log_header *) data;
+    if (len < sizeof(*header)
+            || memcmp(header->magic, LOG_MAGIC, sizeof(header->magic)) != 0
+            || header->version != LOG_VERSION
+            || header->record_size != sizeof(struct log_record)) {
+        fprintf(stderr, "logdecode: '%s' is not a version %d log\n", path,
+                LOG_VERSION);
+        return 1;
+    }
+
+    /* Read the call sites; their strings stay in the file's buffer */
+    sites = calloc(header->sites + 1, sizeof(*sites));
+    off = sizeof(*header);
+    for (i = 0; i < header->sites; i++) {
+        if (off + sizeof(entry) > len) {
+            fprintf(stderr, "logdecode: call sites truncated\n");
+            return 1;
+        }
+        memcpy(&entry, data + off, sizeof(entry));
+        off += sizeof(entry);
+        if (off + entry.length > len || entry.length < 3
+                || data[off + entry.length - 1] != '\0') {
+            fprintf(stderr, "logdecode: call sites truncated\n");
+            return 1;
+        }
+        sites[i].line = entry.line;
+        sites[i].file = data + off;
+        sites[i].func = sites[i].file + strlen(sites[i].file) + 1;
+        sites[i].fmt = sites[i].func + strlen(sites[i].func) + 1;
+        off += entry.length;
+    }
+
+    /* Count the messages; a log cut short ends at its last whole chunk.
+     * Records are copied to aligned memory, as the site strings may have
+     * left them unaligned in the file. */
+    for (i = off; i + sizeof(chunk) <= len; i = end) {
+        memcpy(&chunk, data + i, sizeof(chunk));
+        end = i + sizeof(chunk) + chunk.count * sizeof(struct log_record);
+        if (end > len) {
+            fprintf(stderr, "logdecode: log truncated at byte %zu\n", i);
+            break;
+        }
+        count += chunk.count;
+    }
+
+    messages = calloc(count + 1, sizeof(*messages));
+    for (i = off, j = 0; j < count; i = end) {
+        memcpy(&chunk, data + i, sizeof(chunk));
+        end = i + sizeof(chunk) + chunk.count * sizeof(*records);
+        records = malloc(chunk.count * sizeof(*records) + 1);
+        memcpy(records, data + i + sizeof(chunk),
+                chunk.count * sizeof(*records));
+        for (; chunk.count > 0; chunk.count--, records++) {
+            messages[j].record = records;
+            messages[j].thread = chunk.thread;
+            messages[j].index = j;
+            j++;
+        }
+    }
+    qsort(messages, count, sizeof(*messages), message_compare);
+
+    color = isatty(STDOUT_FILENO);
+    for (i = 0; i < count; i++) {
+        if (messages[i].record->site >= header->sites) {
+            continue;
+        }
+        site = &sites[messages[i].record->site];
+        if (times) {
+            printf("%14.9f %3u ", messages[i].record->time / 1e9,
+                    messages[i].thread);
+        }
+#if DEBUG_COLOR
+        if (color) {
+            printf("%s%s%s:%u:%s%s()%s: ", COLOR_RED, site->file,
+                    COLOR_RESET, site->line, COLOR_BLUE, site->func,
+                    COLOR_RESET);
+            print_message(site->fmt, messages[i].record->args);
+            continue;
+        }
+#endif
+        printf("%s:%u:%s(): ", site->file, site->line, site->func);
+        print_message(site->fmt, messages[i].record->args);
+    }
+    return 0;
+}
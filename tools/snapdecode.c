@@ -0,0 +1,89 @@
+/**
+ * @file snapdecode.c
+ *
+ * Turns a binary heap snapshot (heap_snapshot_write with SNAPSHOT_BINARY)
+ * into the text write_memory prints, which the visualizer reads:
+ *
+ * -- Current Memory State --
+ * [REGION] 0x7f5aa0b0d000-0x7f5aa0b1d000 65536
+ * [BLOCK]  0x7f5aa0b0d040-0x7f5aa0b0d1a0 (0) 'a' 352 128 112
+ *
+ * Usage: snapdecode <snapshot>
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../snapshot.h"
+
+int main(int argc, char *argv[])
+{
+    struct snapshot_header header;
+    struct snapshot_entry entry;
+    uint32_t arena = UINT32_MAX;
+    char *names;
+    FILE *fp;
+    uint64_t i;
+
+    if (argc != 2) {
+        fputs("usage: snapdecode <snapshot>\n", stderr);
+        return 1;
+    }
+    fp = fopen(argv[1], "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "snapdecode: cannot read '%s'\n", argv[1]);
+        return 1;
+    }
+    if (fread(&header, sizeof(header), 1, fp) != 1
+            || memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0
+            || header.version != SNAPSHOT_VERSION
+            || header.entry_size != sizeof(entry)) {
+        fprintf(stderr, "snapdecode: '%s' is not a version %d snapshot\n",
+                argv[1], SNAPSHOT_VERSION);
+        return 1;
+    }
+
+    /* The name table follows the entries; read it first */
+    names = malloc(header.names + 1);
+    if (names == NULL
+            || fseek(fp, header.entries * sizeof(entry), SEEK_CUR) != 0
+            || fread(names, 1, header.names, fp) != header.names
+            || fseek(fp, sizeof(header), SEEK_SET) != 0) {
+        fprintf(stderr, "snapdecode: snapshot truncated\n");
+        return 1;
+    }
+    names[header.names] = '\0';
+
+    puts("-- Current Memory State --");
+    for (i = 0; i < header.entries; i++) {
+        if (fread(&entry, sizeof(entry), 1, fp) != 1) {
+            fprintf(stderr, "snapdecode: snapshot truncated\n");
+            return 1;
+        }
+        if (entry.name >= header.names) {
+            entry.name = 0;
+        }
+        if (header.arenas > 1 && entry.arena != arena) {
+            arena = entry.arena;
+            printf("[ARENA]  %u\n", arena);
+        }
+        if (entry.type == SNAPSHOT_REGION) {
+            printf("[REGION] %p-%p %llu\n", (void *) (uintptr_t) entry.addr,
+                    (void *) (uintptr_t) (entry.addr + entry.size),
+                    (unsigned long long) entry.size);
+            continue;
+        }
+        printf("[BLOCK]  %p-%p (%llu) '%s' %llu %llu %llu\n",
+                (void *) (uintptr_t) entry.addr,
+                (void *) (uintptr_t) (entry.addr + entry.size),
+                (unsigned long long) entry.alloc_id, names + entry.name,
+                (unsigned long long) entry.size,
+                (unsigned long long) entry.usage,
+                (unsigned long long) (entry.usage == 0
+                    ? 0 : entry.usage - header.block_header));
+    }
+    fclose(fp);
+    free(names);
+    return 0;
+}
@@ -0,0 +1,82 @@
+/**
+ * @file trace.h
+ *
+ * Format of the allocation traces written when ALLOCATOR_TRACE is set, shared
+ * by the allocator and the replay tool (bench/replay.c).
+ *
+ * A trace starts with a trace_header. Chunks follow, each a trace_chunk and
+ * the records one thread made since its previous chunk, in call order. The
+ * chunks of different threads interleave; merging them by timestamp gives the
+ * order of the calls in the process.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/** First bytes of every trace file. */
+#define TRACE_MAGIC "ALLOCTRC"
+
+/** Format version, bumped on incompatible changes. */
+#define TRACE_VERSION 1
+
+/** Largest size a record can hold; bigger sizes are clamped to it. */
+#define TRACE_SIZE_MAX (((uint64_t) 1 << 56) - 1)
+
+/**
+ * Calls recorded in a trace.
+ */
+enum trace_op {
+    TRACE_MALLOC = 1, /*!< malloc, malloc_name and malloc_tag */
+    TRACE_CALLOC,     /*!< calloc; size is the total size */
+    TRACE_REALLOC,    /*!< realloc; arg is the pointer passed in */
+    TRACE_MEMALIGN,   /*!< aligned allocations; arg is the alignment */
+    TRACE_FREE,       /*!< free of a non-NULL pointer */
+};
+
+/**
+ * Header at the start of a trace file.
+ */
+struct trace_header {
+    /** TRACE_MAGIC, without its terminating NUL. */
+    char magic[8];
+
+    /** TRACE_VERSION. */
+    uint32_t version;
+
+    /** Size of a trace_record, so readers can reject foreign layouts. */
+    uint32_t record_size;
+};
+
+/**
+ * Header of a run of records made by one thread.
+ */
+struct trace_chunk {
+    /** Number of the thread, starting from 1 (0: unknown). */
+    uint32_t thread;
+
+    /** Number of records following the header. */
+    uint32_t count;
+};
+
+/**
+ * A single call. Allocations are stamped once they have returned and frees
+ * when they start, so a pointer is never seen again before it was freed.
+ */
+struct trace_record {
+    /** Nanoseconds since the trace was started. */
+    uint64_t time;
+
+    /** Pointer returned (allocations) or passed in (free). */
+    uint64_t ptr;
+
+    /** Second argument of the call; see enum trace_op. */
+    uint64_t arg;
+
+    /** Requested size, and the call (an enum trace_op). */
+    uint64_t size : 56;
+    uint64_t op : 8;
+};
+
+#endif